@@ -0,0 +1,173 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <list>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <ctime>
+
+const uint16_t TYPE_A = 1;
+const uint16_t TYPE_NS = 2;
+const uint16_t TYPE_CNAME = 5;
+const uint16_t TYPE_SOA = 6;
+const uint16_t TYPE_AAAA = 28;
+// Отрицательная запись "имени не существует" (NXDOMAIN) относится ко всем типам сразу.
+const uint16_t TYPE_NXDOMAIN = 0;
+
+const size_t MAX_CACHE_ENTRIES = 100000;
+// Кэш общий для потоков сервера: ключи распределены по CACHE_SHARDS частям со своими мьютексами,
+// поэтому потоки редко ждут друг друга.
+const size_t CACHE_SHARDS = 16;
+// TTL записей ограничивается сверху, отрицательные ответы хранятся не дольше трех часов (RFC 2308).
+const uint32_t MAX_CACHE_TTL = 86400;
+const uint32_t MAX_NEGATIVE_TTL = 10800;
+
+// Ресурсная запись. Имена хранятся в нижнем регистре без завершающей точки (корень — "").
+// data: для A и AAAA — адрес в сетевом порядке байт, для NS и CNAME — имя, на которое ссылается запись,
+// для SOA — rdata в wire-формате без указателей сжатия (ее можно вставить в любое сообщение).
+struct DnsRecord {
+    std::string name;
+    uint16_t type;
+    uint32_t ttl;
+    std::string data;
+};
+
+// Набор записей одного имени и типа (RRset) или отрицательный ответ (negative: NXDOMAIN или
+// нет записей такого типа) вместе с SOA зоны из ответа (authority). Срок хранения — абсолютное время.
+struct CacheEntry {
+    std::vector<DnsRecord> records;
+    std::vector<DnsRecord> authority;
+    bool negative = false;
+    time_t expires = 0;
+};
+
+struct CacheNode {
+    std::string key;
+    CacheEntry entry;
+};
+
+// Часть кэша: LRU-список записей (недавно использованные в начале) и индекс по ключу.
+// Вытеснение при заполнении — удаление из конца списка за O(1).
+struct CacheShard {
+    std::mutex mutex;
+    std::list<CacheNode> lru;
+    std::unordered_map<std::string, std::list<CacheNode>::iterator> index;
+};
+
+struct DnsCache {
+    CacheShard shards[CACHE_SHARDS];
+    std::atomic<unsigned long long> hits{0};
+    std::atomic<unsigned long long> misses{0};
+};
+
+std::string cacheKey(const std::string& name, uint16_t type) {
+    return name + "/" + std::to_string(type);
+}
+
+CacheShard& cacheShard(DnsCache& cache, const std::string& key) {
+    return cache.shards[std::hash<std::string>{}(key) % CACHE_SHARDS];
+}
+
+void eraseCacheNode(CacheShard& shard, std::list<CacheNode>::iterator it) {
+    shard.index.erase(it->key);
+    shard.lru.erase(it);
+}
+
+// Запись для сохранения по ключу: существующая переносится в начало LRU, новая добавляется туда же.
+// Если часть кэша заполнена, вытесняется давно не использованная запись из конца списка
+// (устаревшие записи, которые никто не запрашивает, тоже оказываются там). Вызывается под shard.mutex.
+CacheEntry& storeCacheEntry(CacheShard& shard, const std::string& key) {
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+        return found->second->entry;
+    }
+    if (shard.lru.size() >= MAX_CACHE_ENTRIES / CACHE_SHARDS) eraseCacheNode(shard, std::prev(shard.lru.end()));
+    shard.lru.push_front({key, CacheEntry()});
+    shard.index[key] = shard.lru.begin();
+    return shard.lru.front().entry;
+}
+
+size_t cacheSize(DnsCache& cache) {
+    size_t size = 0;
+    for (CacheShard& shard : cache.shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        size += shard.lru.size();
+    }
+    return size;
+}
+
+// Сохраняет RRset; срок хранения — наименьший TTL его записей.
+void cacheRecords(DnsCache& cache, const std::string& name, uint16_t type, const std::vector<DnsRecord>& records) {
+    if (records.empty()) return;
+    uint32_t ttl = MAX_CACHE_TTL;
+    for (const DnsRecord& record : records) ttl = std::min(ttl, record.ttl);
+    if (ttl == 0) return;
+    time_t now = time(nullptr);
+    std::string key = cacheKey(name, type);
+    CacheShard& shard = cacheShard(cache, key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    CacheEntry& entry = storeCacheEntry(shard, key);
+    entry.records = records;
+    entry.authority.clear();
+    entry.negative = false;
+    entry.expires = now + ttl;
+}
+
+// Отрицательный ответ хранится min(TTL SOA, SOA MINIMUM) секунд (RFC 2308, раздел 5) вместе с SOA,
+// которую нужно вернуть клиенту, чтобы и он мог сохранить отрицательный ответ.
+void cacheNegative(DnsCache& cache, const std::string& name, uint16_t type, uint32_t ttl,
+                   const std::vector<DnsRecord>& authority) {
+    ttl = std::min(ttl, MAX_NEGATIVE_TTL);
+    if (ttl == 0) return;
+    time_t now = time(nullptr);
+    std::string key = cacheKey(name, type);
+    CacheShard& shard = cacheShard(cache, key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    CacheEntry& entry = storeCacheEntry(shard, key);
+    entry.records.clear();
+    entry.authority = authority;
+    entry.negative = true;
+    entry.expires = now + ttl;
+}
+
+// Копирует действующую запись кэша в entry; false, если ее нет. Копия, а не указатель: после
+// снятия блокировки запись может удалить другой поток. Для отрицательного ответа records пуст.
+bool cacheLookup(DnsCache& cache, const std::string& name, uint16_t type, CacheEntry& entry) {
+    std::string key = cacheKey(name, type);
+    CacheShard& shard = cacheShard(cache, key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found == shard.index.end()) return false;
+    if (found->second->entry.expires <= time(nullptr)) {
+        eraseCacheNode(shard, found->second);
+        return false;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+    entry = found->second->entry;
+    return true;
+}
+
+// Сколько секунд записи осталось жить в кэше: так TTL выдается клиенту.
+uint32_t remainingTtl(const CacheEntry& entry) {
+    time_t now = time(nullptr);
+    return entry.expires > now ? (uint32_t)(entry.expires - now) : 0;
+}
+
+// name совпадает с zone или находится внутри нее ("www.example.com" внутри "com" и "").
+bool inZone(const std::string& name, const std::string& zone) {
+    if (zone.empty() || name == zone) return true;
+    return name.size() > zone.size() && name.compare(name.size() - zone.size(), zone.size(), zone) == 0 &&
+           name[name.size() - zone.size() - 1] == '.';
+}
+
+// Родительская зона: "www.example.com" -> "example.com" -> "com" -> "".
+std::string parentZone(const std::string& name) {
+    size_t dot = name.find('.');
+    return dot == std::string::npos ? "" : name.substr(dot + 1);
+}
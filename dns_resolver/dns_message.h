@@ -0,0 +1,358 @@
+#pragma once
+
+#include "dns_cache.h"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <arpa/inet.h>
+
+#pragma pack(push, 1)
+struct DNS_HEADER {
+    uint16_t id;
+    uint16_t flags;
+    uint16_t qdcount;
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+};
+
+struct QUESTION {
+    uint16_t qtype;
+    uint16_t qclass;
+};
+#pragma pack(pop)
+
+void domainToDnsFormat(unsigned char* dns, const std::string& hostname) {
+    std::string domain = hostname;
+    size_t start = 0, end;
+    while ((end = domain.find('.', start)) != std::string::npos) {
+        std::string label = domain.substr(start, end - start);
+        *dns++ = label.length();
+        memcpy(dns, label.c_str(), label.length());
+        dns += label.length();
+        start = end + 1;
+    }
+    std::string label = domain.substr(start);
+    *dns++ = label.length();
+    memcpy(dns, label.c_str(), label.length());
+    dns += label.length();
+
+    *dns++ = '\0';
+}
+
+// Ответ сервера, разобранный по секциям. negative_ttl — срок хранения отрицательного ответа
+// из SOA в секции authority (0, если SOA нет). По id и вопросу ответ сопоставляется с запросом.
+struct DnsResponse {
+    uint16_t id = 0;
+    uint16_t flags = 0;
+    std::string question;
+    uint16_t question_type = 0;
+    std::vector<DnsRecord> answers;
+    std::vector<DnsRecord> authority;
+    std::vector<DnsRecord> additional;
+    uint32_t negative_ttl = 0;
+};
+
+std::string normalizeName(std::string name) {
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+    while (!name.empty() && name.back() == '.') name.pop_back();
+    return name;
+}
+
+// Имя без завершающей точки, которое можно закодировать в вопрос: не длиннее 253 символов,
+// каждая метка — от 1 до 63 байт (RFC 1035, 2.3.4). Пустую метку ("foo..test") или слишком
+// длинную domainToDnsFormat превратил бы в другой или испорченный вопрос.
+bool isValidName(const std::string& name) {
+    if (name.empty() || name.size() > 253) return false;
+    size_t start = 0;
+    while (true) {
+        size_t end = name.find('.', start);
+        size_t length = (end == std::string::npos ? name.size() : end) - start;
+        if (length == 0 || length > 63) return false;
+        if (end == std::string::npos) return true;
+        start = end + 1;
+    }
+}
+
+// Имя в wire-формате вместе с байтами длин меток не длиннее 255 байт (RFC 1035, 3.1).
+const size_t MAX_NAME_WIRE_LENGTH = 255;
+// Указатели сжатия ведут только назад, и их не больше MAX_NAME_POINTERS на одно имя:
+// враждебный ответ не может зациклить разбор или заставить обходить сообщение много раз.
+const int MAX_NAME_POINTERS = 32;
+
+// Имя, декодированное в буфер на стеке: метки через точку, в нижнем регистре, без завершающей
+// точки (корень — пустая строка).
+struct DnsName {
+    char text[MAX_NAME_WIRE_LENGTH];
+    size_t length = 0;
+};
+
+// Запись сообщения без копирования: rdata указывает в буфер сообщения и живет, пока жив он.
+struct DnsRecordView {
+    DnsName name;
+    uint16_t type;
+    uint16_t record_class;
+    uint32_t ttl;
+    const unsigned char* rdata;
+    uint16_t rdlength;
+    size_t rdata_offset;
+};
+
+enum DnsSection {
+    SECTION_ANSWER,
+    SECTION_AUTHORITY,
+    SECTION_ADDITIONAL,
+    SECTION_END
+};
+
+// Однопроходный разбор сообщения: заголовок и первый вопрос читаются в beginParse, записи —
+// по одной в nextRecord. Все чтения проверяют границы буфера, malformed отмечает испорченное сообщение.
+struct DnsParser {
+    const unsigned char* buffer = nullptr;
+    size_t length = 0;
+    size_t offset = 0;
+    uint16_t id = 0;
+    uint16_t flags = 0;
+    DnsName question;
+    uint16_t question_type = 0;
+    uint16_t counts[SECTION_END] = {};
+    int section = SECTION_ANSWER;
+    uint16_t index = 0;
+    bool malformed = false;
+};
+
+uint16_t read16(const unsigned char* p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+uint32_t read32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Декодирует имя, начинающееся с offset, и сдвигает offset за имя (за первый указатель сжатия,
+// если он есть). Метки с точкой внутри отвергаются: в текстовом виде их не отличить от двух меток.
+bool readName(const unsigned char* buffer, size_t length, size_t& offset, DnsName& name) {
+    size_t pos = offset;
+    size_t wire_length = 0;
+    int pointers = 0;
+    bool jumped = false;
+    name.length = 0;
+    while (true) {
+        if (pos >= length) return false;
+        unsigned char label_length = buffer[pos];
+        if ((label_length & 0xC0) == 0xC0) {
+            if (pos + 1 >= length) return false;
+            size_t target = (label_length & 0x3F) << 8 | buffer[pos + 1];
+            if (target >= pos || ++pointers > MAX_NAME_POINTERS) return false;
+            if (!jumped) offset = pos + 2;
+            jumped = true;
+            pos = target;
+            continue;
+        }
+        // 0x40 и 0x80 — устаревшие расширенные метки (RFC 6891), их не бывает в ответах.
+        if (label_length & 0xC0) return false;
+        wire_length += label_length + 1;
+        if (wire_length > MAX_NAME_WIRE_LENGTH) return false;
+        if (label_length == 0) break;
+        if (pos + 1 + label_length > length) return false;
+        if (name.length > 0) name.text[name.length++] = '.';
+        for (size_t i = pos + 1; i <= pos + label_length; ++i) {
+            unsigned char c = buffer[i];
+            if (c == '.') return false;
+            name.text[name.length++] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+        }
+        pos += 1 + label_length;
+    }
+    if (!jumped) offset = pos + 1;
+    return true;
+}
+
+bool nameEquals(const DnsName& name, const std::string& text) {
+    return name.length == text.size() && memcmp(name.text, text.data(), name.length) == 0;
+}
+
+std::string nameString(const DnsName& name) {
+    return std::string(name.text, name.length);
+}
+
+bool beginParse(DnsParser& parser, const unsigned char* buffer, size_t length) {
+    parser = DnsParser();
+    parser.buffer = buffer;
+    parser.length = length;
+    if (length < sizeof(DNS_HEADER)) return false;
+    parser.id = read16(buffer);
+    parser.flags = read16(buffer + 2);
+    uint16_t qdcount = read16(buffer + 4);
+    parser.counts[SECTION_ANSWER] = read16(buffer + 6);
+    parser.counts[SECTION_AUTHORITY] = read16(buffer + 8);
+    parser.counts[SECTION_ADDITIONAL] = read16(buffer + 10);
+    parser.offset = sizeof(DNS_HEADER);
+    DnsName question;
+    for (uint16_t i = 0; i < qdcount; ++i) {
+        if (!readName(buffer, length, parser.offset, i == 0 ? parser.question : question)) return false;
+        if (parser.offset + sizeof(QUESTION) > length) return false;
+        if (i == 0) parser.question_type = read16(buffer + parser.offset);
+        parser.offset += sizeof(QUESTION);
+    }
+    return true;
+}
+
+// Читает следующую запись в record, section — ее секция. Возвращает false, когда записи
+// кончились или сообщение испорчено (тогда parser.malformed).
+bool nextRecord(DnsParser& parser, DnsRecordView& record, int& section) {
+    while (parser.section < SECTION_END && parser.index >= parser.counts[parser.section]) {
+        parser.section++;
+        parser.index = 0;
+    }
+    if (parser.section == SECTION_END) return false;
+    // Фиксированная часть записи: type, class, ttl, rdlength — 10 байт.
+    if (!readName(parser.buffer, parser.length, parser.offset, record.name) || parser.offset + 10 > parser.length) {
+        parser.malformed = true;
+        return false;
+    }
+    const unsigned char* fixed = parser.buffer + parser.offset;
+    record.type = read16(fixed);
+    record.record_class = read16(fixed + 2);
+    record.ttl = read32(fixed + 4);
+    record.rdlength = read16(fixed + 8);
+    record.rdata_offset = parser.offset + 10;
+    if (record.rdata_offset + record.rdlength > parser.length) {
+        parser.malformed = true;
+        return false;
+    }
+    record.rdata = parser.buffer + record.rdata_offset;
+    parser.offset = record.rdata_offset + record.rdlength;
+    section = parser.section;
+    parser.index++;
+    return true;
+}
+
+// Имя в rdata записи (NS, CNAME), которое должно целиком лежать внутри rdata.
+bool readRdataName(const DnsParser& parser, const DnsRecordView& record, DnsName& name) {
+    size_t offset = record.rdata_offset;
+    return readName(parser.buffer, record.rdata_offset + record.rdlength, offset, name) &&
+           offset <= record.rdata_offset + record.rdlength;
+}
+
+void appendU16(std::string& message, uint16_t value) {
+    message.push_back(value >> 8);
+    message.push_back(value & 0xFF);
+}
+
+void appendU32(std::string& message, uint32_t value) {
+    appendU16(message, value >> 16);
+    appendU16(message, value & 0xFFFF);
+}
+
+void appendWireName(std::string& message, const std::string& name) {
+    unsigned char wire[MAX_NAME_WIRE_LENGTH + 2];
+    domainToDnsFormat(wire, name);
+    message.append((const char*)wire, strlen((const char*)wire) + 1);
+}
+
+// rdata SOA (MNAME, RNAME и пять 32-битных полей) без указателей сжатия: имена раскрываются.
+bool readSoaData(const DnsParser& parser, const DnsRecordView& record, std::string& data) {
+    size_t end = record.rdata_offset + record.rdlength;
+    size_t offset = record.rdata_offset;
+    DnsName names[2];
+    for (DnsName& name : names) {
+        if (!readName(parser.buffer, end, offset, name)) return false;
+    }
+    if (offset + 20 != end) return false;
+    data.clear();
+    for (const DnsName& name : names) appendWireName(data, nameString(name));
+    data.append((const char*)parser.buffer + offset, 20);
+    return true;
+}
+
+// Переводит записи в DnsRecord для кэша. Адреса неверной длины и имена, которые не удается
+// разобрать, делают ответ испорченным.
+bool parseRecords(DnsParser& parser, DnsResponse& response) {
+    response.id = parser.id;
+    response.flags = parser.flags;
+    response.question = nameString(parser.question);
+    response.question_type = parser.question_type;
+    std::vector<DnsRecord>* sections[SECTION_END] = {&response.answers, &response.authority, &response.additional};
+    DnsRecordView view;
+    DnsName target;
+    int section;
+    while (nextRecord(parser, view, section)) {
+        DnsRecord record{nameString(view.name), view.type, std::min<uint32_t>(view.ttl, MAX_CACHE_TTL), ""};
+        if (view.type == TYPE_A || view.type == TYPE_AAAA) {
+            if (view.rdlength != (view.type == TYPE_A ? 4 : 16)) return false;
+            record.data.assign((const char*)view.rdata, view.rdlength);
+        } else if (view.type == TYPE_NS || view.type == TYPE_CNAME) {
+            if (!readRdataName(parser, view, target)) return false;
+            record.data = nameString(target);
+        } else if (view.type == TYPE_SOA) {
+            // SOA с неразборчивой rdata не делает ответ испорченным, но и не используется.
+            if (readSoaData(parser, view, record.data)) {
+                // Последнее поле SOA — MINIMUM, TTL отрицательных ответов зоны.
+                uint32_t minimum = read32(view.rdata + view.rdlength - 4);
+                response.negative_ttl = std::min(record.ttl, minimum);
+            }
+        }
+        sections[section]->push_back(std::move(record));
+    }
+    return !parser.malformed;
+}
+
+bool parseResponse(const unsigned char* buffer, size_t length, DnsResponse& response) {
+    DnsParser parser;
+    return beginParse(parser, buffer, length) && parseRecords(parser, response);
+}
+
+std::string formatAddress(const DnsRecord& record) {
+    char address[INET6_ADDRSTRLEN] = "";
+    if (record.type == TYPE_A && record.data.size() == 4) {
+        inet_ntop(AF_INET, record.data.data(), address, sizeof(address));
+    } else if (record.type == TYPE_AAAA && record.data.size() == 16) {
+        inet_ntop(AF_INET6, record.data.data(), address, sizeof(address));
+    }
+    return address;
+}
+
+// Дописывает запись к сообщению. Имя, совпадающее с вопросом, заменяется указателем сжатия
+// на вопрос (он всегда сразу за заголовком).
+void appendResourceRecord(std::string& message, const DnsRecord& record, const std::string& question) {
+    if (record.name == question) {
+        appendU16(message, 0xC000 | sizeof(DNS_HEADER));
+    } else {
+        appendWireName(message, record.name);
+    }
+    appendU16(message, record.type);
+    appendU16(message, 1);
+    appendU32(message, record.ttl);
+    if (record.type == TYPE_CNAME || record.type == TYPE_NS) {
+        std::string target;
+        appendWireName(target, record.data);
+        appendU16(message, target.size());
+        message += target;
+    } else {
+        appendU16(message, record.data.size());
+        message += record.data;
+    }
+}
+
+// Собирает запрос (RD установлен, как и раньше) в buf и возвращает его длину.
+int buildQuery(unsigned char* buf, uint16_t id, const std::string& name, int query_type) {
+    DNS_HEADER *dns = (DNS_HEADER*)buf;
+    dns->id = htons(id);
+    dns->flags = htons(0x0100);
+    dns->qdcount = htons(1);
+    dns->ancount = 0;
+    dns->nscount = 0;
+    dns->arcount = 0;
+
+    unsigned char* qname = &buf[sizeof(DNS_HEADER)];
+    domainToDnsFormat(qname, name);
+    size_t qname_len = strlen((const char*)qname) + 1;
+
+    QUESTION *qinfo = (QUESTION*)&buf[sizeof(DNS_HEADER) + qname_len];
+    qinfo->qtype = htons(query_type);
+    qinfo->qclass = htons(1);
+
+    return sizeof(DNS_HEADER) + qname_len + sizeof(QUESTION);
+}
@@ -0,0 +1,285 @@
+#include "dns_message.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+
+using Clock = std::chrono::steady_clock;
+
+using Message = std::vector<unsigned char>;
+
+// Сообщения из файла записи резолвера (-w): двухбайтная длина и сообщение, как в DNS поверх TCP.
+bool loadCapture(const std::string& path, std::vector<Message>& corpus) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        perror("Failed to open capture file");
+        return false;
+    }
+    unsigned char prefix[2];
+    while (file.read((char*)prefix, 2)) {
+        Message message(read16(prefix));
+        if (!file.read((char*)message.data(), message.size())) break;
+        corpus.push_back(std::move(message));
+    }
+    return true;
+}
+
+void append16(Message& message, uint16_t value) {
+    message.push_back(value >> 8);
+    message.push_back(value & 0xFF);
+}
+
+void append32(Message& message, uint32_t value) {
+    append16(message, value >> 16);
+    append16(message, value & 0xFFFF);
+}
+
+void appendName(Message& message, const std::string& name) {
+    unsigned char wire[MAX_NAME_WIRE_LENGTH + 2];
+    domainToDnsFormat(wire, name);
+    message.insert(message.end(), wire, wire + strlen((const char*)wire) + 1);
+}
+
+// Запись, имя которой — указатель сжатия на name_offset, или полное имя, если name_offset == 0.
+void appendRecord(Message& message, const std::string& name, uint16_t name_offset, uint16_t type, uint32_t ttl,
+                  const Message& rdata) {
+    if (name_offset != 0) {
+        append16(message, 0xC000 | name_offset);
+    } else {
+        appendName(message, name);
+    }
+    append16(message, type);
+    append16(message, 1);
+    append32(message, ttl);
+    append16(message, rdata.size());
+    message.insert(message.end(), rdata.begin(), rdata.end());
+}
+
+Message responseHeader(const std::string& question, uint16_t type, uint16_t flags, uint16_t ancount,
+                       uint16_t nscount, uint16_t arcount) {
+    Message message;
+    append16(message, 0x1234);
+    append16(message, flags);
+    append16(message, 1);
+    append16(message, ancount);
+    append16(message, nscount);
+    append16(message, arcount);
+    appendName(message, question);
+    append16(message, type);
+    append16(message, 1);
+    return message;
+}
+
+Message nameData(const std::string& name) {
+    Message data;
+    appendName(data, name);
+    return data;
+}
+
+// Типичные ответы на случай, когда файла записи нет: делегирование корня (13 NS с glue), ответ с адресами,
+// NXDOMAIN с SOA, CNAME и большой ответ с сотней адресов.
+std::vector<Message> builtinCorpus() {
+    std::vector<Message> corpus;
+    const char* letters = "abcdefghijklm";
+
+    Message referral = responseHeader("www.example.com", TYPE_A, 0x8000, 0, 13, 13);
+    for (int i = 0; i < 13; ++i) {
+        appendRecord(referral, "com", 0, TYPE_NS, 172800, nameData(std::string(1, letters[i]) + ".gtld-servers.net"));
+    }
+    for (int i = 0; i < 13; ++i) {
+        appendRecord(referral, std::string(1, letters[i]) + ".gtld-servers.net", 0, TYPE_A, 172800, {192, 5, 6, (unsigned char)(30 + i)});
+    }
+    corpus.push_back(referral);
+
+    Message answer = responseHeader("www.example.com", TYPE_A, 0x8400, 2, 0, 0);
+    appendRecord(answer, "", sizeof(DNS_HEADER), TYPE_A, 300, {93, 184, 216, 34});
+    appendRecord(answer, "", sizeof(DNS_HEADER), TYPE_A, 300, {93, 184, 216, 35});
+    corpus.push_back(answer);
+
+    Message nxdomain = responseHeader("missing.example.com", TYPE_A, 0x8403, 0, 1, 0);
+    Message soa = nameData("ns.icann.org");
+    Message mailbox = nameData("noc.dns.icann.org");
+    soa.insert(soa.end(), mailbox.begin(), mailbox.end());
+    for (uint32_t value : {2024010101u, 7200u, 3600u, 1209600u, 3600u}) append32(soa, value);
+    appendRecord(nxdomain, "example.com", 0, TYPE_SOA, 3600, soa);
+    corpus.push_back(nxdomain);
+
+    Message cname = responseHeader("www.example.org", TYPE_A, 0x8400, 2, 0, 0);
+    appendRecord(cname, "", sizeof(DNS_HEADER), TYPE_CNAME, 300, nameData("edge.example.net"));
+    appendRecord(cname, "edge.example.net", 0, TYPE_A, 60, {203, 0, 113, 7});
+    corpus.push_back(cname);
+
+    Message big = responseHeader("big.example.com", TYPE_A, 0x8400, 100, 0, 0);
+    for (int i = 0; i < 100; ++i) {
+        appendRecord(big, "", sizeof(DNS_HEADER), TYPE_A, 60, {10, 1, (unsigned char)(i / 250), (unsigned char)(i % 250)});
+    }
+    corpus.push_back(big);
+    return corpus;
+}
+
+// Разбор без выделения памяти: заголовок, вопрос и обход всех записей с декодированием имен.
+size_t walkMessage(const Message& message) {
+    DnsParser parser;
+    if (!beginParse(parser, message.data(), message.size())) return 0;
+    DnsRecordView record;
+    DnsName target;
+    int section;
+    size_t checksum = parser.question.length;
+    while (nextRecord(parser, record, section)) {
+        checksum += record.name.length + record.rdlength;
+        if ((record.type == TYPE_NS || record.type == TYPE_CNAME) && readRdataName(parser, record, target)) {
+            checksum += target.length;
+        }
+    }
+    return parser.malformed ? 0 : checksum;
+}
+
+void benchmark(const std::vector<Message>& corpus, int iterations) {
+    size_t bytes = 0;
+    for (const Message& message : corpus) bytes += message.size();
+    double total_messages = (double)corpus.size() * iterations;
+
+    size_t checksum = 0;
+    auto started = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (const Message& message : corpus) checksum += walkMessage(message);
+    }
+    double view_seconds = std::chrono::duration<double>(Clock::now() - started).count();
+
+    size_t records = 0;
+    started = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (const Message& message : corpus) {
+            DnsResponse response;
+            if (parseResponse(message.data(), message.size(), response)) {
+                records += response.answers.size() + response.authority.size() + response.additional.size();
+            }
+        }
+    }
+    double full_seconds = std::chrono::duration<double>(Clock::now() - started).count();
+
+    std::cout << corpus.size() << " messages, " << bytes << " bytes, " << iterations << " iterations" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Views (no allocation): " << view_seconds * 1e9 / total_messages << " ns/message, "
+              << bytes * iterations / view_seconds / 1e6 << " MB/s" << std::endl;
+    std::cout << "DnsResponse (for cache): " << full_seconds * 1e9 / total_messages << " ns/message, "
+              << bytes * iterations / full_seconds / 1e6 << " MB/s" << std::endl;
+    if (checksum == 0 && records == 0) std::cout << "No message parsed." << std::endl;
+}
+
+// Случайная порча сообщения: битые байты, указатели сжатия в произвольное место (в том числе
+// вперед и на себя), огромные счетчики записей, обрезание и вставка куска сообщения.
+void mutate(Message& message, std::mt19937& random) {
+    int mutations = 1 + random() % 8;
+    for (int i = 0; i < mutations && !message.empty(); ++i) {
+        size_t pos = random() % message.size();
+        switch (random() % 6) {
+        case 0:
+            message[pos] ^= 1 << (random() % 8);
+            break;
+        case 1:
+            message[pos] = random();
+            break;
+        case 2:
+            message[pos] = 0xC0 | (random() % 4);
+            if (pos + 1 < message.size()) message[pos + 1] = random() % message.size();
+            break;
+        case 3:
+            if (message.size() >= sizeof(DNS_HEADER)) message[4 + 2 * (random() % 4) + random() % 2] = 0xFF;
+            break;
+        case 4:
+            message.resize(pos);
+            break;
+        default: {
+            size_t length = random() % 32;
+            size_t from = random() % message.size();
+            Message chunk(message.begin() + from, message.begin() + std::min(message.size(), from + length));
+            message.insert(message.begin() + pos, chunk.begin(), chunk.end());
+            break;
+        }
+        }
+    }
+}
+
+// Проверяет испорченные сообщения: разбор не должен выходить за буфер (это ловит сборка
+// с -fsanitize=address), зацикливаться и выдавать имена длиннее допустимого; оба способа
+// разбора должны одинаково принимать или отвергать сообщение.
+bool fuzz(const std::vector<Message>& corpus, long long iterations, unsigned seed) {
+    std::mt19937 random(seed);
+    long long accepted = 0;
+    for (long long i = 0; i < iterations; ++i) {
+        // Копия точной длины: чтение за концом сообщения — ошибка ASan, а не чтение соседних данных.
+        Message message = corpus[random() % corpus.size()];
+        mutate(message, random);
+        Message exact(message);
+
+        DnsParser parser;
+        bool view_ok = beginParse(parser, exact.data(), exact.size());
+        DnsRecordView record;
+        DnsName target;
+        int section;
+        bool names_ok = !view_ok || parser.question.length < MAX_NAME_WIRE_LENGTH - 1;
+        int walked = 0;
+        while (view_ok && nextRecord(parser, record, section)) {
+            names_ok = names_ok && record.name.length < MAX_NAME_WIRE_LENGTH - 1 &&
+                       record.rdata + record.rdlength <= exact.data() + exact.size();
+            if (record.type == TYPE_NS || record.type == TYPE_CNAME) {
+                if (!readRdataName(parser, record, target)) {
+                    parser.malformed = true;
+                    break;
+                }
+                names_ok = names_ok && target.length < MAX_NAME_WIRE_LENGTH - 1;
+            } else if ((record.type == TYPE_A && record.rdlength != 4) || (record.type == TYPE_AAAA && record.rdlength != 16)) {
+                parser.malformed = true;
+                break;
+            }
+            walked++;
+        }
+        view_ok = view_ok && !parser.malformed;
+
+        DnsResponse response;
+        bool full_ok = parseResponse(exact.data(), exact.size(), response);
+        int parsed = response.answers.size() + response.authority.size() + response.additional.size();
+        if (!names_ok || view_ok != full_ok || (full_ok && walked != parsed)) {
+            std::cerr << "Fuzz iteration " << i << " (seed " << seed << "): parsers disagree or name too long, message:";
+            for (unsigned char c : exact) std::cerr << ' ' << std::hex << std::setw(2) << std::setfill('0') << (int)c;
+            std::cerr << std::dec << std::endl;
+            return false;
+        }
+        if (full_ok) accepted++;
+    }
+    std::cout << "Fuzz: " << iterations << " mutated messages, " << accepted << " accepted, "
+              << iterations - accepted << " rejected, no violations" << std::endl;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::string capture_path;
+    int iterations = 20000;
+    long long fuzz_iterations = 0;
+    unsigned seed = std::random_device{}();
+    for (int i = 1; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-c") capture_path = argv[++i];
+        else if (arg == "-i") iterations = std::max(1, atoi(argv[++i]));
+        else if (arg == "-f") fuzz_iterations = atoll(argv[++i]);
+        else if (arg == "-s") seed = strtoul(argv[++i], nullptr, 10);
+        else {
+            std::cerr << "Usage: " << argv[0] << " [-c capture_file] [-i iterations] [-f fuzz_iterations] [-s seed]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Message> corpus;
+    if (!capture_path.empty() && !loadCapture(capture_path, corpus)) return 1;
+    if (corpus.empty()) corpus = builtinCorpus();
+
+    benchmark(corpus, iterations);
+    if (fuzz_iterations > 0 && !fuzz(corpus, fuzz_iterations, seed)) return 1;
+    return 0;
+}
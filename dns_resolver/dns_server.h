@@ -0,0 +1,512 @@
+#pragma once
+
+#include "resolver_engine.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <csignal>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+// Ответ по UDP клиенту без EDNS не длиннее 512 байт (RFC 1035); с EDNS — не длиннее размера,
+// объявленного клиентом, и не больше MAX_EDNS_UDP_SIZE (без фрагментации IP, DNS Flag Day 2020).
+const size_t MAX_UDP_RESPONSE = 512;
+const uint16_t MAX_EDNS_UDP_SIZE = 1232;
+const uint16_t TYPE_OPT = 41;
+// Соединение клиента без запросов и ответов дольше TCP_IDLE_TIMEOUT_S секунд закрывается (RFC 7766),
+// если ни один его запрос не ждет разрешения.
+const int TCP_IDLE_TIMEOUT_S = 10;
+const size_t MAX_TCP_CLIENTS = 1024;
+const size_t MAX_TCP_OUTPUT = 1024 * 1024;
+// Шаблонов ответов на поток; при переполнении они сбрасываются и строятся заново из кэша.
+const size_t MAX_RESPONSE_TEMPLATES = 100000;
+
+const int RCODE_FORMERR = 1;
+const int RCODE_SERVFAIL = 2;
+const int RCODE_NXDOMAIN = 3;
+const int RCODE_NOTIMP = 4;
+const int RCODE_REFUSED = 5;
+
+enum StubEvent : uint32_t {
+    EVENT_STUB_UDP = EVENT_EXTERNAL,
+    EVENT_STUB_LISTEN,
+    EVENT_STUB_TCP
+};
+
+// Устанавливается обработчиком SIGINT/SIGTERM: потоки сервера завершаются после текущего тика.
+std::atomic<bool> server_stop{false};
+
+// Готовый ответ в wire-формате с id 0. Действует в ту секунду, в которую построен: в следующую
+// он строится из кэша заново, поэтому TTL, которые видит клиент, отстают от кэша не больше
+// чем на секунду, а истекшие записи не выдаются.
+struct ResponseTemplate {
+    std::string message;
+    time_t built = 0;
+};
+
+// Клиент, ждущий ответа: адрес (UDP) или соединение (TCP), id и RD его запроса, вопрос в том виде,
+// в котором он пришел (регистр букв возвращается как есть), и EDNS.
+struct StubQuery {
+    bool tcp = false;
+    sockaddr_in address{};
+    uint32_t connection = 0;
+    uint16_t id = 0;
+    bool recursion_desired = true;
+    std::string question;
+    bool edns = false;
+    size_t udp_size = MAX_UDP_RESPONSE;
+};
+
+struct StubConnection {
+    int fd = -1;
+    std::string in;
+    std::string out;
+    bool writing = false;
+    time_t active = 0;
+    // Запросы соединения, которые ждут разрешения в StubServer::waiting.
+    size_t pending = 0;
+};
+
+struct StubServerStats {
+    unsigned long long queries = 0;
+    unsigned long long template_hits = 0;
+    unsigned long long lookups = 0;
+    unsigned long long coalesced = 0;
+    unsigned long long servfail = 0;
+    unsigned long long truncated = 0;
+    unsigned long long tcp_queries = 0;
+    unsigned long long rejected = 0;
+};
+
+// Поток сервера: свой движок, свои сокеты на общем адресе (SO_REUSEPORT) и свои шаблоны.
+// Общий между потоками только dns_cache.
+struct StubServer {
+    Engine engine;
+    int udp_fd = -1;
+    int listen_fd = -1;
+    std::unordered_map<std::string, ResponseTemplate> templates;
+    // Клиенты по ключу кэша вопроса: одновременные одинаковые вопросы ждут одного разрешения.
+    std::unordered_map<std::string, std::vector<StubQuery>> waiting;
+    std::unordered_map<uint32_t, StubConnection> connections;
+    uint32_t next_connection = 0;
+    size_t active = 0;
+    StubServerStats stats;
+};
+
+bool addStubSocket(StubServer& server, int fd, uint64_t event) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = event;
+    if (epoll_ctl(server.engine.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return false;
+    }
+    return true;
+}
+
+// Открывает UDP- и TCP-сокеты потока на address. SO_REUSEPORT позволяет каждому потоку
+// привязать свои сокеты к тому же адресу: ядро делит между ними датаграммы и соединения.
+bool openStubSockets(StubServer& server, const sockaddr_in& address) {
+    server.udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    server.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (server.udp_fd < 0 || server.listen_fd < 0) {
+        perror("socket creation failed");
+        return false;
+    }
+    int on = 1;
+    for (int fd : {server.udp_fd, server.listen_fd}) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            perror("SO_REUSEPORT failed");
+            return false;
+        }
+        if (bind(fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+            perror("bind failed");
+            return false;
+        }
+    }
+    setsockopt(server.udp_fd, SOL_SOCKET, SO_RCVBUF, &ENGINE_SOCKET_BUFFER, sizeof(ENGINE_SOCKET_BUFFER));
+    if (listen(server.listen_fd, SOMAXCONN) < 0) {
+        perror("listen failed");
+        return false;
+    }
+    return addStubSocket(server, server.udp_fd, (uint64_t)EVENT_STUB_UDP << 32) &&
+           addStubSocket(server, server.listen_fd, (uint64_t)EVENT_STUB_LISTEN << 32);
+}
+
+// Ответ с id 0 на вопрос question (байты вопроса в wire-формате, пусто — ответ без вопроса):
+// QR и RA установлены, записи aliases и records идут в секцию ответов, authority (SOA
+// отрицательного ответа) — в секцию authority.
+std::string buildStubResponse(const std::string& question, const std::string& name, int rcode,
+                              const std::vector<DnsRecord>& aliases, const std::vector<DnsRecord>& records,
+                              const std::vector<DnsRecord>& authority = {}) {
+    std::string message;
+    appendU16(message, 0);
+    appendU16(message, 0x8180 | rcode);
+    appendU16(message, question.empty() ? 0 : 1);
+    appendU16(message, aliases.size() + records.size());
+    appendU16(message, authority.size());
+    appendU16(message, 0);
+    message += question;
+    for (const DnsRecord& record : aliases) appendResourceRecord(message, record, name);
+    for (const DnsRecord& record : records) appendResourceRecord(message, record, name);
+    for (const DnsRecord& record : authority) appendResourceRecord(message, record, name);
+    return message;
+}
+
+void closeConnection(StubServer& server, uint32_t id) {
+    auto it = server.connections.find(id);
+    if (it == server.connections.end()) return;
+    close(it->second.fd);
+    server.connections.erase(it);
+}
+
+// Пишет в соединение, сколько примет сокет; остаток ждет EPOLLOUT. Клиент, который не читает
+// ответы, отключается.
+void flushConnection(StubServer& server, uint32_t id) {
+    StubConnection& connection = server.connections.at(id);
+    while (!connection.out.empty()) {
+        ssize_t written = send(connection.fd, connection.out.data(), connection.out.size(), MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeConnection(server, id);
+                return;
+            }
+            break;
+        }
+        connection.out.erase(0, written);
+        connection.active = time(nullptr);
+    }
+    if (connection.out.size() > MAX_TCP_OUTPUT) {
+        closeConnection(server, id);
+        return;
+    }
+    if (connection.writing == !connection.out.empty()) return;
+    connection.writing = !connection.out.empty();
+    epoll_event ev{};
+    ev.events = connection.writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.u64 = (uint64_t)EVENT_STUB_TCP << 32 | id;
+    epoll_ctl(server.engine.epoll_fd, EPOLL_CTL_MOD, connection.fd, &ev);
+}
+
+// Отправляет клиенту ответ response (шаблон с id 0): в копии меняются только id, бит RD и байты
+// вопроса. Ответ, не помещающийся в UDP, уходит без записей с флагом TC — клиент повторит запрос по TCP.
+void sendStubResponse(StubServer& server, const StubQuery& query, const std::string& response) {
+    std::string message = response;
+    message[0] = query.id >> 8;
+    message[1] = query.id & 0xFF;
+    message[2] = (message[2] & ~0x01) | (query.recursion_desired ? 0x01 : 0);
+    if (read16((const unsigned char*)message.data() + 4) == 1) {
+        message.replace(sizeof(DNS_HEADER), query.question.size(), query.question);
+    }
+    size_t limit = query.tcp ? MAX_RESPONSE_SIZE - 1 : query.udp_size;
+    // OPT в ответ на запрос с EDNS (RFC 6891): размер UDP, который принимает сервер.
+    size_t opt_size = query.edns ? 11 : 0;
+    if (message.size() + opt_size > limit) {
+        server.stats.truncated++;
+        message.resize(sizeof(DNS_HEADER) + query.question.size());
+        message[2] |= 0x02;
+        message[6] = message[7] = message[8] = message[9] = 0;
+    }
+    if (query.edns) {
+        message.push_back(0);
+        appendU16(message, TYPE_OPT);
+        appendU16(message, MAX_EDNS_UDP_SIZE);
+        appendU32(message, 0);
+        appendU16(message, 0);
+        message[11] = 1;
+    }
+
+    if (!query.tcp) {
+        sendto(server.udp_fd, message.data(), message.size(), 0, (const sockaddr*)&query.address, sizeof(query.address));
+        return;
+    }
+    auto it = server.connections.find(query.connection);
+    if (it == server.connections.end()) return;
+    it->second.active = time(nullptr);
+    it->second.out.push_back(message.size() >> 8);
+    it->second.out.push_back(message.size() & 0xFF);
+    it->second.out += message;
+    flushConnection(server, query.connection);
+}
+
+// Разрешение завершилось: ответ отдается всем клиентам, которые ждали этот вопрос, и, если
+// разрешение не закончилось ошибкой, сохраняется как шаблон.
+void answerStubs(StubServer& server, const Lookup& lookup) {
+    std::string name = normalizeName(lookup.hostname);
+    std::string key = cacheKey(name, lookup.type);
+    auto it = server.waiting.find(key);
+    if (it == server.waiting.end()) return;
+    std::vector<StubQuery> queries;
+    queries.swap(it->second);
+    server.waiting.erase(it);
+
+    int rcode = 0;
+    if (lookup.status == LookupStatus::NXDOMAIN) rcode = RCODE_NXDOMAIN;
+    if (lookup.status == LookupStatus::FAILED) rcode = RCODE_SERVFAIL;
+    std::string question;
+    appendWireName(question, name);
+    appendU16(question, lookup.type);
+    appendU16(question, 1);
+    std::string response = rcode == RCODE_SERVFAIL ? buildStubResponse(question, name, rcode, {}, {})
+                                                   : buildStubResponse(question, name, rcode, lookup.aliases, lookup.records,
+                                                                       lookup.authority);
+    if (rcode == RCODE_SERVFAIL) {
+        server.stats.servfail += queries.size();
+        if (debug_mode) std::cout << "SERVFAIL for " << name << ": " << lookup.error << std::endl;
+    } else {
+        if (server.templates.size() >= MAX_RESPONSE_TEMPLATES) server.templates.clear();
+        server.templates[key] = {response, time(nullptr)};
+    }
+    for (const StubQuery& query : queries) {
+        auto connection = query.tcp ? server.connections.find(query.connection) : server.connections.end();
+        if (connection != server.connections.end()) connection->second.pending--;
+        sendStubResponse(server, query, response);
+    }
+}
+
+// Запрос клиента: ответ из шаблона, если он построен в эту секунду, иначе разрешение движком
+// (из кэша или запросами к серверам). Испорченный запрос получает FORMERR, неизвестный код операции —
+// NOTIMP. Сервер разрешает только A и AAAA класса IN: на другие типы и классы он отвечает REFUSED,
+// а не NOTIMP (тот означает неподдерживаемую операцию), и клиент спрашивает следующий сервер
+// из своего списка. Ответы (QR) не обрабатываются, чтобы два сервера не зациклили друг друга.
+void handleStubQuery(StubServer& server, const unsigned char* buffer, size_t length, StubQuery query) {
+    if (length < sizeof(DNS_HEADER)) return;
+    server.stats.queries++;
+    DnsParser parser;
+    bool parsed = beginParse(parser, buffer, length);
+    query.id = read16(buffer);
+    query.recursion_desired = (buffer[2] & 0x01) != 0;
+    if (buffer[2] & 0x80) return;
+    if (!parsed || read16(buffer + 4) != 1) {
+        server.stats.rejected++;
+        sendStubResponse(server, query, buildStubResponse("", "", RCODE_FORMERR, {}, {}));
+        return;
+    }
+    query.question.assign((const char*)buffer + sizeof(DNS_HEADER), parser.offset - sizeof(DNS_HEADER));
+    std::string name = nameString(parser.question);
+    // Вопрос без указателей сжатия: его байты подставляются в шаблон на место вопроса той же длины.
+    if (query.question.size() != (name.empty() ? 1 : name.size() + 2) + sizeof(QUESTION)) {
+        server.stats.rejected++;
+        query.question.clear();
+        sendStubResponse(server, query, buildStubResponse("", "", RCODE_FORMERR, {}, {}));
+        return;
+    }
+    uint16_t query_class = read16(buffer + parser.offset - 2);
+    DnsRecordView record;
+    int section;
+    while (nextRecord(parser, record, section)) {
+        if (section == SECTION_ADDITIONAL && record.type == TYPE_OPT) {
+            query.edns = true;
+            query.udp_size = std::clamp<size_t>(record.record_class, MAX_UDP_RESPONSE, MAX_EDNS_UDP_SIZE);
+        }
+    }
+    bool standard_query = (buffer[2] & 0x78) == 0;
+    bool supported = query_class == 1 && (parser.question_type == TYPE_A || parser.question_type == TYPE_AAAA);
+    if (parser.malformed || !standard_query || !supported) {
+        server.stats.rejected++;
+        int rcode = parser.malformed ? RCODE_FORMERR : !standard_query ? RCODE_NOTIMP : RCODE_REFUSED;
+        sendStubResponse(server, query, buildStubResponse(query.question, name, rcode, {}, {}));
+        return;
+    }
+
+    std::string key = cacheKey(name, parser.question_type);
+    auto cached = server.templates.find(key);
+    if (cached != server.templates.end() && cached->second.built == time(nullptr)) {
+        server.stats.template_hits++;
+        sendStubResponse(server, query, cached->second.message);
+        return;
+    }
+    // Разрешений в потоке не больше DEFAULT_IN_FLIGHT: при перегрузке клиент сразу получает SERVFAIL.
+    if (server.active >= DEFAULT_IN_FLIGHT && server.waiting.count(key) == 0) {
+        server.stats.servfail++;
+        sendStubResponse(server, query, buildStubResponse(query.question, name, RCODE_SERVFAIL, {}, {}));
+        return;
+    }
+    if (query.tcp) server.connections.at(query.connection).pending++;
+    std::vector<StubQuery>& queries = server.waiting[key];
+    queries.push_back(std::move(query));
+    if (queries.size() > 1) {
+        server.stats.coalesced++;
+        return;
+    }
+    server.stats.lookups++;
+    server.active++;
+    size_t slot = allocSlot(server.engine);
+    server.engine.slots[slot].hostname = name;
+    server.engine.slots[slot].type = parser.question_type;
+    startLookup(server.engine, slot);
+}
+
+void receiveStubQueries(StubServer& server) {
+    unsigned char buf[MAX_EDNS_UDP_SIZE * 4];
+    while (true) {
+        StubQuery query;
+        socklen_t address_length = sizeof(query.address);
+        ssize_t received = recvfrom(server.udp_fd, buf, sizeof(buf), 0, (sockaddr*)&query.address, &address_length);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvfrom failed");
+            return;
+        }
+        handleStubQuery(server, buf, received, std::move(query));
+    }
+}
+
+void acceptStubConnections(StubServer& server) {
+    while (true) {
+        int fd = accept4(server.listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept failed");
+            return;
+        }
+        if (server.connections.size() >= MAX_TCP_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        uint32_t id = server.next_connection++;
+        if (!addStubSocket(server, fd, (uint64_t)EVENT_STUB_TCP << 32 | id)) {
+            close(fd);
+            continue;
+        }
+        server.connections[id].fd = fd;
+        server.connections[id].active = time(nullptr);
+    }
+}
+
+// Соединение клиента: запросы с двухбайтной длиной, несколько подряд; ответы могут идти
+// не в порядке запросов (RFC 7766), клиент сопоставляет их по id.
+void handleStubConnection(StubServer& server, uint32_t id, uint32_t events) {
+    auto it = server.connections.find(id);
+    if (it == server.connections.end()) return;
+    if (events & EPOLLOUT) {
+        flushConnection(server, id);
+        if ((it = server.connections.find(id)) == server.connections.end()) return;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+    bool eof = false;
+    while (true) {
+        char buf[4096];
+        ssize_t received = read(it->second.fd, buf, sizeof(buf));
+        if (received > 0) {
+            it->second.in.append(buf, received);
+            continue;
+        }
+        if (received < 0 && errno == EINTR) continue;
+        eof = received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        break;
+    }
+    it->second.active = time(nullptr);
+    std::string in;
+    in.swap(it->second.in);
+    size_t offset = 0;
+    while (in.size() - offset >= 2) {
+        size_t length = read16((const unsigned char*)in.data() + offset);
+        if (in.size() - offset - 2 < length) break;
+        StubQuery query;
+        query.tcp = true;
+        query.connection = id;
+        server.stats.tcp_queries++;
+        handleStubQuery(server, (const unsigned char*)in.data() + offset + 2, length, std::move(query));
+        offset += 2 + length;
+    }
+    // Ответ мог закрыть соединение (клиент не читает).
+    if ((it = server.connections.find(id)) == server.connections.end()) return;
+    if (eof) {
+        closeConnection(server, id);
+        return;
+    }
+    it->second.in = in.substr(offset);
+}
+
+void closeIdleConnections(StubServer& server, time_t now) {
+    std::vector<uint32_t> idle;
+    for (const auto& [id, connection] : server.connections) {
+        if (connection.pending == 0 && now - connection.active > TCP_IDLE_TIMEOUT_S) idle.push_back(id);
+    }
+    for (uint32_t id : idle) closeConnection(server, id);
+}
+
+void serveStubs(StubServer& server) {
+    server.engine.on_event = [&server](uint64_t event, uint32_t events) {
+        switch (event >> 32) {
+        case EVENT_STUB_UDP:
+            receiveStubQueries(server);
+            break;
+        case EVENT_STUB_LISTEN:
+            acceptStubConnections(server);
+            break;
+        default:
+            handleStubConnection(server, (uint32_t)event, events);
+            break;
+        }
+    };
+    std::function<void(const Lookup&)> done = [&server](const Lookup& lookup) { answerStubs(server, lookup); };
+    time_t last_sweep = time(nullptr);
+    while (!server_stop) {
+        if (!pollEngine(server.engine)) return;
+        processFinished(server.engine, done, server.active);
+        time_t now = time(nullptr);
+        if (now != last_sweep) {
+            closeIdleConnections(server, now);
+            last_sweep = now;
+        }
+    }
+}
+
+void stopServer(int) {
+    server_stop = true;
+}
+
+// Локальный кэширующий сервер: threads потоков принимают запросы клиентов по UDP и TCP
+// на address и отвечают из общего кэша или разрешают имена итеративно.
+bool runServer(const sockaddr_in& address, int threads) {
+    std::vector<std::unique_ptr<StubServer>> servers;
+    for (int i = 0; i < threads; ++i) {
+        servers.push_back(std::make_unique<StubServer>());
+        if (!initEngine(servers.back()->engine) || !openStubSockets(*servers.back(), address)) return false;
+    }
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
+    std::cerr << "Serving on " << ip << ":" << ntohs(address.sin_port) << " (UDP and TCP), " << threads
+              << " threads" << std::endl;
+
+    std::vector<std::thread> workers;
+    for (auto& server : servers) workers.emplace_back(serveStubs, std::ref(*server));
+    for (std::thread& worker : workers) worker.join();
+
+    StubServerStats total;
+    EngineStats engine_total;
+    for (const auto& server : servers) {
+        total.queries += server->stats.queries;
+        total.template_hits += server->stats.template_hits;
+        total.lookups += server->stats.lookups;
+        total.coalesced += server->stats.coalesced;
+        total.servfail += server->stats.servfail;
+        total.truncated += server->stats.truncated;
+        total.tcp_queries += server->stats.tcp_queries;
+        total.rejected += server->stats.rejected;
+        engine_total.queries += server->engine.stats.queries;
+        engine_total.timeouts += server->engine.stats.timeouts;
+    }
+    std::cerr << "Served " << total.queries << " queries (" << total.tcp_queries << " over TCP): "
+              << total.template_hits << " from templates, " << total.lookups << " lookups, " << total.coalesced
+              << " coalesced, " << total.servfail << " SERVFAIL, " << total.truncated << " truncated, "
+              << total.rejected << " rejected; " << engine_total.queries << " upstream queries, "
+              << engine_total.timeouts << " timeouts" << std::endl;
+    return true;
+}
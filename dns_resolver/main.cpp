@@ -1,253 +1,195 @@
+#include "resolver_engine.h"
+#include "dns_server.h"
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <string>
-#include <cstring>
 #include <sstream>
-#include <random>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <netdb.h>
-
-bool debug_mode = false;
-
-#pragma pack(push, 1)
-struct DNS_HEADER {
-    uint16_t id;
-    uint16_t flags;
-    uint16_t qdcount;
-    uint16_t ancount;
-    uint16_t nscount;
-    uint16_t arcount;
-};
-
-struct QUESTION {
-    uint16_t qtype;
-    uint16_t qclass;
-};
-
-struct RES_RECORD {
-    uint16_t type;
-    uint16_t _class;
-    uint32_t ttl;
-    uint16_t rdlength;
-};
-#pragma pack(pop)
-
-void domainToDnsFormat(unsigned char* dns, const std::string& hostname) {
-    std::string domain = hostname;
-    size_t start = 0, end;
-    while ((end = domain.find('.', start)) != std::string::npos) {
-        std::string label = domain.substr(start, end - start);
-        *dns++ = label.length();
-        memcpy(dns, label.c_str(), label.length());
-        dns += label.length();
-        start = end + 1;
-    }
-    std::string label = domain.substr(start);
-    *dns++ = label.length();
-    memcpy(dns, label.c_str(), label.length());
-    dns += label.length();
-
-    *dns++ = '\0';
-}
-
-std::string readDnsName(unsigned char* reader, unsigned char* buffer, int* count) {
-    std::string name;
-    unsigned int p = 0, jumped = 0;
-    *count = 0;
-
-    while (*reader != 0) {
-        if (*reader >= 192) {
-            unsigned int offset = (*reader & 0x3F) * 256 + *(reader + 1);
-            reader = buffer + offset;
-            if (!jumped) {
-                *count += 2;
-            }
-            jumped = 1;
-        } else {
-            unsigned int len = *reader;
-            reader++;
-            name.append((const char*)reader, len);
-            name.append(".");
-            reader += len;
-            if (!jumped) {
-                *count += (len + 1);
-            }
+#include <cstdlib>
+#include <algorithm>
+#include <thread>
+#include <fcntl.h>
+
+bool quiet_mode = false;
+
+void printLookup(const Lookup& lookup) {
+    switch (lookup.status) {
+    case LookupStatus::ANSWER:
+        for (const DnsRecord& record : lookup.records) {
+            std::cout << lookup.hostname << " -> " << formatAddress(record);
+            if (debug_mode) std::cout << " (TTL " << record.ttl << ")";
+            std::cout << std::endl;
         }
+        break;
+    case LookupStatus::NXDOMAIN:
+        std::cout << lookup.hostname << ": host not found (NXDOMAIN)." << std::endl;
+        break;
+    case LookupStatus::NODATA:
+        std::cout << lookup.hostname << ": no records of type " << lookup.type << "." << std::endl;
+        break;
+    default:
+        std::cout << "Could not resolve " << lookup.hostname << ". " << lookup.error << std::endl;
+        break;
     }
-
-    if (!jumped) {
-        (*count)++;
-    }
-
-    if (!name.empty()) {
-        name.pop_back();
-    }
-    return name;
 }
 
+// Значение из отсортированного списка задержек.
+float percentile(const std::vector<float>& sorted, double fraction) {
+    return sorted[std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()))];
+}
 
-void resolve(const std::string& hostname, int query_type) {
-    std::vector<std::string> root_servers = {
-        "198.41.0.4",    // a.root-servers.net
-        "199.9.14.201",  // b.root-servers.net
-        "192.33.4.12",   // c.root-servers.net
-    };
-    std::string dns_server_ip = root_servers[0];
-
-    if (debug_mode) std::cout << "Starting resolution for " << hostname << " (type " << query_type << ")" << std::endl;
-
-    for (int iteration = 0; iteration < 20; ++iteration) {
-        if (debug_mode) std::cout << "\n--- Iteration " << iteration + 1 << " ---" << std::endl;
-        if (debug_mode) std::cout << "Querying server: " << dns_server_ip << std::endl;
-
-        int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        if (sockfd < 0) {
-            perror("socket creation failed");
-            return;
-        }
-
-        struct sockaddr_in servaddr;
-        memset(&servaddr, 0, sizeof(servaddr));
-        servaddr.sin_family = AF_INET;
-        servaddr.sin_port = htons(53);
-        inet_pton(AF_INET, dns_server_ip.c_str(), &servaddr.sin_addr);
-
-        unsigned char buf[65536];
-        DNS_HEADER *dns = (DNS_HEADER*)buf;
-        dns->id = (uint16_t)htons(getpid());
-        dns->flags = htons(0x0100);
-        dns->qdcount = htons(1);
-        dns->ancount = 0;
-        dns->nscount = 0;
-        dns->arcount = 0;
-
-        unsigned char* qname = &buf[sizeof(DNS_HEADER)];
-        domainToDnsFormat(qname, hostname);
-        size_t qname_len = strlen((const char*)qname) + 1;
-
-        QUESTION *qinfo = (QUESTION*)&buf[sizeof(DNS_HEADER) + qname_len];
-        qinfo->qtype = htons(query_type);
-        qinfo->qclass = htons(1);
-
-        int query_size = sizeof(DNS_HEADER) + qname_len + sizeof(QUESTION);
-
-        if (sendto(sockfd, buf, query_size, 0, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-            perror("sendto failed");
-            close(sockfd);
-            return;
-        }
-
-        struct timeval tv;
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-
-        recvfrom(sockfd, buf, 65536, 0, nullptr, nullptr);
-        close(sockfd);
-
-        dns = (DNS_HEADER*)buf;
-        unsigned char* reader = &buf[query_size];
-
-        if (debug_mode) {
-            std::cout << "Response received. Flags: 0x" << std::hex << ntohs(dns->flags) << std::dec
-                      << " Questions: " << ntohs(dns->qdcount)
-                      << " Answers: " << ntohs(dns->ancount)
-                      << " Authority: " << ntohs(dns->nscount)
-                      << " Additional: " << ntohs(dns->arcount) << std::endl;
-        }
-
-        if ((ntohs(dns->flags) & 0xF) == 3) {
-            std::cout << "Host not found (NXDOMAIN)." << std::endl;
-            return;
-        }
-
-        if (ntohs(dns->ancount) > 0) {
-             for (int i = 0; i < ntohs(dns->ancount); i++) {
-                int count;
-                std::string name = readDnsName(reader, buf, &count);
-                reader += count;
-
-                RES_RECORD* res = (RES_RECORD*)reader;
-                reader += sizeof(RES_RECORD);
-
-                if (ntohs(res->type) == query_type) {
-                    if (query_type == 1) {
-                         struct in_addr addr;
-                         memcpy(&addr, reader, sizeof(in_addr));
-                         std::cout << hostname << " -> " << inet_ntoa(addr) << std::endl;
-                    } else if (query_type == 28) {
-                        char ipv6_str[INET6_ADDRSTRLEN];
-                        inet_ntop(AF_INET6, reader, ipv6_str, INET6_ADDRSTRLEN);
-                        std::cout << hostname << " -> " << ipv6_str << std::endl;
-                    }
-                    return;
-                }
-                reader += ntohs(res->rdlength);
-            }
-        }
-
-        bool next_server_found = false;
-        unsigned char* temp_reader = reader;
-
-        for (int i = 0; i < ntohs(dns->nscount); i++) {
-             int count;
-             readDnsName(temp_reader, buf, &count);
-             temp_reader += count;
-             RES_RECORD* res = (RES_RECORD*)temp_reader;
-             temp_reader += sizeof(RES_RECORD) + ntohs(res->rdlength);
-        }
-
-        for (int i = 0; i < ntohs(dns->arcount); i++) {
-            int count;
-            std::string name = readDnsName(temp_reader, buf, &count);
-            temp_reader += count;
-
-            RES_RECORD* res = (RES_RECORD*)temp_reader;
-            temp_reader += sizeof(RES_RECORD);
-
-            if (ntohs(res->type) == 1) {
-                struct in_addr addr;
-                memcpy(&addr, temp_reader, sizeof(in_addr));
-                dns_server_ip = inet_ntoa(addr);
-                next_server_found = true;
-                if (debug_mode) std::cout << "Found next server to query: " << name << " at " << dns_server_ip << std::endl;
-                break;
-            }
-             temp_reader += ntohs(res->rdlength);
-        }
+int parseQueryType(const std::string& type_str) {
+    if (type_str == "A") return TYPE_A;
+    if (type_str == "AAAA") return TYPE_AAAA;
+    return -1;
+}
 
-        if (!next_server_found) {
-            std::cout << "Could not resolve " << hostname << ". No referral found." << std::endl;
-            return;
+// Режим сервера: "-l [адрес:]порт [-t потоков] [-d] [-r root_server_ip]", по умолчанию адрес 127.0.0.1
+// и поток на каждое ядро.
+int serverMain(int argc, char* argv[]) {
+    std::string listen_address = argv[2];
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-d") {
+            debug_mode = true;
+        } else if (arg == "-t" && i + 1 < argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-r" && i + 1 < argc) {
+            root_servers.assign(1, argv[++i]);
         }
     }
+    size_t colon = listen_address.rfind(':');
+    std::string ip = colon == std::string::npos ? "127.0.0.1" : listen_address.substr(0, colon);
+    int port = atoi(listen_address.substr(colon == std::string::npos ? 0 : colon + 1).c_str());
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, ip.c_str(), &address.sin_addr) != 1) {
+        std::cerr << "Invalid listen address: " << listen_address << std::endl;
+        return 1;
+    }
+    return runServer(address, threads) ? 0 : 1;
 }
 
 int main(int argc, char *argv[]) {
     if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <hostname> <type (A/AAAA)> [-d]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <hostname|-|@file> <type (A/AAAA)> [-d] [-q] [-r root_server_ip] [-j in_flight] [-w capture_file]"
+                  << std::endl;
+        std::cerr << "       " << argv[0] << " -l [address:]port [-t threads] [-d] [-r root_server_ip]" << std::endl;
         return 1;
     }
+    if (std::string(argv[1]) == "-l") return serverMain(argc, argv);
 
     std::string hostname = argv[1];
     std::string type_str = argv[2];
-    int query_type;
-
-    if (type_str == "A") {
-        query_type = 1;
-    } else if (type_str == "AAAA") {
-        query_type = 28;
-    } else {
+    int query_type = parseQueryType(type_str);
+    if (query_type < 0) {
         std::cerr << "Unsupported record type: " << type_str << ". Use A or AAAA." << std::endl;
         return 1;
     }
 
-    if (argc > 3 && std::string(argv[3]) == "-d") {
-        debug_mode = true;
+    // Одновременных разрешений: в режиме службы по умолчанию одно (ответы идут в порядке строк),
+    // для списка имен — DEFAULT_IN_FLIGHT.
+    size_t max_in_flight = hostname[0] == '@' ? DEFAULT_IN_FLIGHT : 1;
+    std::string capture_path;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-d") {
+            debug_mode = true;
+        } else if (arg == "-q") {
+            quiet_mode = true;
+        } else if (arg == "-r" && i + 1 < argc) {
+            root_servers.assign(1, argv[++i]);
+        } else if (arg == "-j" && i + 1 < argc) {
+            max_in_flight = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-w" && i + 1 < argc) {
+            capture_path = argv[++i];
+        }
+    }
+
+    Engine engine;
+    if (!initEngine(engine)) return 1;
+    if (!capture_path.empty()) {
+        engine.capture_fd = open(capture_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (engine.capture_fd < 0) {
+            perror("Failed to open capture file");
+            return 1;
+        }
     }
 
-    resolve(hostname, query_type);
+    if (hostname != "-" && hostname[0] != '@') {
+        bool started = false;
+        runLookups(engine, 1, [&](Lookup& lookup) {
+            if (started) return false;
+            started = true;
+            lookup.hostname = hostname;
+            lookup.type = query_type;
+            return true;
+        }, printLookup);
+        return 0;
+    }
 
+    // Режим службы: имена читаются из stdin построчно ("имя [A|AAAA]"), и кэш сохраняется между
+    // запросами. Массовый режим (@file) читает такие же строки из файла и печатает скорость.
+    std::ifstream file;
+    if (hostname[0] == '@') {
+        file.open(hostname.substr(1));
+        if (!file) {
+            perror("Failed to open name list");
+            return 1;
+        }
+    }
+    std::istream& input = hostname[0] == '@' ? (std::istream&)file : std::cin;
+
+    unsigned long long resolved = 0, failed = 0;
+    std::vector<float> latencies_ms;
+    auto started = Clock::now();
+    runLookups(engine, max_in_flight, [&](Lookup& lookup) {
+        std::string line;
+        while (std::getline(input, line)) {
+            std::istringstream fields(line);
+            std::string name, type = type_str;
+            if (!(fields >> name)) continue;
+            fields >> type;
+            int line_type = parseQueryType(type);
+            if (line_type < 0) {
+                std::cerr << "Unsupported record type: " << type << ". Use A or AAAA." << std::endl;
+                continue;
+            }
+            lookup.hostname = name;
+            lookup.type = line_type;
+            return true;
+        }
+        return false;
+    }, [&](const Lookup& lookup) {
+        lookup.status == LookupStatus::FAILED ? failed++ : resolved++;
+        latencies_ms.push_back(std::chrono::duration<float, std::milli>(Clock::now() - lookup.started).count());
+        if (!quiet_mode) printLookup(lookup);
+    });
+
+    if (hostname[0] == '@') {
+        double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+        unsigned long long total = resolved + failed;
+        std::cerr << "Resolved " << total << " names in " << seconds << " s (" << (seconds > 0 ? total / seconds : 0)
+                  << " names/sec): " << failed << " failed, " << engine.stats.queries << " queries, "
+                  << engine.stats.timeouts << " timeouts, " << engine.stats.hedged << " hedged, " << engine.stats.tcp << " over TCP, "
+                  << engine.stats.unreachable << " unreachable, " << engine.stats.mismatched << " mismatched, "
+                  << engine.stats.malformed << " malformed responses"
+                  << std::endl;
+        if (!latencies_ms.empty()) {
+            std::sort(latencies_ms.begin(), latencies_ms.end());
+            std::cerr << "Latency: p50 " << percentile(latencies_ms, 0.5) << " ms, p99 " << percentile(latencies_ms, 0.99)
+                      << " ms, max " << latencies_ms.back() << " ms" << std::endl;
+        }
+    }
+    if (debug_mode) {
+        std::cout << "Cache: " << cacheSize(dns_cache) << " entries, " << dns_cache.hits << " hits, "
+                  << dns_cache.misses << " misses" << std::endl;
+        for (const auto& [server_ip, stats] : engine.servers) {
+            std::cout << "Server " << server_ip << ": SRTT " << stats.srtt_ms << " ms, RTTVAR " << stats.rttvar_ms
+                      << " ms, " << stats.responses << " responses, " << stats.timeouts << " timeouts" << std::endl;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
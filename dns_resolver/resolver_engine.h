@@ -0,0 +1,1018 @@
+#pragma once
+
+#include "dns_cache.h"
+#include "dns_message.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+// Запросы нескольких сотен тысяч имен идут через ENGINE_SOCKETS UDP-сокетов. Ответ находится
+// по паре (сокет, id), поэтому на каждом сокете одновременно может ждать до 65536 запросов.
+const int ENGINE_SOCKETS = 4;
+const int ENGINE_SOCKET_BUFFER = 4 * 1024 * 1024;
+const size_t DEFAULT_IN_FLIGHT = 4096;
+// Таймаут запроса зависит от измеренного RTT сервера (RFC 6298: SRTT + 4 * RTTVAR) и лежит
+// в этих границах.
+const int MIN_QUERY_TIMEOUT_MS = 50;
+const int QUERY_TIMEOUT_MS = 2000;
+// Сервер, с которым еще не было обмена, считается отвечающим за UNKNOWN_SRTT_MS.
+const int UNKNOWN_SRTT_MS = 250;
+// Сервер выбирается случайно среди серверов зоны, чей SRTT отстает от лучшего не больше чем
+// на SERVER_SELECTION_BAND_MS: так нагрузка делится между одинаково быстрыми серверами.
+const int SERVER_SELECTION_BAND_MS = 20;
+// Статистика сервера без обновлений дольше SERVER_STATS_TTL секунд забывается, и сервер,
+// который когда-то не отвечал, снова получает шанс.
+const int SERVER_STATS_TTL = 600;
+// Сколько раз на одном шаге запрос отправляется повторно: после таймаута, ошибки сервера или
+// параллельно (hedged), если ответ задерживается дольше обычного для сервера.
+const int QUERY_RETRIES = 3;
+const int MAX_ITERATIONS = 20;
+// Запросов на одно имя вместе с разрешением серверов имен без glue: так цикл делегирований
+// (ns.a.test обслуживается ns.b.test и наоборот) не может бесконечно тратить запросы.
+const int MAX_LOOKUP_QUERIES = 64;
+// Вложенность разрешения имен серверов имен и сколько имен NS разрешается одновременно.
+const int MAX_SUBLOOKUP_DEPTH = 3;
+const size_t MAX_GLUELESS_NS = 2;
+const int MAX_CNAME_CHAIN = 8;
+const int TCP_QUERY_TIMEOUT_MS = 4000;
+// Колесо таймеров: TIMER_WHEEL_SLOTS ячеек по TIMER_TICK_MS, полный оборот больше любого таймаута.
+const int TIMER_TICK_MS = 10;
+const size_t TIMER_WHEEL_SLOTS = 1024;
+const size_t MAX_RESPONSE_SIZE = 65536;
+
+bool debug_mode = false;
+
+std::vector<std::string> root_servers = {
+    "198.41.0.4",    // a.root-servers.net
+    "199.9.14.201",  // b.root-servers.net
+    "192.33.4.12",   // c.root-servers.net
+};
+
+// Кэш общий для всех запросов и потоков процесса: ответы, делегирования (NS) и адреса серверов имен (glue).
+DnsCache dns_cache;
+
+enum class LookupStatus {
+    PENDING,
+    ANSWER,
+    NXDOMAIN,
+    NODATA,
+    FAILED
+};
+
+// Разрешение, которое ждет завершения вложенного (адреса сервера имен). iteration — шаг,
+// на котором оно ждет: если разрешение уже ушло дальше, результат ему не нужен.
+struct LookupWaiter {
+    size_t slot;
+    uint64_t generation;
+    int iteration;
+};
+
+// Разрешение одного имени: текущая зона, ее серверы и номер шага. Шаг — запрос к серверам
+// зоны; ответ либо завершает разрешение, либо передает его более глубокой зоне. На одном шаге
+// может ждать ответа несколько запросов к разным серверам (outstanding), принимается первый ответ.
+// name — имя, которое разрешается сейчас: после CNAME это уже цель псевдонима, а не hostname.
+struct Lookup {
+    std::string hostname;
+    std::string name;
+    int type = TYPE_A;
+    LookupStatus status = LookupStatus::PENDING;
+    std::vector<DnsRecord> records;
+    // Пройденные CNAME от hostname до name: сервер отдает их клиенту вместе с records.
+    std::vector<DnsRecord> aliases;
+    // SOA зоны для NXDOMAIN и NODATA: по ней клиент сервера тоже сохраняет отрицательный ответ.
+    std::vector<DnsRecord> authority;
+    std::string error;
+    Clock::time_point started;
+    // Отличает разрешение от прежних в том же слоте.
+    uint64_t generation = 0;
+
+    std::string zone;
+    std::vector<std::string> servers;
+    std::vector<std::string> tried;
+    std::vector<uint32_t> outstanding;
+    int iterations = 0;
+    int attempts = 0;
+    int cnames = 0;
+    // Оставшиеся запросы, общие для имени и всех разрешений имен его серверов.
+    std::shared_ptr<int> budget;
+
+    // Делегирование без glue: NS зоны, адреса которых разрешаются вложенными разрешениями.
+    std::vector<DnsRecord> ns_records;
+    int waiting = 0;
+    // Вложенное разрешение (адрес сервера имен): кому сообщить о завершении.
+    bool nested = false;
+    int depth = 0;
+    std::vector<LookupWaiter> waiters;
+};
+
+// Сглаженное время ответа сервера и его разброс (RFC 6298), по ним выбирается сервер зоны
+// и считается таймаут.
+struct ServerStats {
+    double srtt_ms = UNKNOWN_SRTT_MS;
+    double rttvar_ms = UNKNOWN_SRTT_MS / 2.0;
+    unsigned long long responses = 0;
+    unsigned long long timeouts = 0;
+    Clock::time_point updated;
+};
+
+// Запрос, ожидающий ответа. serial отличает его от прежних запросов с тем же (сокет, id):
+// записи колеса таймеров не удаляются при ответе и проверяются по serial, когда до них дойдет очередь.
+// Запрос по TCP (после ответа с флагом TC) держит свое соединение и буферы.
+struct PendingQuery {
+    size_t slot;
+    uint64_t serial;
+    sockaddr_in server;
+    std::string server_ip;
+    Clock::time_point sent;
+    int tcp_fd = -1;
+    std::string tcp_out;
+    size_t tcp_written = 0;
+    std::string tcp_in;
+};
+
+// Запись колеса: таймаут запроса или момент, когда к нему добавляется параллельный (hedge).
+struct TimerEntry {
+    uint32_t key;
+    uint64_t serial;
+    bool hedge;
+};
+
+struct EngineStats {
+    unsigned long long queries = 0;
+    unsigned long long timeouts = 0;
+    unsigned long long hedged = 0;
+    unsigned long long unreachable = 0;
+    unsigned long long mismatched = 0;
+    unsigned long long malformed = 0;
+    unsigned long long tcp = 0;
+    unsigned long long nested = 0;
+    unsigned long long cnames = 0;
+};
+
+// Что означает событие epoll: ответ на UDP-сокет движка или событие TCP-запроса (ключ в pending).
+// Начиная с EVENT_EXTERNAL — дескрипторы того, кто встроил движок (сервер), их получает on_event.
+enum EngineEvent : uint32_t {
+    EVENT_UDP,
+    EVENT_TCP,
+    EVENT_EXTERNAL
+};
+
+struct Engine {
+    int epoll_fd = -1;
+    int sockets[ENGINE_SOCKETS];
+    // Ключ — номер сокета в старших 16 битах и id запроса в младших; у TCP-запросов вместо
+    // номера сокета ENGINE_SOCKETS.
+    std::unordered_map<uint32_t, PendingQuery> pending;
+    std::unordered_map<std::string, ServerStats> servers;
+    std::vector<std::vector<TimerEntry>> wheel;
+    size_t wheel_pos = 0;
+    Clock::time_point wheel_time;
+    uint64_t next_serial = 0;
+    std::mt19937 random;
+    // Слоты имен, которые сейчас разрешаются; свободные слоты переиспользуются. deque: вложенные
+    // разрешения добавляют слоты, не перемещая существующие.
+    std::deque<Lookup> slots;
+    std::vector<size_t> free_slots;
+    // Завершенные разрешения, которые еще не переданы ожидающим и не освобождены.
+    std::vector<size_t> finished;
+    // Вложенные разрешения в работе по ключу кэша (имя и тип): одно на имя сервера имен.
+    std::unordered_map<std::string, size_t> nested;
+    EngineStats stats;
+    // Файл, в который пишутся все полученные ответы (для dns_parse_bench), или -1.
+    int capture_fd = -1;
+    // События дескрипторов с видом EVENT_EXTERNAL и выше: data.u64 и маска событий epoll.
+    std::function<void(uint64_t, uint32_t)> on_event;
+};
+
+bool initEngine(Engine& engine) {
+    engine.epoll_fd = epoll_create1(0);
+    if (engine.epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return false;
+    }
+    for (int i = 0; i < ENGINE_SOCKETS; ++i) {
+        engine.sockets[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+        if (engine.sockets[i] < 0) {
+            perror("socket creation failed");
+            return false;
+        }
+        setsockopt(engine.sockets[i], SOL_SOCKET, SO_RCVBUF, &ENGINE_SOCKET_BUFFER, sizeof(ENGINE_SOCKET_BUFFER));
+        // ICMP-ошибки (порт или узел недоступен) попадают в очередь ошибок сокета вместе
+        // с исходным запросом: по нему запрос сразу передается другому серверу, без таймаута.
+        int on = 1;
+        setsockopt(engine.sockets[i], IPPROTO_IP, IP_RECVERR, &on, sizeof(on));
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint64_t)EVENT_UDP << 32 | i;
+        if (epoll_ctl(engine.epoll_fd, EPOLL_CTL_ADD, engine.sockets[i], &ev) < 0) {
+            perror("epoll_ctl failed");
+            return false;
+        }
+    }
+    engine.wheel.assign(TIMER_WHEEL_SLOTS, {});
+    engine.wheel_time = Clock::now();
+    engine.random.seed(std::random_device{}());
+    return true;
+}
+
+ServerStats& serverStats(Engine& engine, const std::string& server_ip) {
+    ServerStats& stats = engine.servers[server_ip];
+    if (stats.updated != Clock::time_point() && Clock::now() - stats.updated > std::chrono::seconds(SERVER_STATS_TTL)) {
+        stats = ServerStats();
+    }
+    return stats;
+}
+
+void recordRtt(ServerStats& stats, double rtt_ms) {
+    if (stats.responses == 0) {
+        stats.srtt_ms = rtt_ms;
+        stats.rttvar_ms = rtt_ms / 2;
+    } else {
+        stats.rttvar_ms = 0.75 * stats.rttvar_ms + 0.25 * std::abs(stats.srtt_ms - rtt_ms);
+        stats.srtt_ms = 0.875 * stats.srtt_ms + 0.125 * rtt_ms;
+    }
+    stats.responses++;
+    stats.updated = Clock::now();
+}
+
+// Сервер не ответил: его SRTT удваивается (как RTO в RFC 6298), и он уступает другим серверам зоны.
+void recordTimeout(ServerStats& stats) {
+    stats.srtt_ms = std::min<double>(stats.srtt_ms * 2, QUERY_TIMEOUT_MS);
+    stats.timeouts++;
+    stats.updated = Clock::now();
+}
+
+int queryTimeoutMs(const ServerStats& stats) {
+    return std::clamp((int)(stats.srtt_ms + 4 * stats.rttvar_ms), MIN_QUERY_TIMEOUT_MS, QUERY_TIMEOUT_MS);
+}
+
+// Через сколько отправить параллельный запрос другому серверу: ответ задерживается дольше
+// обычного для этого сервера (SRTT + 2 * RTTVAR), но не позже половины таймаута.
+int hedgeDelayMs(const ServerStats& stats) {
+    int timeout = queryTimeoutMs(stats);
+    return std::clamp((int)(stats.srtt_ms + 2 * stats.rttvar_ms), TIMER_TICK_MS, timeout / 2);
+}
+
+void scheduleTimer(Engine& engine, int delay_ms, const TimerEntry& entry) {
+    size_t ticks = std::max(1, (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    engine.wheel[(engine.wheel_pos + ticks) % TIMER_WHEEL_SLOTS].push_back(entry);
+}
+
+// Сохраняет записи секции по RRset. Принимаются только записи внутри зоны опрошенного сервера
+// (bailiwick): сервер зоны com не может задать адрес для имени в зоне org.
+void cacheSection(const std::vector<DnsRecord>& records, const std::string& zone) {
+    std::unordered_map<std::string, std::vector<DnsRecord>> rrsets;
+    for (const DnsRecord& record : records) {
+        bool cached_type = record.type == TYPE_A || record.type == TYPE_AAAA || record.type == TYPE_NS ||
+                           record.type == TYPE_CNAME;
+        if (cached_type && inZone(record.name, zone)) rrsets[cacheKey(record.name, record.type)].push_back(record);
+    }
+    for (const auto& [key, rrset] : rrsets) {
+        cacheRecords(dns_cache, rrset[0].name, rrset[0].type, rrset);
+    }
+}
+
+// IPv4-адреса серверов имен из кэша (glue или ранее разрешенные имена).
+std::vector<std::string> cachedAddresses(const std::vector<DnsRecord>& ns_records) {
+    std::vector<std::string> servers;
+    for (const DnsRecord& ns : ns_records) {
+        CacheEntry entry;
+        if (!cacheLookup(dns_cache, ns.data, TYPE_A, entry)) continue;
+        for (const DnsRecord& record : entry.records) servers.push_back(formatAddress(record));
+    }
+    return servers;
+}
+
+// Ближайшая к имени зона, для которой в кэше есть делегирование и адрес хотя бы одного
+// сервера имен. Так повторные запросы в той же зоне не обращаются к корню и к серверам TLD.
+std::vector<std::string> closestServers(const std::string& name, std::string& zone) {
+    for (std::string candidate = name; !candidate.empty(); candidate = parentZone(candidate)) {
+        CacheEntry entry;
+        if (!cacheLookup(dns_cache, candidate, TYPE_NS, entry) || entry.negative) continue;
+        std::vector<std::string> servers = cachedAddresses(entry.records);
+        if (!servers.empty()) {
+            zone = candidate;
+            return servers;
+        }
+    }
+    zone = "";
+    return root_servers;
+}
+
+// Ответ из кэша, в том числе отрицательный. Возвращает false, если в кэше ничего нет.
+// TTL записей — оставшийся срок хранения, как его должен увидеть клиент.
+bool answerFromCache(Lookup& lookup, LookupStatus& status) {
+    CacheEntry entry;
+    if (cacheLookup(dns_cache, lookup.name, TYPE_NXDOMAIN, entry)) {
+        status = LookupStatus::NXDOMAIN;
+    } else if (cacheLookup(dns_cache, lookup.name, lookup.type, entry)) {
+        status = entry.negative ? LookupStatus::NODATA : LookupStatus::ANSWER;
+        lookup.records = entry.records;
+        for (DnsRecord& record : lookup.records) record.ttl = remainingTtl(entry);
+    } else {
+        return false;
+    }
+    lookup.authority = entry.authority;
+    for (DnsRecord& record : lookup.authority) record.ttl = remainingTtl(entry);
+    if (debug_mode) {
+        std::cout << "Cache hit for " << lookup.name << ", expires in " << remainingTtl(entry) << " s" << std::endl;
+    }
+    return true;
+}
+
+// Отмечает разрешение завершенным. Ожидающим оно передается из runLookups, после чего слот освобождается.
+void finishLookup(Engine& engine, size_t slot, LookupStatus status, const std::string& error = "") {
+    Lookup& lookup = engine.slots[slot];
+    if (lookup.status != LookupStatus::PENDING) return;
+    lookup.status = status;
+    lookup.error = error;
+    engine.finished.push_back(slot);
+}
+
+size_t allocSlot(Engine& engine) {
+    size_t slot;
+    if (engine.free_slots.empty()) {
+        slot = engine.slots.size();
+        engine.slots.emplace_back();
+    } else {
+        slot = engine.free_slots.back();
+        engine.free_slots.pop_back();
+        engine.slots[slot] = Lookup();
+    }
+    engine.slots[slot].generation = ++engine.next_serial;
+    return slot;
+}
+
+// Удаляет запрос из ожидающих и закрывает его TCP-соединение. Записи колеса таймеров по нему
+// больше не сработают.
+void dropQuery(Engine& engine, uint32_t key) {
+    auto it = engine.pending.find(key);
+    if (it == engine.pending.end()) return;
+    if (it->second.tcp_fd >= 0) close(it->second.tcp_fd);
+    engine.pending.erase(it);
+}
+
+void cancelQuery(Engine& engine, Lookup& lookup, uint32_t key) {
+    dropQuery(engine, key);
+    lookup.outstanding.erase(std::find(lookup.outstanding.begin(), lookup.outstanding.end(), key));
+}
+
+// Отменяет все запросы шага, на которые еще ждется ответ.
+void cancelStep(Engine& engine, Lookup& lookup) {
+    for (uint32_t key : lookup.outstanding) dropQuery(engine, key);
+    lookup.outstanding.clear();
+}
+
+// Выбирает сервер зоны для следующего запроса шага: среди серверов, которым запрос сейчас не
+// отправлен, — самый быстрый по SRTT (со случайным выбором среди близких по скорости). Уже
+// опрошенные на этом шаге серверы выбираются, только если других не осталось (untried_only
+// запрещает и это). Возвращает -1, если выбрать некого.
+int chooseServer(Engine& engine, const Lookup& lookup, bool untried_only) {
+    std::vector<double> costs(lookup.servers.size(), -1);
+    double best = -1;
+    for (size_t i = 0; i < lookup.servers.size(); ++i) {
+        const std::string& server_ip = lookup.servers[i];
+        bool in_flight = std::any_of(lookup.outstanding.begin(), lookup.outstanding.end(), [&](uint32_t key) {
+            return engine.pending.at(key).server_ip == server_ip;
+        });
+        if (in_flight) continue;
+        bool tried = std::find(lookup.tried.begin(), lookup.tried.end(), server_ip) != lookup.tried.end();
+        if (tried && untried_only) continue;
+        costs[i] = serverStats(engine, server_ip).srtt_ms + (tried ? QUERY_TIMEOUT_MS : 0);
+        if (best < 0 || costs[i] < best) best = costs[i];
+    }
+    if (best < 0) return -1;
+    std::vector<int> candidates;
+    for (size_t i = 0; i < costs.size(); ++i) {
+        if (costs[i] >= 0 && costs[i] <= best + SERVER_SELECTION_BAND_MS) candidates.push_back(i);
+    }
+    return candidates[engine.random() % candidates.size()];
+}
+
+// Новый ожидающий запрос под ключом key; время отправки — сейчас.
+PendingQuery& addPending(Engine& engine, uint32_t key, size_t slot, uint64_t serial, const sockaddr_in& server,
+                         const std::string& server_ip) {
+    PendingQuery& query = engine.pending[key];
+    query = PendingQuery();
+    query.slot = slot;
+    query.serial = serial;
+    query.server = server;
+    query.server_ip = server_ip;
+    query.sent = Clock::now();
+    return query;
+}
+
+// Отправляет запрос шага серверу lookup.servers[index] со случайным id, свободным на выбранном
+// сокете, и ставит в колесо таймаут и момент параллельного запроса.
+bool sendQuery(Engine& engine, size_t slot, int index) {
+    Lookup& lookup = engine.slots[slot];
+    const std::string server_ip = lookup.servers[index];
+    lookup.attempts++;
+    (*lookup.budget)--;
+    lookup.tried.push_back(server_ip);
+    sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(53);
+    if (inet_pton(AF_INET, server_ip.c_str(), &server.sin_addr) != 1) return false;
+
+    int socket_index = engine.random() % ENGINE_SOCKETS;
+    uint32_t key;
+    do {
+        key = (uint32_t)socket_index << 16 | (engine.random() & 0xFFFF);
+    } while (engine.pending.count(key) > 0);
+
+    const ServerStats& stats = serverStats(engine, server_ip);
+    unsigned char buf[512];
+    int query_size = buildQuery(buf, key & 0xFFFF, lookup.name, lookup.type);
+    if (debug_mode) {
+        std::cout << "Querying server: " << server_ip << " for " << lookup.name << " (SRTT " << (int)stats.srtt_ms
+                  << " ms, timeout " << queryTimeoutMs(stats) << " ms)" << std::endl;
+    }
+    if (sendto(engine.sockets[socket_index], buf, query_size, 0, (sockaddr*)&server, sizeof(server)) < 0) {
+        perror("sendto failed");
+        return false;
+    }
+    engine.stats.queries++;
+    uint64_t serial = ++engine.next_serial;
+    addPending(engine, key, slot, serial, server, server_ip);
+    lookup.outstanding.push_back(key);
+    scheduleTimer(engine, queryTimeoutMs(stats), {key, serial, false});
+    if (lookup.servers.size() > 1) scheduleTimer(engine, hedgeDelayMs(stats), {key, serial, true});
+    return true;
+}
+
+// Повторяет запрос шага по TCP тому же серверу: его ответ по UDP не поместился в пакет (флаг TC).
+bool sendTcpQuery(Engine& engine, size_t slot, const std::string& server_ip, const sockaddr_in& server) {
+    Lookup& lookup = engine.slots[slot];
+    if (*lookup.budget <= 0) return false;
+    (*lookup.budget)--;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (fd < 0) {
+        perror("socket creation failed");
+        return false;
+    }
+    if (connect(fd, (const sockaddr*)&server, sizeof(server)) < 0 && errno != EINPROGRESS) {
+        perror("connect failed");
+        close(fd);
+        return false;
+    }
+    uint32_t key;
+    do {
+        key = (uint32_t)ENGINE_SOCKETS << 16 | (engine.random() & 0xFFFF);
+    } while (engine.pending.count(key) > 0);
+    epoll_event ev{};
+    ev.events = EPOLLOUT | EPOLLIN;
+    ev.data.u64 = (uint64_t)EVENT_TCP << 32 | key;
+    if (epoll_ctl(engine.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        close(fd);
+        return false;
+    }
+
+    // Сообщение DNS поверх TCP предваряется двухбайтной длиной (RFC 1035, 4.2.2).
+    unsigned char buf[2 + 512];
+    int query_size = buildQuery(buf + 2, key & 0xFFFF, lookup.name, lookup.type);
+    buf[0] = query_size >> 8;
+    buf[1] = query_size & 0xFF;
+    if (debug_mode) std::cout << "Retrying over TCP: " << server_ip << " for " << lookup.name << std::endl;
+    engine.stats.queries++;
+    engine.stats.tcp++;
+    uint64_t serial = ++engine.next_serial;
+    PendingQuery& query = addPending(engine, key, slot, serial, server, server_ip);
+    query.tcp_fd = fd;
+    query.tcp_out.assign((const char*)buf, query_size + 2);
+    lookup.outstanding.push_back(key);
+    scheduleTimer(engine, TCP_QUERY_TIMEOUT_MS, {key, serial, false});
+    return true;
+}
+
+// Отправляет запрос шага следующему серверу (первый запрос или замена потерянного). Если
+// повторы или запросы имени исчерпаны и ответа ждать не от кого, разрешение завершается ошибкой.
+void sendNext(Engine& engine, size_t slot, const std::string& reason) {
+    Lookup& lookup = engine.slots[slot];
+    while (lookup.attempts <= QUERY_RETRIES && *lookup.budget > 0) {
+        int index = chooseServer(engine, lookup, false);
+        if (index < 0) break;
+        if (sendQuery(engine, slot, index)) return;
+    }
+    if (!lookup.outstanding.empty()) return;
+    finishLookup(engine, slot, LookupStatus::FAILED, *lookup.budget > 0 ? reason : "Query budget exhausted.");
+}
+
+// Начинает новый шаг: запросы предыдущего шага, на которые еще ждется ответ, отменяются.
+void startStep(Engine& engine, size_t slot) {
+    Lookup& lookup = engine.slots[slot];
+    cancelStep(engine, lookup);
+    lookup.tried.clear();
+    lookup.attempts = 0;
+    if (lookup.iterations >= MAX_ITERATIONS) {
+        finishLookup(engine, slot, LookupStatus::FAILED, "Too many referrals.");
+        return;
+    }
+    sendNext(engine, slot, "No server could be queried.");
+}
+
+// Разрешает lookup.name: из кэша (в том числе через сохраненные CNAME) или запросами, начиная
+// с ближайшей зоны, делегирование которой известно.
+void resolveName(Engine& engine, size_t slot) {
+    Lookup& lookup = engine.slots[slot];
+    LookupStatus status;
+    while (true) {
+        if (answerFromCache(lookup, status)) {
+            dns_cache.hits++;
+            finishLookup(engine, slot, status);
+            return;
+        }
+        CacheEntry cname;
+        if (!cacheLookup(dns_cache, lookup.name, TYPE_CNAME, cname) || cname.records.empty()) break;
+        if (++lookup.cnames > MAX_CNAME_CHAIN) {
+            finishLookup(engine, slot, LookupStatus::FAILED, "CNAME chain too long.");
+            return;
+        }
+        if (debug_mode) std::cout << "Cached CNAME " << lookup.name << " -> " << cname.records[0].data << std::endl;
+        lookup.aliases.push_back(cname.records[0]);
+        lookup.aliases.back().ttl = remainingTtl(cname);
+        lookup.name = cname.records[0].data;
+    }
+    dns_cache.misses++;
+    lookup.servers = closestServers(lookup.name, lookup.zone);
+    if (debug_mode && !lookup.zone.empty()) std::cout << "Starting from cached delegation for zone " << lookup.zone << std::endl;
+    startStep(engine, slot);
+}
+
+// Начинает разрешение имени в слоте: из кэша или запросом к ближайшей известной зоне.
+void startLookup(Engine& engine, size_t slot) {
+    Lookup& lookup = engine.slots[slot];
+    lookup.name = normalizeName(lookup.hostname);
+    lookup.started = Clock::now();
+    if (!lookup.budget) lookup.budget = std::make_shared<int>(MAX_LOOKUP_QUERIES);
+    if (debug_mode) std::cout << "Starting resolution for " << lookup.hostname << " (type " << lookup.type << ")" << std::endl;
+    if (!isValidName(lookup.name)) {
+        finishLookup(engine, slot, LookupStatus::FAILED, "Invalid name.");
+        return;
+    }
+    resolveName(engine, slot);
+}
+
+// Делегирование без glue: адреса серверов имен разрешаются вложенными разрешениями с тем же
+// кэшем и бюджетом запросов. Разрешение одного имени сервера общее для всех, кто его ждет;
+// разрешение продолжается, как только известен адрес хотя бы одного сервера зоны.
+void resolveNameservers(Engine& engine, size_t slot) {
+    Lookup& lookup = engine.slots[slot];
+    lookup.servers.clear();
+    lookup.waiting = 0;
+    size_t started = 0;
+    for (const DnsRecord& ns : lookup.ns_records) {
+        if (started >= MAX_GLUELESS_NS || lookup.depth >= MAX_SUBLOOKUP_DEPTH) break;
+        // Сервер внутри самой делегируемой зоны без glue не разрешить: запрос придет к ней же.
+        if (inZone(ns.data, lookup.zone)) continue;
+        std::string key = cacheKey(ns.data, TYPE_A);
+        // Присоединяться можно только к более глубокому разрешению: так ожидания не замкнутся в цикл.
+        auto it = engine.nested.find(key);
+        bool shared = it != engine.nested.end() && engine.slots[it->second].depth > lookup.depth;
+        size_t nested_slot;
+        if (shared) {
+            nested_slot = it->second;
+        } else {
+            nested_slot = allocSlot(engine);
+            Lookup& nested = engine.slots[nested_slot];
+            nested.hostname = ns.data;
+            nested.type = TYPE_A;
+            nested.nested = true;
+            nested.depth = lookup.depth + 1;
+            nested.budget = lookup.budget;
+            if (it == engine.nested.end()) engine.nested[key] = nested_slot;
+            engine.stats.nested++;
+            if (debug_mode) std::cout << "Resolving nameserver " << ns.data << " for zone " << lookup.zone << std::endl;
+        }
+        engine.slots[nested_slot].waiters.push_back({slot, lookup.generation, lookup.iterations});
+        lookup.waiting++;
+        started++;
+        if (!shared) startLookup(engine, nested_slot);
+    }
+    if (lookup.waiting == 0) {
+        finishLookup(engine, slot, LookupStatus::FAILED, "No address for nameservers of zone " + lookup.zone + ".");
+    }
+}
+
+// Вложенное разрешение завершилось: ожидающее разрешение берет адреса своих серверов имен из кэша.
+void resumeWaiter(Engine& engine, const LookupWaiter& waiter) {
+    Lookup& lookup = engine.slots[waiter.slot];
+    if (lookup.generation != waiter.generation || lookup.status != LookupStatus::PENDING ||
+        lookup.iterations != waiter.iteration) {
+        return;
+    }
+    lookup.waiting--;
+    std::vector<std::string> servers = cachedAddresses(lookup.ns_records);
+    if (!servers.empty()) {
+        bool idle = lookup.servers.empty();
+        lookup.servers = servers;
+        if (idle) startStep(engine, waiter.slot);
+        return;
+    }
+    if (lookup.waiting == 0 && lookup.servers.empty()) {
+        finishLookup(engine, waiter.slot, LookupStatus::FAILED, "No address for nameservers of zone " + lookup.zone + ".");
+    }
+}
+
+// SOA из секции authority отрицательного ответа с TTL отрицательного ответа (RFC 2308, раздел 3).
+std::vector<DnsRecord> negativeAuthority(const DnsResponse& response) {
+    for (const DnsRecord& record : response.authority) {
+        if (record.type != TYPE_SOA || record.data.empty()) continue;
+        DnsRecord soa = record;
+        soa.ttl = std::min(response.negative_ttl, MAX_NEGATIVE_TTL);
+        return {soa};
+    }
+    return {};
+}
+
+// Разбирает ответ сервера зоны: окончательный ответ (возможно, после цепочки CNAME), NXDOMAIN,
+// отсутствие записей или делегирование в более глубокую зону (тогда начинается следующий шаг).
+void handleResponse(Engine& engine, size_t slot, const DnsResponse& response) {
+    Lookup& lookup = engine.slots[slot];
+    cancelStep(engine, lookup);
+
+    cacheSection(response.answers, lookup.zone);
+    // Цепочка CNAME в ответе: записи запрошенного типа ищутся у ее последнего имени.
+    std::string target = lookup.name;
+    while (true) {
+        auto cname = std::find_if(response.answers.begin(), response.answers.end(), [&](const DnsRecord& record) {
+            return record.type == TYPE_CNAME && record.name == target;
+        });
+        if (cname == response.answers.end()) break;
+        if (++lookup.cnames > MAX_CNAME_CHAIN) {
+            finishLookup(engine, slot, LookupStatus::FAILED, "CNAME chain too long.");
+            return;
+        }
+        lookup.aliases.push_back(*cname);
+        target = cname->data;
+    }
+    // NXDOMAIN относится к последнему имени цепочки, а не к запрошенному (RFC 6604): псевдонимы
+    // остаются в ответе, а отрицательный ответ сохраняется только для цели. Если цель вне зоны
+    // сервера, он за нее не отвечает — цель разрешается заново.
+    if ((response.flags & 0xF) == 3 && (target == lookup.name || inZone(target, lookup.zone))) {
+        lookup.name = target;
+        lookup.authority = negativeAuthority(response);
+        cacheNegative(dns_cache, lookup.name, TYPE_NXDOMAIN, response.negative_ttl, lookup.authority);
+        finishLookup(engine, slot, LookupStatus::NXDOMAIN);
+        return;
+    }
+    for (const DnsRecord& record : response.answers) {
+        if (record.type == lookup.type && record.name == target && inZone(target, lookup.zone)) {
+            lookup.records.push_back(record);
+        }
+    }
+    if (!lookup.records.empty()) {
+        finishLookup(engine, slot, LookupStatus::ANSWER);
+        return;
+    }
+    // Записей цели псевдонима в ответе нет или они вне зоны сервера: цель разрешается заново.
+    if (target != lookup.name) {
+        if (debug_mode) std::cout << "Following CNAME " << lookup.name << " -> " << target << std::endl;
+        engine.stats.cnames++;
+        lookup.name = target;
+        resolveName(engine, slot);
+        return;
+    }
+
+    // Делегирование: NS более глубокой зоны, в которой находится имя. Вместе с ним
+    // сохраняются адреса серверов имен из секции additional.
+    std::vector<DnsRecord> ns_records;
+    for (const DnsRecord& record : response.authority) {
+        if (record.type != TYPE_NS || record.name == lookup.zone || !inZone(record.name, lookup.zone) ||
+            !inZone(lookup.name, record.name)) {
+            continue;
+        }
+        if (ns_records.empty() || ns_records[0].name == record.name) ns_records.push_back(record);
+    }
+    if (ns_records.empty()) {
+        if (response.answers.empty() && ((response.flags & 0x0400) || response.negative_ttl > 0)) {
+            lookup.authority = negativeAuthority(response);
+            cacheNegative(dns_cache, lookup.name, lookup.type, response.negative_ttl, lookup.authority);
+            finishLookup(engine, slot, LookupStatus::NODATA);
+            return;
+        }
+        finishLookup(engine, slot, LookupStatus::FAILED, "No referral found.");
+        return;
+    }
+    cacheSection(response.authority, lookup.zone);
+    cacheSection(response.additional, lookup.zone);
+
+    lookup.zone = ns_records[0].name;
+    lookup.iterations++;
+    lookup.servers = cachedAddresses(ns_records);
+    if (debug_mode) std::cout << "Referral to zone " << lookup.zone << " for " << lookup.name << std::endl;
+    if (!lookup.servers.empty()) {
+        startStep(engine, slot);
+        return;
+    }
+    lookup.ns_records = ns_records;
+    resolveNameservers(engine, slot);
+}
+
+// Дописывает сообщение в файл записи в формате DNS поверх TCP: двухбайтная длина и само сообщение.
+void captureMessage(Engine& engine, const unsigned char* message, size_t length) {
+    unsigned char prefix[2] = {(unsigned char)(length >> 8), (unsigned char)length};
+    iovec parts[2] = {{prefix, sizeof(prefix)}, {(void*)message, length}};
+    if (writev(engine.capture_fd, parts, 2) < 0) {
+        perror("Failed to write capture");
+        close(engine.capture_fd);
+        engine.capture_fd = -1;
+    }
+}
+
+// Читает ICMP-ошибки из очереди ошибок сокета. В ошибке возвращается исходный запрос и адрес,
+// на который он был отправлен: запрос к недоступному серверу сразу передается другому серверу.
+void receiveErrors(Engine& engine, int socket_index) {
+    unsigned char buf[512];
+    char control[512];
+    while (true) {
+        sockaddr_in to{};
+        iovec iov{buf, sizeof(buf)};
+        msghdr msg{};
+        msg.msg_name = &to;
+        msg.msg_namelen = sizeof(to);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t received = recvmsg(engine.sockets[socket_index], &msg, MSG_ERRQUEUE);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (received < (ssize_t)sizeof(DNS_HEADER)) continue;
+        uint32_t key = (uint32_t)socket_index << 16 | read16(buf);
+        auto it = engine.pending.find(key);
+        if (it == engine.pending.end() || it->second.server.sin_addr.s_addr != to.sin_addr.s_addr) continue;
+        size_t slot = it->second.slot;
+        recordTimeout(serverStats(engine, it->second.server_ip));
+        if (debug_mode) std::cout << "Server " << it->second.server_ip << " unreachable" << std::endl;
+        engine.stats.unreachable++;
+        cancelQuery(engine, engine.slots[slot], key);
+        sendNext(engine, slot, "Servers unreachable.");
+    }
+}
+
+// Ответ на запрос key, сопоставленный по id и адресу сервера. Вопрос должен совпадать
+// с отправленным. Ответ без ошибки завершает шаг, остальные запросы шага отменяются; SERVFAIL,
+// REFUSED и испорченный ответ передают запрос другому серверу зоны, обрезанный (TC) — повторяется по TCP.
+void acceptResponse(Engine& engine, uint32_t key, DnsParser& parser) {
+    PendingQuery& query = engine.pending.at(key);
+    size_t slot = query.slot;
+    Lookup& lookup = engine.slots[slot];
+    if (!nameEquals(parser.question, lookup.name) || parser.question_type != lookup.type) {
+        engine.stats.mismatched++;
+        return;
+    }
+    const std::string server_ip = query.server_ip;
+    const sockaddr_in server = query.server;
+    bool tcp = query.tcp_fd >= 0;
+    // Время ответа по TCP включает установление соединения и для выбора сервера не годится.
+    if (!tcp) {
+        double rtt_ms = std::chrono::duration<double, std::milli>(Clock::now() - query.sent).count();
+        recordRtt(serverStats(engine, server_ip), rtt_ms);
+    }
+    int rcode = parser.flags & 0xF;
+    if (rcode != 0 && rcode != 3) {
+        if (debug_mode) std::cout << "Server " << server_ip << " failed with rcode " << rcode << std::endl;
+        cancelQuery(engine, lookup, key);
+        sendNext(engine, slot, "Server failure (rcode " + std::to_string(rcode) + ").");
+        return;
+    }
+    if ((parser.flags & 0x0200) && !tcp) {
+        cancelQuery(engine, lookup, key);
+        if (!sendTcpQuery(engine, slot, server_ip, server)) sendNext(engine, slot, "Truncated response.");
+        return;
+    }
+    DnsResponse response;
+    if (!parseRecords(parser, response)) {
+        if (debug_mode) std::cout << "Malformed response from " << server_ip << std::endl;
+        engine.stats.malformed++;
+        cancelQuery(engine, lookup, key);
+        sendNext(engine, slot, "Malformed response.");
+        return;
+    }
+    handleResponse(engine, slot, response);
+}
+
+// Читает ответы с сокета, пока они есть. Ответ принимается, только если id и адрес сервера
+// совпадают с отправленным запросом; остальное (опоздавшие ответы на повторенные запросы,
+// подделки) отбрасывается.
+void receiveResponses(Engine& engine, int socket_index) {
+    unsigned char buf[MAX_RESPONSE_SIZE];
+    while (true) {
+        sockaddr_in from{};
+        socklen_t from_length = sizeof(from);
+        ssize_t received = recvfrom(engine.sockets[socket_index], buf, sizeof(buf), 0, (sockaddr*)&from, &from_length);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            // Ошибка из очереди ICMP (ECONNREFUSED и т. п.): разбирается отдельно, чтение продолжается.
+            if (errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH) {
+                receiveErrors(engine, socket_index);
+                continue;
+            }
+            perror("recvfrom failed");
+            return;
+        }
+        // Заголовок и вопрос разбираются без выделения памяти: чужие и испорченные ответы
+        // отбрасываются до построения записей.
+        if (engine.capture_fd >= 0) captureMessage(engine, buf, received);
+        DnsParser parser;
+        if (!beginParse(parser, buf, received)) {
+            engine.stats.mismatched++;
+            continue;
+        }
+        uint32_t key = (uint32_t)socket_index << 16 | parser.id;
+        auto it = engine.pending.find(key);
+        if (it == engine.pending.end() || from.sin_addr.s_addr != it->second.server.sin_addr.s_addr ||
+            from.sin_port != it->second.server.sin_port) {
+            engine.stats.mismatched++;
+            continue;
+        }
+        acceptResponse(engine, key, parser);
+    }
+}
+
+// TCP-запрос: отправка, когда соединение установлено, затем чтение ответа с двухбайтной длиной.
+// Обрыв соединения или ответ не на тот вопрос передает запрос другому серверу зоны.
+void handleTcpEvent(Engine& engine, uint32_t key, uint32_t events) {
+    auto it = engine.pending.find(key);
+    if (it == engine.pending.end()) return;
+    PendingQuery& query = it->second;
+    bool failed = false, eof = false;
+    if (query.tcp_written < query.tcp_out.size() && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        ssize_t written = write(query.tcp_fd, query.tcp_out.data() + query.tcp_written,
+                                query.tcp_out.size() - query.tcp_written);
+        if (written < 0 && errno != EAGAIN && errno != EINTR) {
+            failed = true;
+        } else if (written > 0 && (query.tcp_written += written) == query.tcp_out.size()) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = (uint64_t)EVENT_TCP << 32 | key;
+            epoll_ctl(engine.epoll_fd, EPOLL_CTL_MOD, query.tcp_fd, &ev);
+        }
+    }
+    while (!failed && !eof && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        char buf[4096];
+        ssize_t received = read(query.tcp_fd, buf, sizeof(buf));
+        if (received > 0) {
+            query.tcp_in.append(buf, received);
+            failed = query.tcp_in.size() > 2 + MAX_RESPONSE_SIZE;
+        } else if (received == 0) {
+            eof = true;
+        } else if (errno != EINTR) {
+            failed = errno != EAGAIN;
+            break;
+        }
+    }
+
+    const unsigned char* in = (const unsigned char*)query.tcp_in.data();
+    bool complete = query.tcp_in.size() >= 2 && query.tcp_in.size() >= 2 + (size_t)read16(in);
+    if (!failed && complete) {
+        std::string message = query.tcp_in.substr(2, read16(in));
+        if (engine.capture_fd >= 0) captureMessage(engine, (const unsigned char*)message.data(), message.size());
+        DnsParser parser;
+        if (beginParse(parser, (const unsigned char*)message.data(), message.size()) && parser.id == (key & 0xFFFF)) {
+            acceptResponse(engine, key, parser);
+        }
+    } else if (!failed && !eof) {
+        return;
+    }
+
+    it = engine.pending.find(key);
+    if (it == engine.pending.end()) return;
+    size_t slot = it->second.slot;
+    if (debug_mode) std::cout << "TCP query to " << it->second.server_ip << " failed" << std::endl;
+    cancelQuery(engine, engine.slots[slot], key);
+    sendNext(engine, slot, "TCP query failed.");
+}
+
+// Поворачивает колесо до текущего времени. Запись ячейки действует, если запрос с тем же serial
+// все еще ждет ответа: таймаут передает запрос другому серверу, а hedge добавляет параллельный
+// запрос серверу зоны, который на этом шаге еще не опрашивался.
+void expireQueries(Engine& engine) {
+    auto now = Clock::now();
+    while (now - engine.wheel_time >= std::chrono::milliseconds(TIMER_TICK_MS)) {
+        engine.wheel_time += std::chrono::milliseconds(TIMER_TICK_MS);
+        engine.wheel_pos = (engine.wheel_pos + 1) % TIMER_WHEEL_SLOTS;
+        std::vector<TimerEntry> due;
+        due.swap(engine.wheel[engine.wheel_pos]);
+        for (const TimerEntry& entry : due) {
+            auto it = engine.pending.find(entry.key);
+            if (it == engine.pending.end() || it->second.serial != entry.serial) continue;
+            size_t slot = it->second.slot;
+            Lookup& lookup = engine.slots[slot];
+            if (entry.hedge) {
+                if (lookup.attempts > QUERY_RETRIES || *lookup.budget <= 0) continue;
+                int index = chooseServer(engine, lookup, true);
+                if (index < 0) continue;
+                if (debug_mode) std::cout << "Hedging query for " << lookup.name << std::endl;
+                if (sendQuery(engine, slot, index)) engine.stats.hedged++;
+                continue;
+            }
+            if (it->second.tcp_fd < 0) recordTimeout(serverStats(engine, it->second.server_ip));
+            engine.stats.timeouts++;
+            cancelQuery(engine, lookup, entry.key);
+            sendNext(engine, slot, "Timed out.");
+        }
+    }
+}
+
+// Передает завершенные разрешения: имена из next — в done, вложенные — ожидающим их разрешениям.
+// Освобожденные слоты переиспользуются. active — сколько имен из next еще разрешается.
+void processFinished(Engine& engine, const std::function<void(const Lookup&)>& done, size_t& active) {
+    while (!engine.finished.empty()) {
+        size_t slot = engine.finished.back();
+        engine.finished.pop_back();
+        Lookup& lookup = engine.slots[slot];
+        // Запросы, на которые еще ждется ответ, не должны достаться следующему имени в этом слоте.
+        cancelStep(engine, lookup);
+        if (!lookup.nested) {
+            done(lookup);
+            active--;
+            engine.free_slots.push_back(slot);
+            continue;
+        }
+        auto it = engine.nested.find(cacheKey(lookup.hostname, TYPE_A));
+        if (it != engine.nested.end() && it->second == slot) engine.nested.erase(it);
+        std::vector<LookupWaiter> waiters;
+        waiters.swap(lookup.waiters);
+        for (const LookupWaiter& waiter : waiters) resumeWaiter(engine, waiter);
+        engine.free_slots.push_back(slot);
+    }
+}
+
+// Ждет событий не дольше одного тика колеса и обрабатывает их, затем поворачивает колесо.
+bool pollEngine(Engine& engine) {
+    epoll_event events[64];
+    int n = epoll_wait(engine.epoll_fd, events, 64, TIMER_TICK_MS);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait failed");
+        return false;
+    }
+    for (int i = 0; i < n; ++i) {
+        uint32_t id = (uint32_t)events[i].data.u64;
+        uint32_t kind = events[i].data.u64 >> 32;
+        if (kind >= EVENT_EXTERNAL) {
+            engine.on_event(events[i].data.u64, events[i].events);
+            continue;
+        }
+        if (kind == EVENT_TCP) {
+            handleTcpEvent(engine, id, events[i].events);
+            continue;
+        }
+        if (events[i].events & EPOLLERR) receiveErrors(engine, id);
+        receiveResponses(engine, id);
+    }
+    expireQueries(engine);
+    return true;
+}
+
+// Разрешает имена, которые выдает next, держа одновременно до max_in_flight разрешений.
+// done вызывается для каждого завершенного имени, после чего его слот переиспользуется,
+// поэтому память не зависит от длины списка имен.
+void runLookups(Engine& engine, size_t max_in_flight, const std::function<bool(Lookup&)>& next,
+                const std::function<void(const Lookup&)>& done) {
+    size_t active = 0;
+    bool input_done = false;
+
+    while (true) {
+        while (!input_done && active < max_in_flight) {
+            size_t slot = allocSlot(engine);
+            if (!next(engine.slots[slot])) {
+                engine.free_slots.push_back(slot);
+                input_done = true;
+                break;
+            }
+            active++;
+            startLookup(engine, slot);
+        }
+
+        processFinished(engine, done, active);
+        if (active == 0) {
+            if (input_done) return;
+            continue;
+        }
+        if (!pollEngine(engine)) return;
+    }
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "http_message.h"
+#include <string>
+#include <string_view>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+const time_t HEURISTIC_FRESHNESS_MAX = 24 * 3600;
+// Коды, ответы с которыми можно сохранять без явного разрешения (RFC 9110, раздел 15.1).
+const int CACHEABLE_STATUSES[] = {200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501};
+
+// Свежесть и валидаторы сохраненного ответа. Время — абсолютное (Unix), чтобы оставаться
+// верным и для файлов дискового кэша после перезапуска.
+struct CachePolicy {
+    // До этого момента ответ свежий и отдается без обращения к серверу.
+    time_t expires = 0;
+    // Сколько секунд после expires устаревший ответ еще можно отдавать, обновляя его в фоне.
+    time_t stale_while_revalidate = 0;
+    // no-cache или must-revalidate: устаревший ответ отдается только после проверки на сервере.
+    bool must_revalidate = false;
+    std::string etag;
+    std::string last_modified;
+};
+
+// Дата в формате IMF-fixdate: "Sun, 06 Nov 1994 08:49:37 GMT".
+std::string format_http_date(time_t time) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+    char buffer[64];
+    size_t n = strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buffer, n);
+}
+
+bool parse_http_date(std::string_view value, time_t& result) {
+    if (value.size() >= 64) return false;
+    char buffer[64];
+    memcpy(buffer, value.data(), value.size());
+    buffer[value.size()] = '\0';
+
+    struct tm tm{};
+    const char* end = strptime(buffer, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != '\0') return false;
+    result = timegm(&tm);
+    return true;
+}
+
+// Ищет директиву в списке Cache-Control. Если передан value и у директивы есть числовое
+// значение ("max-age=60" или "max-age=\"60\""), оно записывается в value.
+bool cache_directive(std::string_view cache_control, std::string_view name, time_t* value = nullptr) {
+    while (!cache_control.empty()) {
+        size_t comma = cache_control.find(',');
+        std::string_view item = trim(cache_control.substr(0, comma));
+        cache_control = comma == std::string_view::npos ? std::string_view() : cache_control.substr(comma + 1);
+
+        size_t equals = item.find('=');
+        if (!equals_ignore_case(trim(item.substr(0, equals)), name)) continue;
+        if (value != nullptr) {
+            if (equals == std::string_view::npos) return false;
+            std::string number(trim(item.substr(equals + 1)));
+            number.erase(std::remove(number.begin(), number.end(), '"'), number.end());
+            char* end;
+            long long parsed = strtoll(number.c_str(), &end, 10);
+            if (number.empty() || *end != '\0' || parsed < 0) return false;
+            *value = parsed;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool cacheable_status(int status) {
+    return std::find(std::begin(CACHEABLE_STATUSES), std::end(CACHEABLE_STATUSES), status) != std::end(CACHEABLE_STATUSES);
+}
+
+// Валидаторы можно сохранить в метаданных кэша, только если в них нет разделителей строки метаданных.
+std::string_view storable_validator(std::string_view value) {
+    return value.find_first_of("\t\r\n") == std::string_view::npos ? value : std::string_view();
+}
+
+// Вычисляет свежесть ответа по Cache-Control (s-maxage, max-age), Expires относительно Date или,
+// если явного срока нет, эвристически — 10% времени с Last-Modified (RFC 9111, раздел 4.2).
+time_t freshness_lifetime(const ResponseHead& response, const std::string& cache_control, time_t now, bool& explicit_lifetime) {
+    time_t lifetime;
+    explicit_lifetime = true;
+    if (cache_directive(cache_control, "s-maxage", &lifetime) || cache_directive(cache_control, "max-age", &lifetime)) {
+        return lifetime;
+    }
+
+    time_t date = now;
+    std::string_view date_header = find_header(response.headers, "Date");
+    if (!date_header.empty()) parse_http_date(date_header, date);
+    std::string_view expires_header = find_header(response.headers, "Expires");
+    if (!expires_header.empty()) {
+        time_t expires;
+        // Некорректная дата (например, "0") означает, что ответ уже устарел.
+        if (!parse_http_date(expires_header, expires)) return 0;
+        return std::max<time_t>(0, expires - date);
+    }
+
+    explicit_lifetime = false;
+    time_t last_modified;
+    if (parse_http_date(find_header(response.headers, "Last-Modified"), last_modified) && last_modified < date) {
+        return std::min(HEURISTIC_FRESHNESS_MAX, (date - last_modified) / 10);
+    }
+    return 0;
+}
+
+bool has_validators(const CachePolicy& policy) {
+    return !policy.etag.empty() || !policy.last_modified.empty();
+}
+
+// Заполняет срок свежести и валидаторы ответа.
+void compute_cache_policy(const ResponseHead& response, const std::string& cache_control, time_t now,
+                          CachePolicy& policy, bool& explicit_lifetime) {
+    time_t lifetime = freshness_lifetime(response, cache_control, now, explicit_lifetime);
+    time_t age = 0;
+    std::string_view age_header = find_header(response.headers, "Age");
+    if (!age_header.empty()) age = std::max(0ll, atoll(std::string(age_header).c_str()));
+
+    bool no_cache = cache_directive(cache_control, "no-cache");
+    policy.must_revalidate = no_cache || cache_directive(cache_control, "must-revalidate") ||
+                             cache_directive(cache_control, "proxy-revalidate");
+    policy.expires = no_cache ? now : now + std::max<time_t>(0, lifetime - age);
+    policy.stale_while_revalidate = 0;
+    cache_directive(cache_control, "stale-while-revalidate", &policy.stale_while_revalidate);
+    policy.etag = storable_validator(find_header(response.headers, "ETag"));
+    policy.last_modified = storable_validator(find_header(response.headers, "Last-Modified"));
+}
+
+// Решает, можно ли сохранить ответ в общем кэше, и заполняет policy. Не сохраняются ответы
+// с no-store, private и Vary: *, а также ответы с кодами не из CACHEABLE_STATUSES без явного срока.
+bool response_cache_policy(const ResponseHead& response, time_t now, CachePolicy& policy) {
+    if (response.status < 200 || response.status == 206 || response.status == 304) return false;
+    std::string cache_control = joined_header(response.headers, "Cache-Control");
+    if (cache_directive(cache_control, "no-store") || cache_directive(cache_control, "private")) return false;
+    if (trim(find_header(response.headers, "Vary")) == "*") return false;
+
+    bool explicit_lifetime;
+    compute_cache_policy(response, cache_control, now, policy, explicit_lifetime);
+    if (!cacheable_status(response.status) && !explicit_lifetime) return false;
+    // Без срока свежести и без валидаторов сохраненный ответ нельзя ни отдать, ни проверить.
+    return policy.expires > now || has_validators(policy);
+}
+
+// Ответ на запрос с Authorization общий кэш сохраняет, только если сервер явно это разрешил
+// (RFC 9111, раздел 3.5). Ключ кэша — один URL, поэтому ответ с Vary по заголовкам запроса тоже
+// не сохраняется; исключение — Accept-Encoding, который прокси серверу не пересылает.
+bool shared_response_storable(const ResponseHead& response, bool authorized) {
+    std::string cache_control = joined_header(response.headers, "Cache-Control");
+    if (authorized && !cache_directive(cache_control, "public") && !cache_directive(cache_control, "s-maxage") &&
+        !cache_directive(cache_control, "must-revalidate")) {
+        return false;
+    }
+    std::string vary = joined_header(response.headers, "Vary");
+    std::string_view list = vary;
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view name = trim(list.substr(0, comma));
+        if (!name.empty() && !equals_ignore_case(name, "Accept-Encoding")) return false;
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+    }
+    return true;
+}
+
+// Обновляет метаданные после ответа 304: новые заголовки заменяют сохраненные (RFC 9111, раздел 4.3.4).
+void refresh_cache_policy(CachePolicy& policy, const ResponseHead& not_modified, time_t now) {
+    CachePolicy refreshed;
+    bool explicit_lifetime;
+    compute_cache_policy(not_modified, joined_header(not_modified.headers, "Cache-Control"), now, refreshed, explicit_lifetime);
+    if (refreshed.etag.empty()) refreshed.etag = policy.etag;
+    if (refreshed.last_modified.empty()) refreshed.last_modified = policy.last_modified;
+    policy = refreshed;
+}
+
+bool is_fresh(const CachePolicy& policy, time_t now) {
+    return now < policy.expires;
+}
+
+bool can_serve_stale(const CachePolicy& policy, time_t now) {
+    return !policy.must_revalidate && now < policy.expires + policy.stale_while_revalidate;
+}
+
+// Заголовки условного запроса для проверки сохраненного ответа на сервере.
+std::string conditional_headers(const CachePolicy& policy) {
+    std::string headers;
+    if (!policy.etag.empty()) headers += "If-None-Match: " + policy.etag + "\r\n";
+    if (!policy.last_modified.empty()) headers += "If-Modified-Since: " + policy.last_modified + "\r\n";
+    return headers;
+}
+
+// Метаданные в файле дискового кэша: "expires swr must_revalidate\tETag\tLast-Modified".
+std::string format_cache_policy(const CachePolicy& policy) {
+    return std::to_string(policy.expires) + " " + std::to_string(policy.stale_while_revalidate) + " " +
+           (policy.must_revalidate ? "1" : "0") + "\t" + policy.etag + "\t" + policy.last_modified;
+}
+
+bool parse_cache_policy(std::string_view line, CachePolicy& policy) {
+    size_t first_tab = line.find('\t');
+    size_t second_tab = line.find('\t', first_tab + 1);
+    if (first_tab == std::string_view::npos || second_tab == std::string_view::npos) return false;
+    long long expires, swr;
+    int must_revalidate;
+    std::string numbers(line.substr(0, first_tab));
+    if (sscanf(numbers.c_str(), "%lld %lld %d", &expires, &swr, &must_revalidate) != 3) return false;
+    policy.expires = expires;
+    policy.stale_while_revalidate = swr;
+    policy.must_revalidate = must_revalidate != 0;
+    policy.etag = line.substr(first_tab + 1, second_tab - first_tab - 1);
+    policy.last_modified = trim(line.substr(second_tab + 1));
+    return true;
+}
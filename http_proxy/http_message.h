@@ -0,0 +1,338 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <strings.h>
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+// Заголовок ответа сервера. Строки ссылаются на буфер, из которого он разобран.
+struct ResponseHead {
+    std::string_view version;
+    int status = 0;
+    std::vector<HttpHeader> headers;
+};
+
+// Заголовок запроса клиента. Строки ссылаются на буфер, из которого он разобран.
+struct RequestHead {
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    std::vector<HttpHeader> headers;
+};
+
+// Заголовки одного соединения (RFC 9110, раздел 7.6.1) и заголовки, адресованные прокси: они не
+// пересылаются дальше. Transfer-Encoding сюда не входит: тело передается в исходной разметке.
+const char* const HOP_BY_HOP_HEADERS[] = {"Connection", "Proxy-Connection", "Keep-Alive", "TE", "Upgrade",
+                                         "Proxy-Authorization", "Proxy-Authenticate"};
+
+bool equals_ignore_case(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+std::string_view trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t' || value.back() == '\r')) value.remove_suffix(1);
+    return value;
+}
+
+// Разбирает строки "Имя: значение" после первой строки сообщения. block — все до пустой строки.
+// Продолженные строки (obs-fold) не принимаются (RFC 9112, раздел 5.2).
+bool parse_header_lines(std::string_view block, std::vector<HttpHeader>& headers) {
+    size_t line_end = block.find('\n');
+    while (line_end != std::string_view::npos) {
+        block.remove_prefix(line_end + 1);
+        line_end = block.find('\n');
+        if (!block.empty() && (block.front() == ' ' || block.front() == '\t')) return false;
+        std::string_view line = trim(block.substr(0, line_end));
+        if (line.empty()) continue;
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos || colon == 0) return false;
+        headers.push_back({trim(line.substr(0, colon)), trim(line.substr(colon + 1))});
+    }
+    return true;
+}
+
+// Разбирает строку статуса и заголовки ответа; head заканчивается пустой строкой.
+bool parse_response_head(std::string_view head, ResponseHead& response) {
+    size_t line_end = head.find('\n');
+    std::string_view status_line = trim(head.substr(0, line_end));
+    size_t space = status_line.find(' ');
+    if (space == std::string_view::npos || status_line.substr(0, 5) != "HTTP/") return false;
+    response.version = status_line.substr(0, space);
+    std::string_view code = status_line.substr(space + 1, 3);
+    if (code.size() != 3 || code.find_first_not_of("0123456789") != std::string_view::npos) return false;
+    response.status = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+    return parse_header_lines(head, response.headers);
+}
+
+// Разбирает строку запроса "МЕТОД цель HTTP/1.x" и заголовки; head заканчивается пустой строкой.
+bool parse_request_head(std::string_view head, RequestHead& request) {
+    std::string_view request_line = trim(head.substr(0, head.find('\n')));
+    size_t first_space = request_line.find(' ');
+    size_t second_space = request_line.find(' ', first_space + 1);
+    if (first_space == 0 || first_space == std::string_view::npos || second_space == std::string_view::npos) return false;
+    request.method = request_line.substr(0, first_space);
+    request.target = request_line.substr(first_space + 1, second_space - first_space - 1);
+    request.version = request_line.substr(second_space + 1);
+    if (request.method.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ") != std::string_view::npos ||
+        request.target.empty() || request.version.substr(0, 7) != "HTTP/1.") {
+        return false;
+    }
+    return parse_header_lines(head, request.headers);
+}
+
+std::string_view find_header(const std::vector<HttpHeader>& headers, std::string_view name) {
+    for (const HttpHeader& header : headers) {
+        if (equals_ignore_case(header.name, name)) return header.value;
+    }
+    return {};
+}
+
+// Значения всех заголовков с этим именем через запятую (так объединяются повторы Cache-Control).
+std::string joined_header(const std::vector<HttpHeader>& headers, std::string_view name) {
+    std::string result;
+    for (const HttpHeader& header : headers) {
+        if (!equals_ignore_case(header.name, name)) continue;
+        if (!result.empty()) result += ", ";
+        result += header.value;
+    }
+    return result;
+}
+
+// Есть ли элемент token в списке через запятую (Connection, Expect, Transfer-Encoding).
+bool list_has_token(std::string_view list, std::string_view token) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        if (equals_ignore_case(trim(list.substr(0, comma)), token)) return true;
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+    }
+    return false;
+}
+
+// Заголовок не пересылается: он из HOP_BY_HOP_HEADERS или назван в Connection этого сообщения.
+bool hop_by_hop_header(std::string_view name, std::string_view connection) {
+    for (const char* header : HOP_BY_HOP_HEADERS) {
+        if (equals_ignore_case(name, header)) return true;
+    }
+    return list_has_token(connection, name);
+}
+
+// Безопасные методы не меняют ресурс; идемпотентный запрос можно повторить (RFC 9110, раздел 9.2).
+bool safe_method(std::string_view method) {
+    return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "TRACE";
+}
+
+bool idempotent_method(std::string_view method) {
+    return safe_method(method) || method == "PUT" || method == "DELETE";
+}
+
+// Промежуточный ответ 1xx (например, 100 Continue), за которым последует окончательный.
+// 101 Switching Protocols окончательный.
+bool interim_response(std::string_view head) {
+    size_t space = head.find(' ');
+    if (head.substr(0, 5) != "HTTP/" || space == std::string_view::npos) return false;
+    std::string_view code = head.substr(space + 1, 3);
+    return code.size() == 3 && code[0] == '1' && code != "101";
+}
+
+// Заголовок ответа для клиента: без заголовков соединения с сервером и с Connection: close,
+// так как соединение с клиентом закрывается после ответа.
+std::string client_response_head(std::string_view head, const ResponseHead& response) {
+    std::string result(trim(head.substr(0, head.find('\n'))));
+    result += "\r\n";
+    std::string connection = joined_header(response.headers, "Connection");
+    for (const HttpHeader& header : response.headers) {
+        if (hop_by_hop_header(header.name, connection)) continue;
+        result.append(header.name).append(": ").append(header.value).append("\r\n");
+    }
+    result += "Connection: close\r\n\r\n";
+    return result;
+}
+
+// Постоянное ли соединение с сервером после этого ответа: в HTTP/1.1 — если нет Connection: close,
+// в HTTP/1.0 — только с явным Connection: keep-alive.
+bool response_keep_alive(const ResponseHead& response) {
+    std::string connection = joined_header(response.headers, "Connection");
+    if (response.version == "HTTP/1.0") return list_has_token(connection, "keep-alive");
+    return !list_has_token(connection, "close");
+}
+
+enum class BodyFraming {
+    NONE,
+    LENGTH,
+    CHUNKED,
+    UNTIL_CLOSE
+};
+
+enum class ChunkState {
+    SIZE_LINE,
+    DATA,
+    TRAILER,
+    DONE
+};
+
+const size_t MAX_CHUNK_LINE = 4096;
+// Размер одного куска chunked-кодирования: больше не бывает у настоящих серверов, а размер
+// вместе с CRLF не переполняет счетчик.
+const uint64_t MAX_CHUNK_SIZE = 1ULL << 40;
+
+// Граница тела ответа (RFC 9112, раздел 6.3): по Content-Length, по кускам chunked-кодирования
+// или по закрытию соединения. Данные тела и кусков проходят мимо разбора (их можно переносить
+// через splice), а строки размеров кусков и трейлеры разбираются в памяти.
+struct BodyReader {
+    BodyFraming framing = BodyFraming::UNTIL_CLOSE;
+    // LENGTH — сколько байт тела осталось; CHUNKED — сколько осталось в текущем куске вместе с CRLF после него.
+    uint64_t remaining = 0;
+    ChunkState chunk_state = ChunkState::SIZE_LINE;
+    std::string line;
+    bool error = false;
+};
+
+// Граница сообщения без тела.
+BodyReader no_body_reader() {
+    BodyReader reader;
+    reader.framing = BodyFraming::NONE;
+    return reader;
+}
+
+// Граница тела по Transfer-Encoding и Content-Length. Без них тело ответа читается до закрытия
+// соединения (without_length = UNTIL_CLOSE), а у запроса тела нет (NONE).
+void init_body_framing(BodyReader& reader, const std::vector<HttpHeader>& headers, BodyFraming without_length) {
+    reader = BodyReader();
+    std::string transfer_encoding = joined_header(headers, "Transfer-Encoding");
+    if (!transfer_encoding.empty()) {
+        std::string_view last = trim(std::string_view(transfer_encoding).substr(transfer_encoding.rfind(',') + 1));
+        reader.framing = equals_ignore_case(last, "chunked") ? BodyFraming::CHUNKED : BodyFraming::UNTIL_CLOSE;
+        return;
+    }
+    reader.framing = without_length;
+    // Content-Length принимается только один раз и с одним числом: при повторе заголовка (даже
+    // с тем же значением) или списке значений прокси и сервер могут выбрать разные границы тела
+    // (RFC 9112, раздел 6.3), поэтому такое сообщение отвергается целиком.
+    int count = 0;
+    std::string_view content_length;
+    for (const HttpHeader& header : headers) {
+        if (!equals_ignore_case(header.name, "Content-Length")) continue;
+        content_length = header.value;
+        count++;
+    }
+    if (count == 0) return;
+    std::string digits(content_length);
+    if (count > 1 || digits.empty() || digits.find_first_not_of("0123456789") != std::string::npos) {
+        reader.error = true;
+        return;
+    }
+    errno = 0;
+    unsigned long long length = strtoull(digits.c_str(), nullptr, 10);
+    if (errno == ERANGE) {
+        reader.error = true;
+        return;
+    }
+    reader.framing = BodyFraming::LENGTH;
+    reader.remaining = length;
+}
+
+void init_body_reader(BodyReader& reader, const ResponseHead& response) {
+    init_body_framing(reader, response.headers, BodyFraming::UNTIL_CLOSE);
+    if (response.status < 200 || response.status == 204 || response.status == 304) reader = no_body_reader();
+}
+
+// Тело запроса. Запрос с Transfer-Encoding без chunked в конце или одновременно с Content-Length,
+// а также с повторенным или неверным Content-Length отклоняется: иначе прокси и сервер могут
+// по-разному найти границу (request smuggling).
+bool init_request_body_reader(BodyReader& reader, const RequestHead& request) {
+    init_body_framing(reader, request.headers, BodyFraming::NONE);
+    bool both = !find_header(request.headers, "Transfer-Encoding").empty() &&
+                !find_header(request.headers, "Content-Length").empty();
+    return !reader.error && !both && reader.framing != BodyFraming::UNTIL_CLOSE;
+}
+
+bool body_complete(const BodyReader& reader) {
+    switch (reader.framing) {
+    case BodyFraming::NONE: return true;
+    case BodyFraming::LENGTH: return reader.remaining == 0;
+    case BodyFraming::CHUNKED: return reader.chunk_state == ChunkState::DONE;
+    case BodyFraming::UNTIL_CLOSE: return false;
+    }
+    return false;
+}
+
+// Сколько следующих байт тела можно передать без разбора. 0 — дальше строка разметки chunked.
+uint64_t body_passthrough(const BodyReader& reader) {
+    switch (reader.framing) {
+    case BodyFraming::LENGTH: return reader.remaining;
+    case BodyFraming::CHUNKED: return reader.chunk_state == ChunkState::DATA ? reader.remaining : 0;
+    case BodyFraming::UNTIL_CLOSE: return UINT64_MAX;
+    default: return 0;
+    }
+}
+
+void body_skip(BodyReader& reader, uint64_t n) {
+    if (reader.framing == BodyFraming::UNTIL_CLOSE) return;
+    reader.remaining -= n;
+    if (reader.framing == BodyFraming::CHUNKED && reader.remaining == 0) reader.chunk_state = ChunkState::SIZE_LINE;
+}
+
+void body_line(BodyReader& reader) {
+    std::string_view line = reader.line;
+    if (!line.empty() && line.back() == '\n') line.remove_suffix(1);
+    line = trim(line);
+    if (reader.chunk_state == ChunkState::TRAILER) {
+        if (line.empty()) reader.chunk_state = ChunkState::DONE;
+        return;
+    }
+    // Только шестнадцатеричные цифры: strtoull приняла бы и "-1", "+1", "0x1", а сервер прочел бы их иначе.
+    std::string size(trim(line.substr(0, line.find(';'))));
+    if (size.empty() || size.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+        reader.error = true;
+        return;
+    }
+    errno = 0;
+    unsigned long long chunk_size = strtoull(size.c_str(), nullptr, 16);
+    if (errno == ERANGE || chunk_size > MAX_CHUNK_SIZE) {
+        reader.error = true;
+        return;
+    }
+    if (chunk_size == 0) {
+        reader.chunk_state = ChunkState::TRAILER;
+    } else {
+        reader.chunk_state = ChunkState::DATA;
+        reader.remaining = chunk_size + 2;
+    }
+}
+
+// Пропускает через разбор байты тела из памяти. Возвращает, сколько из них относится к телу:
+// меньше n, если тело закончилось раньше или разметка некорректна (reader.error).
+size_t body_consume(BodyReader& reader, const char* data, size_t n) {
+    size_t consumed = 0;
+    while (consumed < n && !body_complete(reader) && !reader.error) {
+        uint64_t passthrough = body_passthrough(reader);
+        if (passthrough > 0) {
+            size_t take = std::min<uint64_t>(passthrough, n - consumed);
+            body_skip(reader, take);
+            consumed += take;
+            continue;
+        }
+        const char* newline = (const char*)memchr(data + consumed, '\n', n - consumed);
+        size_t take = newline ? newline - (data + consumed) + 1 : n - consumed;
+        reader.line.append(data + consumed, take);
+        consumed += take;
+        if (reader.line.size() > MAX_CHUNK_LINE) {
+            reader.error = true;
+        } else if (newline) {
+            body_line(reader);
+            reader.line.clear();
+        }
+    }
+    return consumed;
+}
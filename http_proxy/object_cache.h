@@ -0,0 +1,478 @@
+#pragma once
+
+#include "cache_policy.h"
+#include <string>
+#include <string_view>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const std::string CACHE_DIR = "cache/";
+const size_t MEMORY_CACHE_SHARDS = 16;
+const size_t MEMORY_CACHE_CAPACITY = 64 * 1024 * 1024;
+const size_t MEMORY_CACHE_MAX_ENTRY = 1024 * 1024;
+const size_t DISK_CACHE_CAPACITY = 1024ull * 1024 * 1024;
+// Размер строки метаданных (CachePolicy) в файле кэша. Она фиксированной длины, чтобы после
+// ответа 304 ее можно было перезаписать на месте.
+const size_t CACHE_META_SIZE = 512;
+
+// Приводит URL к каноническому виду, чтобы разные записи одного ресурса попадали в одну запись кэша:
+// схема и хост — в нижнем регистре, порт 80 опускается, пустой путь заменяется на "/", фрагмент отбрасывается.
+std::string normalize_url(std::string_view url) {
+    std::string result = "http://";
+    if (url.size() >= 7 && strncasecmp(url.data(), "http://", 7) == 0) url.remove_prefix(7);
+
+    size_t authority_end = std::min(url.find_first_of("/?#"), url.size());
+    std::string host(url.substr(0, authority_end));
+    std::transform(host.begin(), host.end(), host.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (host.size() > 3 && host.compare(host.size() - 3, 3, ":80") == 0) host.resize(host.size() - 3);
+    result += host;
+
+    std::string_view rest = url.substr(authority_end);
+    rest = rest.substr(0, rest.find('#'));
+    if (rest.empty() || rest.front() != '/') result += '/';
+    result += rest;
+    return result;
+}
+
+// FNV-1a: хеш не зависит от реализации стандартной библиотеки, поэтому имена файлов
+// дискового кэша остаются прежними между сборками и перезапусками.
+uint64_t url_hash(std::string_view url) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : url) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Ответ сервера целиком (строка статуса, заголовки и тело), готовый к отправке одним send.
+struct CachedObject {
+    std::string url;
+    std::string bytes;
+    CachePolicy policy;
+};
+
+struct MemoryCacheEntry {
+    uint64_t key;
+    std::shared_ptr<const CachedObject> object;
+};
+
+// Часть кэша со своей блокировкой: воркеры, обращающиеся к разным частям, не мешают друг другу.
+struct MemoryCacheShard {
+    std::mutex mutex;
+    size_t size = 0;
+    std::list<MemoryCacheEntry> lru;
+    std::unordered_map<uint64_t, std::list<MemoryCacheEntry>::iterator> index;
+};
+
+// LRU объектов в памяти, общий для всех воркеров, с ограничением по объему. Ключ — хеш
+// нормализованного URL; при совпадении хешей разных URL запись просто не находится.
+struct MemoryCache {
+    size_t shard_capacity = MEMORY_CACHE_CAPACITY / MEMORY_CACHE_SHARDS;
+    size_t max_entry = MEMORY_CACHE_MAX_ENTRY;
+    MemoryCacheShard shards[MEMORY_CACHE_SHARDS];
+};
+
+MemoryCacheShard& memory_cache_shard(MemoryCache& cache, uint64_t key) {
+    return cache.shards[(key >> 32) % MEMORY_CACHE_SHARDS];
+}
+
+std::shared_ptr<const CachedObject> memory_cache_lookup(MemoryCache& cache, uint64_t key, const std::string& url) {
+    MemoryCacheShard& shard = memory_cache_shard(cache, key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found == shard.index.end() || found->second->object->url != url) return nullptr;
+    shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+    return found->second->object;
+}
+
+void memory_cache_erase(MemoryCacheShard& shard, std::list<MemoryCacheEntry>::iterator it) {
+    shard.size -= it->object->bytes.size();
+    shard.index.erase(it->key);
+    shard.lru.erase(it);
+}
+
+void memory_cache_remove(MemoryCache& cache, uint64_t key) {
+    MemoryCacheShard& shard = memory_cache_shard(cache, key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) memory_cache_erase(shard, found->second);
+}
+
+void memory_cache_insert(MemoryCache& cache, uint64_t key, std::shared_ptr<const CachedObject> object) {
+    size_t entry_size = object->bytes.size();
+    if (entry_size > cache.max_entry || entry_size > cache.shard_capacity) return;
+
+    MemoryCacheShard& shard = memory_cache_shard(cache, key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) {
+        memory_cache_erase(shard, found->second);
+    }
+    while (shard.size + entry_size > cache.shard_capacity) {
+        memory_cache_erase(shard, std::prev(shard.lru.end()));
+    }
+    shard.lru.push_front({key, std::move(object)});
+    shard.index[key] = shard.lru.begin();
+    shard.size += entry_size;
+}
+
+struct DiskCacheEntry {
+    uint64_t key;
+    size_t size;
+};
+
+// Второй уровень: файлы в каталоге кэша с именами из 16 шестнадцатеричных цифр хеша URL.
+// Файл начинается со строки с полным URL (по ней отсеиваются совпадения хешей) и строки
+// метаданных длиной CACHE_META_SIZE, за которыми следует ответ сервера. Новый файл пишется
+// под временным именем и переименовывается, только когда ответ получен полностью. Суммарный объем ограничен, при переполнении удаляются давно не
+// запрошенные файлы. Уже открытый для отправки файл продолжает отправляться и после удаления.
+struct DiskCache {
+    std::string directory = CACHE_DIR;
+    size_t capacity = DISK_CACHE_CAPACITY;
+    std::mutex mutex;
+    size_t size = 0;
+    std::atomic<unsigned long long> temp_counter{0};
+    std::list<DiskCacheEntry> lru;
+    std::unordered_map<uint64_t, std::list<DiskCacheEntry>::iterator> index;
+};
+
+std::string disk_cache_path(const DiskCache& cache, uint64_t key) {
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+    return cache.directory + name;
+}
+
+bool parse_cache_file_name(const std::string& name, uint64_t& key) {
+    if (name.size() != 16 || name.find_first_not_of("0123456789abcdef") != std::string::npos) return false;
+    key = std::stoull(name, nullptr, 16);
+    return true;
+}
+
+void disk_cache_erase(DiskCache& cache, std::list<DiskCacheEntry>::iterator it) {
+    unlink(disk_cache_path(cache, it->key).c_str());
+    cache.size -= it->size;
+    cache.index.erase(it->key);
+    cache.lru.erase(it);
+}
+
+void disk_cache_evict(DiskCache& cache) {
+    while (cache.size > cache.capacity && !cache.lru.empty()) {
+        disk_cache_erase(cache, std::prev(cache.lru.end()));
+    }
+}
+
+// Восстанавливает индекс по содержимому каталога при запуске. Порядок LRU приближается
+// временем последнего изменения файлов.
+void disk_cache_load(DiskCache& cache) {
+    std::vector<std::pair<std::filesystem::file_time_type, DiskCacheEntry>> files;
+    std::error_code error;
+    for (const auto& item : std::filesystem::directory_iterator(cache.directory, error)) {
+        uint64_t key;
+        // Временные файлы остаются от ответов, которые не успели дописаться до остановки прокси.
+        if (item.path().filename().string().find(".tmp") != std::string::npos) {
+            std::filesystem::remove(item.path(), error);
+            continue;
+        }
+        if (!item.is_regular_file(error) || !parse_cache_file_name(item.path().filename().string(), key)) continue;
+        files.push_back({item.last_write_time(error), {key, (size_t)item.file_size(error)}});
+    }
+    std::sort(files.begin(), files.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    for (const auto& file : files) {
+        cache.lru.push_front(file.second);
+        cache.index[file.second.key] = cache.lru.begin();
+        cache.size += file.second.size;
+    }
+    disk_cache_evict(cache);
+}
+
+size_t cache_header_size(const std::string& url) {
+    return url.size() + 1 + CACHE_META_SIZE;
+}
+
+// Строка метаданных, дополненная пробелами до CACHE_META_SIZE. Слишком длинные валидаторы
+// не сохраняются: такой ответ нельзя будет проверить условным запросом.
+std::string format_cache_meta(const CachePolicy& policy) {
+    std::string meta = format_cache_policy(policy);
+    if (meta.size() >= CACHE_META_SIZE) {
+        CachePolicy without_validators = policy;
+        without_validators.etag.clear();
+        without_validators.last_modified.clear();
+        meta = format_cache_policy(without_validators);
+    }
+    meta.resize(CACHE_META_SIZE - 1, ' ');
+    meta += '\n';
+    return meta;
+}
+
+// Открывает файл объекта, если он есть в кэше и принадлежит этому URL. body_offset —
+// начало ответа сервера в файле (после строк с URL и метаданными).
+int disk_cache_open(DiskCache& cache, uint64_t key, const std::string& url, off_t& body_offset, CachePolicy& policy) {
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        auto found = cache.index.find(key);
+        if (found == cache.index.end()) return -1;
+        cache.lru.splice(cache.lru.begin(), cache.lru, found->second);
+    }
+
+    int fd = open(disk_cache_path(cache, key).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    std::string header(cache_header_size(url), '\0');
+    if (pread(fd, header.data(), header.size(), 0) != (ssize_t)header.size() ||
+        header.compare(0, url.size(), url) != 0 || header[url.size()] != '\n' ||
+        !parse_cache_policy(std::string_view(header).substr(url.size() + 1, CACHE_META_SIZE - 1), policy)) {
+        close(fd);
+        return -1;
+    }
+    body_offset = header.size();
+    return fd;
+}
+
+// Создает временный файл для нового объекта и записывает в него строки с URL и метаданными.
+int disk_cache_create(DiskCache& cache, uint64_t key, const std::string& url, const CachePolicy& policy,
+                      std::string& temp_path) {
+    temp_path = disk_cache_path(cache, key) + ".tmp" + std::to_string(cache.temp_counter++);
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    std::string header = url + "\n" + format_cache_meta(policy);
+    if (write(fd, header.data(), header.size()) != (ssize_t)header.size()) {
+        close(fd);
+        unlink(temp_path.c_str());
+        return -1;
+    }
+    return fd;
+}
+
+// Перезаписывает метаданные объекта после ответа 304.
+void disk_cache_update_policy(DiskCache& cache, uint64_t key, const std::string& url, const CachePolicy& policy) {
+    off_t body_offset;
+    CachePolicy stored;
+    int fd = disk_cache_open(cache, key, url, body_offset, stored);
+    if (fd < 0) return;
+    close(fd);
+    fd = open(disk_cache_path(cache, key).c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    std::string meta = format_cache_meta(policy);
+    if (pwrite(fd, meta.data(), meta.size(), url.size() + 1) != (ssize_t)meta.size()) {
+        perror("Failed to update cache metadata");
+    }
+    close(fd);
+}
+
+// Переименовывает полностью записанный файл в постоянное имя, учитывает его в кэше и вытесняет
+// старые файлы сверх лимита. Клиенты, которым отправляется прежняя версия, дополучают ее.
+// Переименование и обновление индекса идут под одной блокировкой: иначе вытеснение или удаление
+// прежней записи с тем же ключом между ними удалило бы уже новый файл, и в индексе осталась
+// бы запись без файла.
+void disk_cache_commit(DiskCache& cache, uint64_t key, const std::string& temp_path, size_t size) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (rename(temp_path.c_str(), disk_cache_path(cache, key).c_str()) < 0) {
+        perror("Failed to commit cache file");
+        unlink(temp_path.c_str());
+        return;
+    }
+    auto found = cache.index.find(key);
+    if (found != cache.index.end()) {
+        cache.size -= found->second->size;
+        cache.lru.erase(found->second);
+    }
+    cache.lru.push_front({key, size});
+    cache.index[key] = cache.lru.begin();
+    cache.size += size;
+    disk_cache_evict(cache);
+}
+
+void disk_cache_remove(DiskCache& cache, uint64_t key) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto found = cache.index.find(key);
+    if (found != cache.index.end()) disk_cache_erase(cache, found->second);
+}
+
+// Читает ответ из файла объекта для переноса в кэш в памяти.
+std::shared_ptr<CachedObject> read_cached_object(int fd, const std::string& url, const CachePolicy& policy,
+                                                 off_t offset, size_t size) {
+    auto object = std::make_shared<CachedObject>();
+    object->url = url;
+    object->policy = policy;
+    object->bytes.resize(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, object->bytes.data() + done, size - done, offset + done);
+        if (n <= 0) return nullptr;
+        done += n;
+    }
+    return object;
+}
+
+// Промах, который уже загружается с сервера (single-flight). Первый запрос (ведущий) пишет ответ
+// во временный файл, а клиенты, запросившие тот же URL позже (ведомые), получают байты этого файла
+// по мере записи, в том числе из других воркеров. После commit файл переименовывается, и path
+// меняется под той же блокировкой, поэтому ведомый всегда может его открыть.
+struct InFlightFetch {
+    std::string url;
+    std::mutex mutex;
+    // Пустой, пока ведущий не получил заголовок ответа и не решил сохранять его.
+    std::string path;
+    off_t body_offset = 0;
+    // Сколько байт файла уже записано.
+    off_t size = 0;
+    bool done = false;
+    bool failed = false;
+    int followers = 0;
+    // eventfd воркеров, сессии которых отправили все записанное и ждут новых данных.
+    std::vector<int> waiters;
+};
+
+// Двухуровневый кэш, общий для всех воркеров.
+struct ObjectCache {
+    MemoryCache memory;
+    DiskCache disk;
+    std::atomic<unsigned long long> memory_hits{0};
+    std::atomic<unsigned long long> disk_hits{0};
+    std::atomic<unsigned long long> misses{0};
+    std::atomic<unsigned long long> revalidations{0};
+    std::atomic<unsigned long long> coalesced{0};
+    // Объекты, которые сейчас обновляются в фоне (stale-while-revalidate): обновление одного
+    // объекта запускается не больше одного раза.
+    std::mutex refresh_mutex;
+    std::unordered_set<uint64_t> refreshing;
+    // Промахи, которые сейчас загружаются с серверов.
+    std::mutex fetch_mutex;
+    std::unordered_map<uint64_t, std::shared_ptr<InFlightFetch>> fetches;
+};
+
+ObjectCache object_cache;
+
+bool begin_refresh(ObjectCache& cache, uint64_t key) {
+    std::lock_guard<std::mutex> lock(cache.refresh_mutex);
+    return cache.refreshing.insert(key).second;
+}
+
+void end_refresh(ObjectCache& cache, uint64_t key) {
+    std::lock_guard<std::mutex> lock(cache.refresh_mutex);
+    cache.refreshing.erase(key);
+}
+
+// Присоединяет запрос к загрузке URL, которая уже идет (leader = false), или регистрирует новую
+// загрузку, ведущим которой становится вызывающий (leader = true). При совпадении хешей разных
+// URL загрузки не объединяются: возвращается nullptr.
+std::shared_ptr<InFlightFetch> join_fetch(ObjectCache& cache, uint64_t key, const std::string& url, bool& leader) {
+    std::lock_guard<std::mutex> lock(cache.fetch_mutex);
+    auto found = cache.fetches.find(key);
+    leader = found == cache.fetches.end();
+    if (leader) {
+        auto fetch = std::make_shared<InFlightFetch>();
+        fetch->url = url;
+        cache.fetches[key] = fetch;
+        return fetch;
+    }
+    if (found->second->url != url) return nullptr;
+    std::lock_guard<std::mutex> fetch_lock(found->second->mutex);
+    found->second->followers++;
+    cache.coalesced++;
+    return found->second;
+}
+
+void notify_fetch_waiters(const std::vector<int>& waiters) {
+    uint64_t one = 1;
+    for (int fd : waiters) {
+        if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("Failed to wake worker");
+    }
+}
+
+// Сообщает ведомым, что в файле записано size байт (path задается, когда файл создан или переименован).
+void publish_fetch(InFlightFetch& fetch, off_t size, const std::string* path = nullptr, off_t body_offset = 0) {
+    std::vector<int> waiters;
+    {
+        std::lock_guard<std::mutex> lock(fetch.mutex);
+        if (path != nullptr) {
+            fetch.path = *path;
+            fetch.body_offset = body_offset;
+        }
+        fetch.size = size;
+        waiters.swap(fetch.waiters);
+    }
+    notify_fetch_waiters(waiters);
+}
+
+// Загрузка закончена: done — ответ записан целиком, иначе ведомые, еще ничего не отправившие
+// своим клиентам, запрашивают сервер сами.
+void end_fetch(ObjectCache& cache, uint64_t key, InFlightFetch& fetch, bool done) {
+    {
+        std::lock_guard<std::mutex> lock(cache.fetch_mutex);
+        auto found = cache.fetches.find(key);
+        if (found != cache.fetches.end() && found->second.get() == &fetch) cache.fetches.erase(found);
+    }
+    std::vector<int> waiters;
+    {
+        std::lock_guard<std::mutex> lock(fetch.mutex);
+        fetch.done = done;
+        fetch.failed = !done;
+        waiters.swap(fetch.waiters);
+    }
+    notify_fetch_waiters(waiters);
+}
+
+// Ищет объект сначала в памяти, затем на диске. Небольшой объект с диска переносится в память
+// и возвращается в object, для большого возвращается открытый файл (file_fd, body_offset).
+bool object_cache_lookup(ObjectCache& cache, uint64_t key, const std::string& url,
+                         std::shared_ptr<const CachedObject>& object, int& file_fd, off_t& body_offset, CachePolicy& policy) {
+    object = memory_cache_lookup(cache.memory, key, url);
+    if (object) {
+        policy = object->policy;
+        cache.memory_hits++;
+        return true;
+    }
+
+    file_fd = disk_cache_open(cache.disk, key, url, body_offset, policy);
+    if (file_fd < 0) return false;
+    cache.disk_hits++;
+    struct stat st;
+    if (fstat(file_fd, &st) < 0) {
+        close(file_fd);
+        file_fd = -1;
+        return false;
+    }
+    size_t body_size = st.st_size - body_offset;
+    if (body_size <= cache.memory.max_entry) {
+        object = read_cached_object(file_fd, url, policy, body_offset, body_size);
+        close(file_fd);
+        file_fd = -1;
+        if (!object) return false;
+        memory_cache_insert(cache.memory, key, object);
+    }
+    return true;
+}
+
+// Обновляет метаданные объекта в обоих уровнях после ответа 304.
+void object_cache_refresh(ObjectCache& cache, uint64_t key, const std::string& url, const CachePolicy& policy) {
+    auto object = memory_cache_lookup(cache.memory, key, url);
+    if (object) {
+        auto refreshed = std::make_shared<CachedObject>(*object);
+        refreshed->policy = policy;
+        memory_cache_insert(cache.memory, key, std::move(refreshed));
+    }
+    disk_cache_update_policy(cache.disk, key, url, policy);
+    cache.revalidations++;
+}
+
+void object_cache_remove(ObjectCache& cache, uint64_t key) {
+    memory_cache_remove(cache.memory, key);
+    disk_cache_remove(cache.disk, key);
+}
@@ -0,0 +1,631 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <fstream>
+#include <cmath>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <thread>
+#include <filesystem>
+#include <climits>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+const int BUFFER_SIZE = 16384;
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchStats {
+    long long completed = 0;
+    long long errors = 0;
+    std::vector<double> latencies_ms;
+};
+
+int proxy_port = 8090;
+int origin_port = 9090;
+int clients = 16;
+int duration_sec = 5;
+int proxy_workers = 1;
+size_t body_size = 1024;
+// Размеры объектов Zipf-нагрузки: от body_size до max_body_size, у каждого URL свой и постоянный.
+size_t max_body_size = 0;
+int origin_latency_ms = 0;
+int object_count = 1000;
+double zipf_alpha = 0.99;
+int memory_cache_mb = -1;
+int echo_port = 0;
+size_t tunnel_bytes = 1024 * 1024;
+int tls_port = 0;
+const int TLS_CHECK_LINES = 64;
+
+std::atomic<long long> origin_connections{0};
+std::atomic<long long> origin_requests{0};
+
+sockaddr_in loopback_addr(int port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+// Размер объекта Zipf-нагрузки с номером id: постоянный для URL, равномерно распределен
+// между body_size и max_body_size.
+size_t object_size(long long id) {
+    if (max_body_size <= body_size) return body_size;
+    uint64_t hash = (uint64_t)id * 0x9E3779B97F4A7C15ULL;
+    return body_size + (hash >> 16) % (max_body_size - body_size + 1);
+}
+
+// Соединение с локальным сервером-источником: отвечает на каждый запрос через origin_latency_ms
+// с Content-Length и держит соединение открытым, пока его не закроет прокси. Ответы на /zipf/<id>
+// кэшируемые и имеют размер object_size(id), остальные — body_size байт с no-store, поэтому
+// каждый такой запрос через прокси — промах кэша.
+void serve_origin_connection(int fd, const std::string& body) {
+    std::string request;
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) break;
+        request.append(buffer, n);
+        size_t end;
+        while ((end = request.find("\r\n\r\n")) != std::string::npos) {
+            std::string head = request.substr(0, end);
+            request.erase(0, end + 4);
+            origin_requests++;
+            bool close_after = head.find("Connection: close") != std::string::npos;
+            size_t zipf = head.find(" /zipf/");
+            size_t size = zipf == std::string::npos ? body_size : object_size(atoll(head.c_str() + zipf + 7));
+            std::string response = "HTTP/1.1 200 OK\r\n"
+                                   "Content-Type: application/octet-stream\r\n" +
+                                   std::string(zipf == std::string::npos ? "Cache-Control: no-store\r\n"
+                                                                         : "Cache-Control: max-age=3600\r\n") +
+                                   "Content-Length: " + std::to_string(size) + "\r\n\r\n";
+            if (origin_latency_ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(origin_latency_ms));
+            bool ok = send(fd, response.data(), response.size(), MSG_NOSIGNAL | MSG_MORE) == (ssize_t)response.size();
+            for (size_t sent = 0; ok && sent < size;) {
+                ssize_t written = send(fd, body.data(), std::min(size - sent, body.size()), MSG_NOSIGNAL);
+                ok = written > 0;
+                sent += ok ? written : 0;
+            }
+            if (!ok || close_after) {
+                close(fd);
+                return;
+            }
+        }
+    }
+    close(fd);
+}
+
+void run_origin(int listener) {
+    std::string body(std::max(body_size, max_body_size), 'x');
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) continue;
+        origin_connections++;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::thread(serve_origin_connection, fd, std::cref(body)).detach();
+    }
+}
+
+int start_origin() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in addr = loopback_addr(origin_port);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        perror("Origin listen failed");
+        close(listener);
+        return -1;
+    }
+    std::thread(run_origin, listener).detach();
+    return listener;
+}
+
+// Эхо-сервер для туннелей CONNECT: сначала отправляет TUNNEL_BANNER (данные от сервера до первого
+// байта клиента, как приветствие SMTP или ServerHello TLS), затем возвращает все полученное и
+// закрывает свою половину соединения, когда клиент закрыл свою.
+const std::string TUNNEL_BANNER = "proxy_bench echo server\r\n";
+
+void serve_echo_connection(int fd) {
+    bool ok = send(fd, TUNNEL_BANNER.data(), TUNNEL_BANNER.size(), MSG_NOSIGNAL) == (ssize_t)TUNNEL_BANNER.size();
+    char buffer[BUFFER_SIZE];
+    ssize_t n;
+    while (ok && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        for (ssize_t sent = 0; ok && sent < n;) {
+            ssize_t written = send(fd, buffer + sent, n - sent, MSG_NOSIGNAL);
+            ok = written > 0;
+            sent += ok ? written : 0;
+        }
+    }
+    shutdown(fd, SHUT_WR);
+    close(fd);
+}
+
+int start_echo() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in addr = loopback_addr(echo_port);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        perror("Echo server listen failed");
+        close(listener);
+        return -1;
+    }
+    std::thread([listener] {
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) std::thread(serve_echo_connection, fd).detach();
+        }
+    }).detach();
+    return listener;
+}
+
+// Один туннель через прокси: CONNECT к эхо-серверу, ответ 200, приветствие сервера (направление
+// сервер -> клиент), затем payload в обе стороны. Отправка идет в отдельном потоке, чтобы эхо
+// не заблокировалось на заполненных буферах; после нее клиент закрывает свою половину
+// соединения и читает эхо до закрытия. Если pipelined, начало payload отправляется в одном
+// пакете с CONNECT — прокси должен передать его серверу после установки туннеля.
+bool tunnel_roundtrip(const std::string& payload, bool pipelined) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    sockaddr_in addr = loopback_addr(proxy_port);
+    std::string target = "127.0.0.1:" + std::to_string(echo_port);
+    std::string request = "CONNECT " + target + " HTTP/1.1\r\nHost: " + target + "\r\n\r\n";
+    size_t early = pipelined ? std::min<size_t>(payload.size(), 512) : 0;
+    request.append(payload, 0, early);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+        close(fd);
+        return false;
+    }
+
+    std::string received;
+    char buffer[BUFFER_SIZE];
+    size_t head_end;
+    ssize_t n;
+    while ((head_end = received.find("\r\n\r\n")) == std::string::npos && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        received.append(buffer, n);
+    }
+    if (head_end == std::string::npos || received.compare(0, 12, "HTTP/1.1 200") != 0) {
+        close(fd);
+        return false;
+    }
+    received.erase(0, head_end + 4);
+
+    std::thread sender([&] {
+        for (size_t sent = early; sent < payload.size();) {
+            ssize_t written = send(fd, payload.data() + sent, std::min<size_t>(payload.size() - sent, BUFFER_SIZE), MSG_NOSIGNAL);
+            if (written <= 0) break;
+            sent += written;
+        }
+        shutdown(fd, SHUT_WR);
+    });
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        received.append(buffer, n);
+        if (received.size() > TUNNEL_BANNER.size() + payload.size()) break;
+    }
+    sender.join();
+    close(fd);
+    return received.size() == TUNNEL_BANNER.size() + payload.size() &&
+           received.compare(0, TUNNEL_BANNER.size(), TUNNEL_BANNER) == 0 &&
+           received.compare(TUNNEL_BANNER.size(), payload.size(), payload) == 0;
+}
+
+// Один запрос через прокси: соединение, запрос, чтение ответа до закрытия соединения прокси.
+// Ответ должен быть 200 и длиннее тела expected_body.
+bool proxy_request(const std::string& request, size_t expected_body, size_t& received) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sockaddr_in addr = loopback_addr(proxy_port);
+    bool ok = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+              send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size();
+    char buffer[BUFFER_SIZE];
+    received = 0;
+    ssize_t n;
+    while (ok && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        if (received == 0 && strncmp(buffer, "HTTP/1.1 200", std::min<size_t>(n, 12)) != 0) ok = false;
+        received += n;
+    }
+    close(fd);
+    return ok && received > expected_body;
+}
+
+// Задержка одного запроса учитывается только у успешных.
+void timed_request(const std::string& request, size_t expected_body, BenchStats& stats) {
+    auto started = Clock::now();
+    size_t received;
+    if (!proxy_request(request, expected_body, received)) {
+        stats.errors++;
+        return;
+    }
+    stats.latencies_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - started).count());
+    stats.completed++;
+}
+
+void run_miss_client(int index, BenchStats& stats) {
+    auto deadline = Clock::now() + std::chrono::seconds(duration_sec);
+    for (long long i = 0; Clock::now() < deadline; ++i) {
+        std::string request = "GET http://127.0.0.1:" + std::to_string(origin_port) + "/object/" + std::to_string(index) +
+                              "/" + std::to_string(i) + " HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+        timed_request(request, body_size, stats);
+    }
+}
+
+// Функция распределения Zipf: вероятность объекта ранга k пропорциональна 1 / k^alpha.
+std::vector<double> zipf_cdf(int count, double alpha) {
+    std::vector<double> cdf(count);
+    double sum = 0;
+    for (int k = 0; k < count; ++k) {
+        sum += 1.0 / std::pow(k + 1, alpha);
+        cdf[k] = sum;
+    }
+    for (double& value : cdf) value /= sum;
+    return cdf;
+}
+
+// Клиент Zipf-нагрузки: популярные объекты запрашиваются часто и попадают в кэш, редкие — промахи.
+void run_zipf_client(int index, BenchStats& stats, const std::vector<double>& cdf) {
+    std::mt19937_64 random(index + 1);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    auto deadline = Clock::now() + std::chrono::seconds(duration_sec);
+    while (Clock::now() < deadline) {
+        long long id = std::lower_bound(cdf.begin(), cdf.end(), uniform(random)) - cdf.begin();
+        id = std::min<long long>(id, cdf.size() - 1);
+        std::string request = "GET http://127.0.0.1:" + std::to_string(origin_port) + "/zipf/" + std::to_string(id) +
+                              " HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+        timed_request(request, object_size(id), stats);
+    }
+}
+
+// Клиент туннелей: каждый туннель переносит свои случайные байты, через раз — с данными в пакете CONNECT.
+void run_tunnel_client(int index, BenchStats& stats) {
+    std::mt19937_64 random(index + 1);
+    std::string payload(tunnel_bytes, '\0');
+    auto deadline = Clock::now() + std::chrono::seconds(duration_sec);
+    for (long long i = 0; Clock::now() < deadline; ++i) {
+        for (char& c : payload) c = (char)random();
+        auto started = Clock::now();
+        if (!tunnel_roundtrip(payload, i % 2 == 1)) {
+            stats.errors++;
+            continue;
+        }
+        stats.latencies_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - started).count());
+        stats.completed++;
+    }
+}
+
+double percentile(std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t idx = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+    return sorted[idx];
+}
+
+BenchStats run_benchmark(const std::function<void(int, BenchStats&)>& client, double& elapsed) {
+    std::vector<BenchStats> client_stats(clients);
+    std::vector<std::thread> threads;
+    auto bench_start = Clock::now();
+    for (int i = 0; i < clients; ++i) {
+        threads.emplace_back(client, i, std::ref(client_stats[i]));
+    }
+    for (auto& thread : threads) thread.join();
+    elapsed = std::chrono::duration<double>(Clock::now() - bench_start).count();
+
+    BenchStats total;
+    for (auto& stats : client_stats) {
+        total.completed += stats.completed;
+        total.errors += stats.errors;
+        total.latencies_ms.insert(total.latencies_ms.end(), stats.latencies_ms.begin(), stats.latencies_ms.end());
+    }
+    std::sort(total.latencies_ms.begin(), total.latencies_ms.end());
+    return total;
+}
+
+// Ждет до 5 секунд, пока на локальном порту port не начнут принимать соединения.
+bool wait_for_port(int port) {
+    sockaddr_in addr = loopback_addr(port);
+    for (int attempt = 0; attempt < 50; ++attempt) {
+        usleep(100 * 1000);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        bool ready = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (ready) return true;
+    }
+    return false;
+}
+
+// Запускает прокси во временном каталоге с пустым кэшем (там он создаст свой cache/) и ждет,
+// пока он начнет принимать соединения.
+pid_t start_proxy(const std::string& proxy_binary, const std::string& work_dir, int pool_size) {
+    std::filesystem::remove_all(work_dir + "/cache");
+    std::vector<std::string> args = {proxy_binary, std::to_string(proxy_port), "-q",
+                                     "--workers", std::to_string(proxy_workers),
+                                     "--pool-size", std::to_string(pool_size)};
+    if (memory_cache_mb >= 0) {
+        args.push_back("--memory-cache");
+        args.push_back(std::to_string(memory_cache_mb));
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        if (chdir(work_dir.c_str()) < 0) _exit(1);
+        std::vector<char*> argv;
+        for (std::string& arg : args) argv.push_back(arg.data());
+        argv.push_back(nullptr);
+        execv(proxy_binary.c_str(), argv.data());
+        perror("exec failed");
+        _exit(1);
+    }
+
+    if (wait_for_port(proxy_port)) return pid;
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    return -1;
+}
+
+// Поле из /proc/<pid>/status в килобайтах: VmRSS — текущая резидентная память, VmHWM — пиковая.
+long long process_memory_kb(pid_t pid, const std::string& field) {
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind(field + ":", 0) == 0) return atoll(line.c_str() + field.size() + 1);
+    }
+    return 0;
+}
+
+void stop_proxy(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+// Промахи: сначала без пула (--pool-size 0, каждый промах — новое соединение), затем с пулом.
+bool run_miss_benchmark(const std::string& proxy_binary, const std::string& work_dir, int pool_size) {
+    std::cout << "\n--- Miss Latency (" << clients << " clients, " << body_size << " byte objects, " << proxy_workers
+              << " proxy workers) ---" << std::endl;
+    std::cout << std::setw(10) << "Pool" << std::setw(16) << "Requests/sec" << std::setw(12) << "p50, ms"
+              << std::setw(12) << "p99, ms" << std::setw(16) << "Origin conns" << std::setw(10) << "Errors" << std::endl;
+
+    for (int pool : {0, pool_size}) {
+        pid_t pid = start_proxy(proxy_binary, work_dir, pool);
+        if (pid < 0) {
+            std::cerr << "Proxy did not start with pool size " << pool << std::endl;
+            return false;
+        }
+        long long connections_before = origin_connections;
+        double elapsed;
+        BenchStats stats = run_benchmark(run_miss_client, elapsed);
+        stop_proxy(pid);
+
+        std::cout << std::setw(10) << pool << std::setw(16) << stats.completed / elapsed
+                  << std::setw(12) << percentile(stats.latencies_ms, 50)
+                  << std::setw(12) << percentile(stats.latencies_ms, 99)
+                  << std::setw(16) << origin_connections - connections_before
+                  << std::setw(10) << stats.errors << std::endl;
+    }
+    return true;
+}
+
+// Zipf-нагрузка на холодный кэш. Доля попаданий считается по серверу-источнику: запрос, который
+// до него не дошел (попадание или присоединение к чужой загрузке), обслужен кэшем.
+bool run_zipf_benchmark(const std::string& proxy_binary, const std::string& work_dir, int pool_size) {
+    std::cout << "\n--- Zipf Workload (" << object_count << " objects, alpha " << zipf_alpha << ", " << clients
+              << " clients, " << body_size << "-" << std::max(body_size, max_body_size) << " bytes, origin latency "
+              << origin_latency_ms << " ms) ---" << std::endl;
+    std::cout << std::setw(16) << "Requests/sec" << std::setw(12) << "Hit ratio" << std::setw(12) << "p50, ms"
+              << std::setw(12) << "p99, ms" << std::setw(14) << "Origin reqs" << std::setw(12) << "RSS, MB"
+              << std::setw(14) << "Peak RSS, MB" << std::setw(10) << "Errors" << std::endl;
+
+    pid_t pid = start_proxy(proxy_binary, work_dir, pool_size);
+    if (pid < 0) {
+        std::cerr << "Proxy did not start" << std::endl;
+        return false;
+    }
+    std::vector<double> cdf = zipf_cdf(object_count, zipf_alpha);
+    long long requests_before = origin_requests;
+    double elapsed;
+    BenchStats stats = run_benchmark([&](int index, BenchStats& client_stats) { run_zipf_client(index, client_stats, cdf); },
+                                     elapsed);
+    long long rss_kb = process_memory_kb(pid, "VmRSS");
+    long long peak_kb = process_memory_kb(pid, "VmHWM");
+    stop_proxy(pid);
+
+    long long origin = origin_requests - requests_before;
+    double hit_ratio = stats.completed > 0 ? std::max(0.0, 1.0 - (double)origin / stats.completed) : 0.0;
+    std::cout << std::setw(16) << stats.completed / elapsed << std::setw(12) << hit_ratio
+              << std::setw(12) << percentile(stats.latencies_ms, 50)
+              << std::setw(12) << percentile(stats.latencies_ms, 99)
+              << std::setw(14) << origin << std::setw(12) << rss_kb / 1024.0 << std::setw(14) << peak_kb / 1024.0
+              << std::setw(10) << stats.errors << std::endl;
+    return true;
+}
+
+// Запускает программу из PATH с выводом в /dev/null.
+pid_t spawn_quiet(std::vector<std::string> args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        std::vector<char*> argv;
+        for (std::string& arg : args) argv.push_back(arg.data());
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        _exit(1);
+    }
+    return pid;
+}
+
+// TLS через туннель: openssl s_client подключается через работающий прокси (-proxy, то есть CONNECT)
+// к локальному openssl s_server -rev, который возвращает каждую строку перевернутой. Эхо-нагрузка
+// выше гоняет произвольные байты и меряет скорость, а здесь поверх туннеля проходят настоящее
+// рукопожатие TLS и записи в обе стороны. Без openssl проверка пропускается.
+bool run_tls_tunnel_check(const std::string& work_dir) {
+    if (system("openssl version > /dev/null 2>&1") != 0) {
+        std::cout << "TLS handshake through tunnel: skipped (openssl not found)" << std::endl;
+        return true;
+    }
+    std::string cert = work_dir + "/tls_cert.pem";
+    std::string key = work_dir + "/tls_key.pem";
+    std::string make_cert = "openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost -days 1 -keyout " + key +
+                            " -out " + cert + " > /dev/null 2>&1";
+    if (system(make_cert.c_str()) != 0) {
+        std::cerr << "TLS check failed: could not create a test certificate" << std::endl;
+        return false;
+    }
+    pid_t server = spawn_quiet({"openssl", "s_server", "-accept", "127.0.0.1:" + std::to_string(tls_port),
+                                "-cert", cert, "-key", key, "-rev", "-quiet"});
+    if (server < 0 || !wait_for_port(tls_port)) {
+        if (server > 0) {
+            kill(server, SIGTERM);
+            waitpid(server, nullptr, 0);
+        }
+        std::cerr << "TLS check failed: openssl s_server did not start on port " << tls_port << std::endl;
+        return false;
+    }
+
+    // Строки случайной длины из букв и цифр; CLOSE в конце просит сервер закрыть соединение.
+    std::mt19937_64 random(42);
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    std::string input, expected;
+    for (int i = 0; i < TLS_CHECK_LINES; ++i) {
+        std::string line(1 + random() % 4096, '\0');
+        for (char& c : line) c = alphabet[random() % (sizeof(alphabet) - 1)];
+        input += line + "\n";
+        expected.append(line.rbegin(), line.rend());
+        expected += "\n";
+    }
+    input += "CLOSE\n";
+    std::string input_path = work_dir + "/tls_input.txt";
+    std::ofstream(input_path, std::ios::binary) << input;
+
+    std::string command = "timeout 10 openssl s_client -proxy 127.0.0.1:" + std::to_string(proxy_port) +
+                          " -connect 127.0.0.1:" + std::to_string(tls_port) + " -quiet -ign_eof < " + input_path +
+                          " 2> /dev/null";
+    std::string received;
+    int status = -1;
+    if (FILE* output = popen(command.c_str(), "r")) {
+        char buffer[BUFFER_SIZE];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), output)) > 0) received.append(buffer, n);
+        status = pclose(output);
+    }
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+
+    if (status != 0 || received != expected) {
+        std::cerr << "TLS check failed: s_client exit status " << status << ", received " << received.size() << " of "
+                  << expected.size() << " bytes" << (received == expected ? "" : " (data mismatch)") << std::endl;
+        return false;
+    }
+    std::cout << "TLS handshake through tunnel: ok (" << TLS_CHECK_LINES << " lines, " << expected.size()
+              << " bytes each way, s_server port " << tls_port << ")" << std::endl;
+    return true;
+}
+
+// Туннели CONNECT к локальному эхо-серверу: проверяет, что байты доходят без искажений в обе
+// стороны (приветствие сервера и эхо payload), и измеряет скорость; затем через тот же прокси
+// проходит TLS-проверка. Любая ошибка — неудача прогона.
+bool run_tunnel_benchmark(const std::string& proxy_binary, const std::string& work_dir, int pool_size) {
+    std::cout << "\n--- CONNECT Tunnels (" << clients << " clients, " << tunnel_bytes << " bytes each way, echo port "
+              << echo_port << ") ---" << std::endl;
+    std::cout << std::setw(16) << "Tunnels/sec" << std::setw(12) << "MB/s" << std::setw(12) << "p50, ms"
+              << std::setw(12) << "p99, ms" << std::setw(10) << "Errors" << std::endl;
+
+    pid_t pid = start_proxy(proxy_binary, work_dir, pool_size);
+    if (pid < 0) {
+        std::cerr << "Proxy did not start" << std::endl;
+        return false;
+    }
+    double elapsed;
+    BenchStats stats = run_benchmark(run_tunnel_client, elapsed);
+    std::cout << std::setw(16) << stats.completed / elapsed
+              << std::setw(12) << 2.0 * stats.completed * tunnel_bytes / elapsed / 1e6
+              << std::setw(12) << percentile(stats.latencies_ms, 50)
+              << std::setw(12) << percentile(stats.latencies_ms, 99)
+              << std::setw(10) << stats.errors << std::endl;
+    bool tls_ok = run_tls_tunnel_check(work_dir);
+    stop_proxy(pid);
+    if (stats.errors > 0 || stats.completed == 0) {
+        std::cerr << "Tunnel check failed: " << stats.errors << " tunnels lost or corrupted data" << std::endl;
+        return false;
+    }
+    return tls_ok;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: ./proxy_bench <proxy_binary> [-m miss|zipf|tunnel|all] [-p proxy_port] [-o origin_port] "
+                     "[-e echo_port] [-s tls_port] [-c clients] [-d seconds] [-b body_bytes] [-B max_body_bytes] [-l origin_latency_ms] "
+                     "[-n objects] [-z alpha] [-M memory_cache_mb] [-w workers] [-P pool_size] [-T tunnel_bytes]" << std::endl;
+        return 1;
+    }
+
+    std::string proxy_binary = argv[1];
+    std::string mode = "all";
+    int pool_size = 8;
+    for (int i = 2; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-p") proxy_port = std::stoi(argv[++i]);
+        else if (arg == "-o") origin_port = std::stoi(argv[++i]);
+        else if (arg == "-c") clients = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "-d") duration_sec = std::stoi(argv[++i]);
+        else if (arg == "-m") mode = argv[++i];
+        else if (arg == "-b") body_size = std::stoull(argv[++i]);
+        else if (arg == "-B") max_body_size = std::stoull(argv[++i]);
+        else if (arg == "-l") origin_latency_ms = std::stoi(argv[++i]);
+        else if (arg == "-n") object_count = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "-z") zipf_alpha = std::stod(argv[++i]);
+        else if (arg == "-M") memory_cache_mb = std::stoi(argv[++i]);
+        else if (arg == "-w") proxy_workers = std::stoi(argv[++i]);
+        else if (arg == "-P") pool_size = std::stoi(argv[++i]);
+        else if (arg == "-e") echo_port = std::stoi(argv[++i]);
+        else if (arg == "-T") tunnel_bytes = std::stoull(argv[++i]);
+        else if (arg == "-s") tls_port = std::stoi(argv[++i]);
+    }
+    if (echo_port == 0) echo_port = origin_port + 1;
+    if (tls_port == 0) tls_port = origin_port + 2;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (proxy_binary.find('/') == std::string::npos) proxy_binary = "./" + proxy_binary;
+    char resolved[PATH_MAX];
+    if (realpath(proxy_binary.c_str(), resolved) == nullptr) {
+        perror("Proxy binary not found");
+        return 1;
+    }
+    proxy_binary = resolved;
+    char work_dir[] = "/tmp/proxy_bench.XXXXXX";
+    if (mkdtemp(work_dir) == nullptr) {
+        perror("mkdtemp failed");
+        return 1;
+    }
+    if (start_origin() < 0 || start_echo() < 0) return 1;
+
+    std::cout << std::fixed << std::setprecision(2);
+    bool ok = true;
+    if (mode == "miss" || mode == "all") ok = run_miss_benchmark(proxy_binary, work_dir, pool_size);
+    if (ok && (mode == "zipf" || mode == "all")) ok = run_zipf_benchmark(proxy_binary, work_dir, pool_size);
+    if (ok && (mode == "tunnel" || mode == "all")) ok = run_tunnel_benchmark(proxy_binary, work_dir, pool_size);
+
+    std::filesystem::remove_all(work_dir);
+    return ok ? 0 : 1;
+}
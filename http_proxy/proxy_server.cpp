@@ -1,127 +1,1449 @@
+#include "object_cache.h"
+#include "resolver.h"
 #include <algorithm>
 #include <iostream>
 #include <string>
 #include <cstring>
 #include <vector>
-#include <fstream>
-#include <sstream>
+#include <list>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
-#include <netdb.h>
+#include <fcntl.h>
+#include <csignal>
+#include <cerrno>
 #include <filesystem>
 
 const int BUFFER_SIZE = 8192;
-const std::string CACHE_DIR = "cache/";
+const size_t MAX_REQUEST_SIZE = 16384;
+const size_t MAX_RESPONSE_HEAD_SIZE = 65536;
+const size_t PIPE_CHUNK_SIZE = 64 * 1024;
+const int MAX_EVENTS = 1024;
+const int TIMER_RESOLUTION_MS = 1000;
 
-std::string url_to_filename(const std::string& url) {
-    std::string filename = url;
-    std::replace(filename.begin(), filename.end(), '/', '_');
-    std::replace(filename.begin(), filename.end(), ':', '_');
-    std::replace(filename.begin(), filename.end(), '?', '_');
-    std::replace(filename.begin(), filename.end(), '&', '_');
-    return CACHE_DIR + filename;
+bool verbose = true;
+int idle_timeout_sec = 30;
+// Сколько свободных постоянных соединений с одним сервером держит воркер (0 — без пула)
+// и сколько секунд свободное соединение может простаивать.
+size_t pool_size = 8;
+int pool_idle_sec = 15;
+
+using Clock = std::chrono::steady_clock;
+
+std::mutex log_mutex;
+
+// Воркеры пишут в консоль одновременно: строка выводится целиком под блокировкой.
+void log_info(const std::string& message) {
+    if (!verbose) return;
+    std::lock_guard<std::mutex> lock(log_mutex);
+    std::cout << message << std::endl;
+}
+
+enum class SessionState {
+    READING_REQUEST,
+    RESOLVING,
+    SENDING_REQUEST,
+    SENDING_BODY,
+    RECEIVING_HEAD,
+    SENDING_HEAD,
+    RELAYING,
+    SENDING_CACHED,
+    FOLLOWING,
+    TUNNELING,
+    SENDING_ERROR,
+    CLOSED
+};
+
+// Пара "клиент — целевой сервер". Заголовок ответа сервера читается в память и разбирается
+// (по нему решается, можно ли сохранить ответ), а тело переносится из сокета сервера в сокет
+// клиента через канал (pipe) вызовами splice и не копируется в память процесса. Для записи
+// в кэш содержимое канала дублируется через tee во второй канал, из которого splice пишет в файл.
+// Тело запроса (POST, PUT) так же переносится из сокета клиента в сокет сервера через тот же канал.
+// Туннель CONNECT переносит байты в обе стороны: к клиенту через тот же канал, к серверу через
+// tunnel_pipe.
+// Сессия фонового обновления (stale-while-revalidate) не имеет клиента: client_fd == -1.
+struct Session {
+    int client_fd = -1;
+    int origin_fd = -1;
+    SessionState state = SessionState::READING_REQUEST;
+    // Заголовок запроса клиента, после его разбора — начало тела запроса.
+    std::string in;
+    // Запрос к серверу (SENDING_REQUEST), строки разметки chunked тела запроса (SENDING_BODY),
+    // заголовок ответа с началом тела (SENDING_HEAD) или ответ об ошибке (SENDING_ERROR).
+    std::string out;
+    size_t out_offset = 0;
+    std::string method;
+    std::string url;
+    std::string http_version;
+    // Заголовки запроса клиента, которые пересылаются серверу: без заголовков соединения и без
+    // тех, которыми управляет кэш (условные запросы, Range, Accept-Encoding).
+    std::string forward_headers;
+    // Граница тела запроса; NONE — тела нет.
+    BodyReader request_body = no_body_reader();
+    // В запросе был Authorization: ответ сохраняется, только если сервер это явно разрешил.
+    bool authorized = false;
+    // Сервер из URL и запрос к нему: запрос сохраняется, чтобы повторить его на новом соединении.
+    std::string origin_host;
+    std::string origin_port;
+    std::string origin_request;
+    // Соединение взято из пула; после ответа оно возвращается в пул, если origin_keep_alive.
+    bool origin_reused = false;
+    bool origin_keep_alive = false;
+    // Ключ кэша: нормализованный URL и его хеш.
+    std::string cache_url;
+    uint64_t cache_key = 0;
+    // Клиент запретил сохранять ответ (Cache-Control: no-store).
+    bool no_store = false;
+
+    // Сохраненный ответ: отправляется из памяти (object) или из файла через sendfile (file_fd).
+    std::shared_ptr<const CachedObject> object;
+    size_t object_offset = 0;
+    int file_fd = -1;
+    off_t file_offset = 0;
+    off_t file_size = 0;
+    // Сохраненный ответ проверяется на сервере условным запросом; при 304 отдается он.
+    bool revalidating = false;
+    CachePolicy stored_policy;
+    // Сессия держит отметку фонового обновления объекта и снимает ее при закрытии.
+    bool refreshing = false;
+    // Общая загрузка промаха: ведущий пишет ответ в кэш, ведомый (FOLLOWING) отправляет клиенту
+    // записанное из файла через sendfile (file_fd, file_offset).
+    std::shared_ptr<InFlightFetch> fetch;
+    bool fetch_leader = false;
+    // Сессия ждет пробуждения воркера через notify_fd: данных общей загрузки (FOLLOWING)
+    // или ответа резолвера (RESOLVING).
+    bool waiting = false;
+
+    // Промах: заголовок ответа сервера, затем канал origin -> client и данные в нем.
+    std::string head;
+    BodyReader body;
+    int pipe_fds[2] = {-1, -1};
+    size_t pipe_bytes = 0;
+    bool origin_eof = false;
+    // Запись ответа в кэш: канал-копия и временный файл. Недописанный файл удаляется при закрытии сессии.
+    int cache_pipe[2] = {-1, -1};
+    int cache_fd = -1;
+    std::string cache_temp_path;
+    size_t cache_size = 0;
+    CachePolicy policy;
+
+    // Туннель CONNECT: канал client -> origin, закрыл ли клиент свою сторону и сколько байт
+    // передано серверу (sent) и клиенту (received).
+    bool tunnel = false;
+    int tunnel_pipe[2] = {-1, -1};
+    size_t tunnel_pipe_bytes = 0;
+    bool client_eof = false;
+    uint64_t tunnel_sent = 0;
+    uint64_t tunnel_received = 0;
+    Clock::time_point started = Clock::now();
+
+    Clock::time_point last_active;
+    std::list<std::shared_ptr<Session>>::iterator idle_pos;
+};
+
+struct PooledConnection {
+    int fd;
+    Clock::time_point idle_since;
+};
+
+struct EventLoop {
+    int epoll_fd = -1;
+    // Сессия доступна и по дескриптору клиента, и по дескриптору сервера.
+    std::unordered_map<int, std::shared_ptr<Session>> sessions;
+    // Сессии в порядке последней активности.
+    std::list<std::shared_ptr<Session>> idle_list;
+    // Свободные постоянные соединения по "host:port", от давно освободившихся к недавним.
+    // Они остаются в epoll, но события на них пропускаются: дескриптора нет в sessions.
+    std::unordered_map<std::string, std::deque<PooledConnection>> origin_pool;
+    // Ведущие сессии (в том числе других воркеров) и потоки резолвера будят воркер через
+    // notify_fd, когда у ждущих сессий появились данные или готов адрес сервера.
+    int notify_fd = -1;
+    std::vector<std::shared_ptr<Session>> waiting;
+};
+
+void close_fd(int& fd) {
+    if (fd >= 0) close(fd);
+    fd = -1;
+}
+
+bool watch_fd(EventLoop& loop, int fd) {
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<Session> add_session(EventLoop& loop) {
+    auto session = std::make_shared<Session>();
+    session->last_active = Clock::now();
+    session->idle_pos = loop.idle_list.insert(loop.idle_list.end(), session);
+    return session;
+}
+
+void close_origin(EventLoop& loop, Session& session) {
+    if (session.origin_fd < 0) return;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, session.origin_fd, nullptr);
+    loop.sessions.erase(session.origin_fd);
+    close_fd(session.origin_fd);
+}
+
+std::string origin_key(const Session& session) {
+    return session.origin_host + ":" + session.origin_port;
+}
+
+// Возвращает соединение с сервером в пул воркера, если сервер его не закрывает и ответ
+// прочитан точно до конца. При переполнении пула закрывается самое старое соединение.
+void release_origin(EventLoop& loop, Session& session) {
+    if (session.origin_fd < 0) return;
+    if (!session.origin_keep_alive || pool_size == 0) {
+        close_origin(loop, session);
+        return;
+    }
+    loop.sessions.erase(session.origin_fd);
+    std::deque<PooledConnection>& idle = loop.origin_pool[origin_key(session)];
+    if (idle.size() >= pool_size) {
+        close(idle.front().fd);
+        idle.pop_front();
+    }
+    idle.push_back({session.origin_fd, Clock::now()});
+    session.origin_fd = -1;
+}
+
+// Берет из пула самое недавнее соединение с сервером. Соединение, на котором без запроса
+// появились данные или EOF (сервер закрыл его по своему таймауту), закрывается.
+int take_pooled_connection(EventLoop& loop, const std::string& key) {
+    auto it = loop.origin_pool.find(key);
+    if (it == loop.origin_pool.end()) return -1;
+    int result = -1;
+    while (result < 0 && !it->second.empty()) {
+        int fd = it->second.back().fd;
+        it->second.pop_back();
+        char byte;
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            result = fd;
+        } else {
+            close(fd);
+        }
+    }
+    if (it->second.empty()) loop.origin_pool.erase(it);
+    return result;
+}
+
+void expire_pooled_connections(EventLoop& loop) {
+    auto deadline = Clock::now() - std::chrono::seconds(pool_idle_sec);
+    for (auto it = loop.origin_pool.begin(); it != loop.origin_pool.end();) {
+        std::deque<PooledConnection>& idle = it->second;
+        while (!idle.empty() && idle.front().idle_since <= deadline) {
+            close(idle.front().fd);
+            idle.pop_front();
+        }
+        it = idle.empty() ? loop.origin_pool.erase(it) : std::next(it);
+    }
+}
+
+// Ведущий снимает общую загрузку (done — ответ сохранен целиком), ведомый просто отсоединяется.
+void finish_fetch(Session& session, bool done) {
+    if (!session.fetch) return;
+    if (session.fetch_leader) {
+        end_fetch(object_cache, session.cache_key, *session.fetch, done);
+    } else {
+        std::lock_guard<std::mutex> lock(session.fetch->mutex);
+        session.fetch->followers--;
+    }
+    session.fetch.reset();
+    session.fetch_leader = false;
+}
+
+void abort_cache_write(Session& session) {
+    finish_fetch(session, false);
+    if (session.cache_fd < 0) return;
+    close_fd(session.cache_fd);
+    unlink(session.cache_temp_path.c_str());
+}
+
+void close_session(EventLoop& loop, Session& session) {
+    session.state = SessionState::CLOSED;
+    abort_cache_write(session);
+    if (session.refreshing) end_refresh(object_cache, session.cache_key);
+    close_fd(session.file_fd);
+    close_fd(session.cache_pipe[0]);
+    close_fd(session.cache_pipe[1]);
+    close_fd(session.pipe_fds[0]);
+    close_fd(session.pipe_fds[1]);
+    close_fd(session.tunnel_pipe[0]);
+    close_fd(session.tunnel_pipe[1]);
+    close_origin(loop, session);
+    if (session.tunnel) {
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - session.started).count();
+        log_info("[INFO] Tunnel to " + session.url + " closed after " + std::to_string(seconds) + " s: " +
+                 std::to_string(session.tunnel_sent) + " bytes sent, " + std::to_string(session.tunnel_received) +
+                 " bytes received");
+    }
+    if (session.client_fd >= 0) {
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, session.client_fd, nullptr);
+        loop.sessions.erase(session.client_fd);
+        close_fd(session.client_fd);
+    }
+    // Последней удаляется запись списка: она может держать последнюю ссылку на сессию.
+    loop.idle_list.erase(session.idle_pos);
 }
 
-void handle_client(int client_socket) {
+void send_error(Session& session, const std::string& status) {
+    if (session.client_fd < 0) {
+        session.state = SessionState::CLOSED;
+        return;
+    }
+    std::string body = "<html><body><h1>" + status + "</h1></body></html>";
+    session.out = "HTTP/1.0 " + status + "\r\n"
+                  "Content-Type: text/html\r\n"
+                  "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                  "Connection: close\r\n\r\n" + body;
+    session.out_offset = 0;
+    session.state = SessionState::SENDING_ERROR;
+}
+
+// Неблокирующее подключение: connect возвращает EINPROGRESS, а первая отправка запроса
+// получит EAGAIN, пока соединение не установится, или ошибку, если оно не удалось.
+int connect_to_origin(const std::vector<HostAddress>& addresses, const std::string& port) {
+    char* end;
+    long port_number = strtol(port.c_str(), &end, 10);
+    if (port.empty() || *end != '\0' || port_number <= 0 || port_number > 65535) return -1;
+
+    int fd = -1;
+    for (HostAddress address : addresses) {
+        if (address.addr.ss_family == AF_INET6) {
+            ((sockaddr_in6*)&address.addr)->sin6_port = htons(port_number);
+        } else {
+            ((sockaddr_in*)&address.addr)->sin_port = htons(port_number);
+        }
+        fd = socket(address.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) continue;
+        if (connect(fd, (sockaddr*)&address.addr, address.length) == 0 || errno == EINPROGRESS) break;
+        close_fd(fd);
+    }
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Ответ сервера полностью записан во временный файл: файл занимает постоянное место в дисковом
+// кэше, а небольшой ответ, кроме того, попадает в кэш в памяти.
+void commit_cache_write(Session& session) {
+    if (session.cache_fd < 0) return;
+    close_fd(session.cache_fd);
+    size_t header_size = cache_header_size(session.cache_url);
+    if (session.fetch_leader) {
+        // Путь меняется вместе с rename под блокировкой загрузки: ведомый, который еще не открыл
+        // файл, откроет его уже под новым именем.
+        std::lock_guard<std::mutex> lock(session.fetch->mutex);
+        disk_cache_commit(object_cache.disk, session.cache_key, session.cache_temp_path, header_size + session.cache_size);
+        session.fetch->path = disk_cache_path(object_cache.disk, session.cache_key);
+    } else {
+        disk_cache_commit(object_cache.disk, session.cache_key, session.cache_temp_path, header_size + session.cache_size);
+    }
+    memory_cache_remove(object_cache.memory, session.cache_key);
+    if (session.cache_size <= object_cache.memory.max_entry) {
+        int fd = open(disk_cache_path(object_cache.disk, session.cache_key).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            auto object = read_cached_object(fd, session.cache_url, session.policy, header_size, session.cache_size);
+            if (object) memory_cache_insert(object_cache.memory, session.cache_key, std::move(object));
+            close(fd);
+        }
+    }
+    finish_fetch(session, true);
+    log_info("[INFO] Cached response for URL: " + session.url);
+}
+
+// Сессия ждет пробуждения воркера через notify_fd (см. wake_waiting_sessions).
+void park_session(EventLoop& loop, const std::shared_ptr<Session>& session) {
+    if (session->waiting) return;
+    session->waiting = true;
+    loop.waiting.push_back(session);
+}
+
+void send_origin_request(EventLoop& loop, const std::shared_ptr<Session>& session, int remote_socket) {
+    session->origin_fd = remote_socket;
+    loop.sessions[remote_socket] = session;
+    // Вместе с запросом отправляется начало тела, пришедшее с заголовком запроса.
+    session->out = session->origin_request + session->in;
+    session->out_offset = 0;
+    session->state = SessionState::SENDING_REQUEST;
+}
+
+// Подключается к серверу по адресам из резолвера. Пока имя разрешается, сессия ждет в RESOLVING
+// и после пробуждения вызывает эту функцию снова.
+void connect_session_origin(EventLoop& loop, std::shared_ptr<Session> session) {
+    std::vector<HostAddress> addresses;
+    std::string error;
+    ResolveStatus status = resolve_host(resolver, session->origin_host, loop.notify_fd, addresses, error);
+    if (status == ResolveStatus::PENDING) {
+        session->state = SessionState::RESOLVING;
+        park_session(loop, session);
+        return;
+    }
+    if (status == ResolveStatus::FAILED) {
+        log_info("[ERROR] Could not resolve host: " + session->origin_host + " (" + error + ")");
+        send_error(*session, "502 Bad Gateway");
+        return;
+    }
+
+    int remote_socket = connect_to_origin(addresses, session->origin_port);
+    if (remote_socket < 0) {
+        log_info("[ERROR] Failed to connect to remote server: " + session->origin_host);
+        send_error(*session, "502 Bad Gateway");
+        return;
+    }
+    if (!watch_fd(loop, remote_socket)) {
+        close(remote_socket);
+        send_error(*session, "500 Internal Server Error");
+        return;
+    }
+    send_origin_request(loop, session, remote_socket);
+}
+
+// Подключается к серверу сессии (берет соединение из пула, если allow_pooled) и готовит
+// отправку запроса.
+void open_origin_connection(EventLoop& loop, std::shared_ptr<Session> session, bool allow_pooled) {
+    int remote_socket = allow_pooled ? take_pooled_connection(loop, origin_key(*session)) : -1;
+    session->origin_reused = remote_socket >= 0;
+    if (remote_socket >= 0) {
+        send_origin_request(loop, session, remote_socket);
+    } else {
+        connect_session_origin(loop, session);
+    }
+}
+
+// Соединение из пула и автоматический повтор используются только для идемпотентных запросов
+// без тела: тело уже прочитано из сокета клиента и второй раз его не отправить.
+bool retryable_request(const Session& session) {
+    return session.request_body.framing == BodyFraming::NONE && idempotent_method(session.method);
+}
+
+// Сервер мог закрыть соединение из пула одновременно с тем, как мы его взяли. Если ответ
+// еще не начался, запрос повторяется один раз на новом соединении (RFC 9112, раздел 9.3.1).
+bool retry_origin_request(EventLoop& loop, Session& session) {
+    if (!session.origin_reused || !session.head.empty() || !retryable_request(session)) return false;
+    log_info("[INFO] Pooled connection closed by remote server, retrying URL: " + session.url);
+    std::shared_ptr<Session> self = loop.sessions[session.origin_fd];
+    close_origin(loop, session);
+    open_origin_connection(loop, self, false);
+    return true;
+}
+
+// Отбрасывает данные, оставшиеся в канале ответа.
+void discard_pipe(Session& session) {
     char buffer[BUFFER_SIZE];
-    int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_received <= 0) {
-        close(client_socket);
+    while (session.pipe_bytes > 0) {
+        ssize_t n = read(session.pipe_fds[0], buffer, std::min(sizeof(buffer), session.pipe_bytes));
+        if (n <= 0) break;
+        session.pipe_bytes -= n;
+    }
+}
+
+// Клиент ведущей сессии ушел, но того же ответа ждут присоединившиеся клиенты: сессия закрывает
+// сокет клиента и дописывает ответ в кэш как фоновая. В остальных случаях сессия закрывается.
+void drop_client(EventLoop& loop, Session& session) {
+    bool followed = false;
+    if (session.fetch_leader && session.cache_fd >= 0 && session.client_fd >= 0 &&
+        (session.state == SessionState::SENDING_HEAD || session.state == SessionState::RELAYING)) {
+        std::lock_guard<std::mutex> lock(session.fetch->mutex);
+        followed = session.fetch->followers > 0;
+    }
+    if (!followed) {
+        session.state = SessionState::CLOSED;
+        return;
+    }
+    log_info("[INFO] Client left, finishing shared fetch for URL: " + session.url);
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, session.client_fd, nullptr);
+    loop.sessions.erase(session.client_fd);
+    close_fd(session.client_fd);
+    // Данные в канале ответа уже скопированы в кэш через tee и отбрасываются.
+    discard_pipe(session);
+    session.out.clear();
+    session.out_offset = 0;
+    session.state = SessionState::RELAYING;
+}
+
+// Сервер перестал принимать тело запроса: закрыл или сбросил соединение. Он мог уже отправить
+// ответ (например, 413), поэтому остаток тела не передается, а сессия переходит к чтению ответа.
+// Тело не передано до конца, и соединение в пул не вернется.
+void abandon_request_body(Session& session) {
+    log_info("[INFO] Remote server stopped reading request body for URL: " + session.url);
+    discard_pipe(session);
+    session.out.clear();
+    session.out_offset = 0;
+    session.state = SessionState::RECEIVING_HEAD;
+}
+
+// Дописывает session.out в сокет. Возвращает true, когда отправлено все.
+bool flush_output(EventLoop& loop, Session& session, int fd) {
+    while (session.out_offset < session.out.size()) {
+        ssize_t n = send(fd, session.out.data() + session.out_offset, session.out.size() - session.out_offset, MSG_NOSIGNAL);
+        if (n > 0) {
+            session.out_offset += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                if (fd != session.origin_fd) {
+                    drop_client(loop, session);
+                } else if (session.request_body.framing != BodyFraming::NONE) {
+                    abandon_request_body(session);
+                } else if (!retry_origin_request(loop, session)) {
+                    log_info("[ERROR] Failed to connect to remote server for " + session.url + ": " + strerror(errno));
+                    send_error(session, "502 Bad Gateway");
+                }
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// Разбирает "host[:port]" (IPv6-адрес — в квадратных скобках) в origin_host и origin_port.
+void parse_origin_authority(Session& session, const std::string& authority, const std::string& default_port) {
+    session.origin_host = authority;
+    session.origin_port = default_port;
+    size_t colon = authority.rfind(':');
+    if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+        session.origin_port = authority.substr(colon + 1);
+        session.origin_host = authority.substr(0, colon);
+    }
+}
+
+// Разбирает сервер из URL и готовит запрос к нему. extra_headers — заголовки
+// условного запроса при проверке сохраненного ответа.
+void start_origin_request(EventLoop& loop, std::shared_ptr<Session> session, const std::string& extra_headers) {
+    std::string temp_url = session->url;
+    if (temp_url.rfind("http://", 0) == 0) {
+        temp_url = temp_url.substr(7);
+    }
+    size_t path_pos = temp_url.find('/');
+    std::string host = (path_pos == std::string::npos) ? temp_url : temp_url.substr(0, path_pos);
+    std::string path = (path_pos == std::string::npos) ? "/" : temp_url.substr(path_pos);
+    parse_origin_authority(*session, host, "80");
+
+    if (pipe2(session->pipe_fds, O_NONBLOCK) < 0 || pipe2(session->cache_pipe, O_NONBLOCK) < 0) {
+        perror("pipe2 failed");
+        send_error(*session, "500 Internal Server Error");
+        return;
+    }
+    // Соединение с сервером остается открытым для следующих запросов, если включен пул.
+    session->origin_request = session->method + " " + path + " " + session->http_version + "\r\n"
+                            + "Host: " + host + "\r\n"
+                            + session->forward_headers
+                            + extra_headers
+                            + (pool_size > 0 ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    open_origin_connection(loop, session, retryable_request(*session));
+}
+
+// Запускает фоновую проверку устаревшего объекта, если ее еще не выполняет другая сессия.
+void start_background_refresh(EventLoop& loop, const Session& source) {
+    if (!begin_refresh(object_cache, source.cache_key)) return;
+    auto refresh = add_session(loop);
+    refresh->refreshing = true;
+    refresh->method = "GET";
+    refresh->url = source.url;
+    refresh->forward_headers = source.forward_headers;
+    refresh->http_version = source.http_version;
+    refresh->cache_url = source.cache_url;
+    refresh->cache_key = source.cache_key;
+    refresh->revalidating = true;
+    refresh->stored_policy = source.stored_policy;
+    log_info("[INFO] Background revalidation for URL: " + source.url);
+    start_origin_request(loop, refresh, conditional_headers(source.stored_policy));
+    if (refresh->state == SessionState::CLOSED) {
+        close_session(loop, *refresh);
+    }
+}
+
+void release_stored_response(Session& session) {
+    session.object.reset();
+    close_fd(session.file_fd);
+}
+
+// CONNECT host:port: прокси подключается к серверу, отвечает клиенту 200 и дальше переносит
+// байты в обе стороны, не разбирая их (обычно это TLS). Байты, которые клиент отправил сразу
+// после заголовка, заранее кладутся в канал к серверу: канал вмещает весь буфер запроса.
+void start_tunnel(EventLoop& loop, std::shared_ptr<Session> session) {
+    parse_origin_authority(*session, session->url, "");
+    if (session->origin_host.empty() || session->origin_port.empty() || session->url.find('/') != std::string::npos) {
+        log_info("[ERROR] Invalid CONNECT target: " + session->url);
+        send_error(*session, "400 Bad Request");
+        return;
+    }
+    if (pipe2(session->pipe_fds, O_NONBLOCK) < 0 || pipe2(session->tunnel_pipe, O_NONBLOCK) < 0) {
+        perror("pipe2 failed");
+        send_error(*session, "500 Internal Server Error");
+        return;
+    }
+    if (!session->in.empty()) {
+        if (write(session->tunnel_pipe[1], session->in.data(), session->in.size()) != (ssize_t)session->in.size()) {
+            perror("Failed to buffer tunnel data");
+            send_error(*session, "500 Internal Server Error");
+            return;
+        }
+        session->tunnel_pipe_bytes = session->in.size();
+        session->in.clear();
+    }
+    open_origin_connection(loop, session, false);
+}
+
+// Неблокирующее подключение к серверу туннеля завершено, когда getpeername перестает
+// возвращать ENOTCONN; ошибку подключения сообщает SO_ERROR.
+void connect_tunnel(Session& session) {
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    getsockopt(session.origin_fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+    sockaddr_storage peer;
+    socklen_t peer_length = sizeof(peer);
+    if (error == 0 && getpeername(session.origin_fd, (sockaddr*)&peer, &peer_length) < 0) return;
+    if (error != 0) {
+        log_info("[ERROR] Failed to connect to remote server " + session.url + ": " + strerror(error));
+        send_error(session, "502 Bad Gateway");
+        return;
+    }
+    log_info("[INFO] Tunnel established to " + session.url);
+    session.tunnel = true;
+    session.out = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    session.out_offset = 0;
+    session.state = SessionState::TUNNELING;
+}
+
+// Заголовки запроса, которые прокси формирует сам при работе с кэшем: условные запросы
+// к серверу, запрос целого ответа вместо диапазона и ответ без сжатия.
+const char* const CACHE_MANAGED_HEADERS[] = {"If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since",
+                                            "If-Range", "Range", "Accept-Encoding"};
+
+bool cache_managed_header(std::string_view name) {
+    for (const char* header : CACHE_MANAGED_HEADERS) {
+        if (equals_ignore_case(name, header)) return true;
+    }
+    return false;
+}
+
+// Заголовок запроса (head_size байт в начале session->in) получен целиком. Запрос GET без тела
+// обслуживается через кэш, остальные методы передаются серверу напрямую, с телом запроса.
+void start_request(EventLoop& loop, std::shared_ptr<Session> session, size_t head_size) {
+    RequestHead request;
+    if (!parse_request_head(std::string_view(session->in).substr(0, head_size), request)) {
+        log_info("[ERROR] Invalid request");
+        send_error(*session, "400 Bad Request");
+        return;
+    }
+    session->method = request.method;
+    session->url = request.target;
+    session->http_version = request.version;
+    log_info("[INFO] " + session->method + " " + session->url + " " + session->http_version);
+
+    if (session->method == "CONNECT") {
+        session->in.erase(0, head_size);
+        start_tunnel(loop, session);
+        return;
+    }
+    if (!init_request_body_reader(session->request_body, request)) {
+        log_info("[ERROR] Invalid request body framing for URL: " + session->url);
+        send_error(*session, "400 Bad Request");
+        return;
+    }
+    bool cacheable = session->method == "GET" && session->request_body.framing == BodyFraming::NONE;
+
+    // Cache-Control запроса: no-store — не сохранять ответ, no-cache — проверить сохраненный на сервере.
+    std::string cache_control = joined_header(request.headers, "Cache-Control");
+    session->no_store = cache_directive(cache_control, "no-store");
+    bool force_revalidate = cache_directive(cache_control, "no-cache") ||
+                            (cache_control.empty() && cache_directive(find_header(request.headers, "Pragma"), "no-cache"));
+    session->authorized = !find_header(request.headers, "Authorization").empty();
+
+    // Host формируется из URL, Expect обрабатывает сам прокси.
+    std::string connection = joined_header(request.headers, "Connection");
+    for (const HttpHeader& header : request.headers) {
+        if (hop_by_hop_header(header.name, connection) || equals_ignore_case(header.name, "Host") ||
+            equals_ignore_case(header.name, "Expect") || (cacheable && cache_managed_header(header.name))) {
+            continue;
+        }
+        session->forward_headers.append(header.name).append(": ").append(header.value).append("\r\n");
+    }
+    bool expect_continue = list_has_token(joined_header(request.headers, "Expect"), "100-continue");
+
+    // В session->in остается только начало тела запроса. Байты после тела (следующий запрос
+    // на том же соединении) отбрасываются: соединение с клиентом закрывается после ответа.
+    size_t body_prefix = body_consume(session->request_body, session->in.data() + head_size, session->in.size() - head_size);
+    session->in.erase(0, head_size);
+    session->in.resize(body_prefix);
+    // Клиент ждет 100 Continue, прежде чем отправить тело. Ответ короткий и отправляется сразу:
+    // буфер нового сокета его вмещает.
+    if (expect_continue && !body_complete(session->request_body) && session->http_version != "HTTP/1.0") {
+        const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(session->client_fd, continue_response, sizeof(continue_response) - 1, MSG_NOSIGNAL);
+    }
+
+    session->cache_url = normalize_url(session->url);
+    session->cache_key = url_hash(session->cache_url);
+    if (!cacheable) {
+        log_info("[INFO] Forwarding " + session->method + " for URL: " + session->url);
+        start_origin_request(loop, session, "");
+        return;
+    }
+
+    off_t body_offset = 0;
+    if (object_cache_lookup(object_cache, session->cache_key, session->cache_url, session->object,
+                            session->file_fd, body_offset, session->stored_policy)) {
+        time_t now = time(nullptr);
+        const char* tier = session->object ? "memory" : "disk";
+        if (session->file_fd >= 0) {
+            struct stat st;
+            fstat(session->file_fd, &st);
+            session->file_offset = body_offset;
+            session->file_size = st.st_size;
+        }
+
+        if (!force_revalidate && is_fresh(session->stored_policy, now)) {
+            log_info(std::string("[INFO] Cache HIT (") + tier + ") for URL: " + session->url);
+            session->state = SessionState::SENDING_CACHED;
+            return;
+        }
+        if (!force_revalidate && can_serve_stale(session->stored_policy, now)) {
+            log_info(std::string("[INFO] Cache HIT (") + tier + ", stale) for URL: " + session->url);
+            session->state = SessionState::SENDING_CACHED;
+            start_background_refresh(loop, *session);
+            return;
+        }
+        if (has_validators(session->stored_policy)) {
+            log_info(std::string("[INFO] Cache REVALIDATE (") + tier + ") for URL: " + session->url);
+            session->revalidating = true;
+            start_origin_request(loop, session, conditional_headers(session->stored_policy));
+            return;
+        }
+        release_stored_response(*session);
+    }
+
+    object_cache.misses++;
+    if (!session->no_store) {
+        session->fetch = join_fetch(object_cache, session->cache_key, session->cache_url, session->fetch_leader);
+        if (session->fetch && !session->fetch_leader) {
+            log_info("[INFO] Cache MISS (coalesced) for URL: " + session->url);
+            session->state = SessionState::FOLLOWING;
+            return;
+        }
+    }
+    log_info("[INFO] Cache MISS for URL: " + session->url);
+    start_origin_request(loop, session, "");
+}
+
+// Edge-triggered: читаем, пока ядро не вернет EAGAIN. Заголовок запроса может прийти несколькими
+// частями; он обрабатывается после \r\n\r\n, а поиск продолжается с конца уже просмотренного.
+bool read_request(EventLoop& loop, std::shared_ptr<Session> session) {
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        ssize_t n = read(session->client_fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            size_t scan_from = session->in.size() >= 3 ? session->in.size() - 3 : 0;
+            session->in.append(buffer, n);
+            size_t head_end = session->in.find("\r\n\r\n", scan_from);
+            if (head_end != std::string::npos) {
+                start_request(loop, session, head_end + 4);
+                return true;
+            }
+            if (session->in.size() > MAX_REQUEST_SIZE) {
+                send_error(*session, "400 Bad Request");
+                return true;
+            }
+        } else if (n == 0) {
+            session->state = SessionState::CLOSED;
+            return false;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+        } else if (errno != EINTR) {
+            session->state = SessionState::CLOSED;
+            return false;
+        }
+    }
+}
+
+// Сообщает ведомым сессиям, сколько байт ответа уже записано в файл.
+void publish_cache_progress(Session& session) {
+    if (session.fetch_leader && session.cache_fd >= 0) {
+        publish_fetch(*session.fetch, cache_header_size(session.cache_url) + session.cache_size);
+    }
+}
+
+// Записывает в файл кэша байты ответа из памяти (заголовок, строки разметки chunked).
+void write_cache_bytes(Session& session, const char* data, size_t n) {
+    if (session.cache_fd < 0) return;
+    if (write(session.cache_fd, data, n) != (ssize_t)n) {
+        perror("Failed to write cache file");
+        abort_cache_write(session);
+        if (session.client_fd < 0) session.state = SessionState::CLOSED;
+        return;
+    }
+    session.cache_size += n;
+    publish_cache_progress(session);
+}
+
+// Заголовок ответа сервера получен: при 304 обновляются метаданные сохраненного ответа и он
+// отдается клиенту, иначе ответ передается клиенту и, если это разрешено, записывается в кэш.
+void on_response_head(EventLoop& loop, Session& session, size_t head_size) {
+    ResponseHead response;
+    if (!parse_response_head(std::string_view(session.head).substr(0, head_size), response)) {
+        log_info("[ERROR] Invalid response from remote server for URL: " + session.url);
+        send_error(session, "502 Bad Gateway");
+        return;
+    }
+    init_body_reader(session.body, response);
+    // У ответа на HEAD нет тела, хотя его заголовки описывают тело ответа на GET.
+    if (session.method == "HEAD") session.body = no_body_reader();
+    if (session.body.error) {
+        log_info("[ERROR] Invalid Content-Length from remote server for URL: " + session.url);
+        send_error(session, "502 Bad Gateway");
+        return;
+    }
+    // Начало тела, пришедшее вместе с заголовком, проходит через разбор границ тела. Байты после
+    // конца тела отбрасываются, и такое соединение в пул не возвращается.
+    // Соединение с сервером возвращается в пул, только если и тело запроса передано до конца.
+    size_t prefix = session.head.size() - head_size;
+    size_t body_prefix = body_consume(session.body, session.head.data() + head_size, prefix);
+    std::string client_head = client_response_head(std::string_view(session.head).substr(0, head_size), response);
+    client_head.append(session.head, head_size, body_prefix);
+    session.origin_keep_alive = body_prefix == prefix && response_keep_alive(response) &&
+                                session.body.framing != BodyFraming::UNTIL_CLOSE && body_complete(session.request_body);
+    time_t now = time(nullptr);
+
+    if (session.revalidating && response.status == 304) {
+        refresh_cache_policy(session.stored_policy, response, now);
+        object_cache_refresh(object_cache, session.cache_key, session.cache_url, session.stored_policy);
+        log_info("[INFO] Revalidated (304) URL: " + session.url);
+        release_origin(loop, session);
+        session.state = session.client_fd >= 0 ? SessionState::SENDING_CACHED : SessionState::CLOSED;
         return;
     }
-    buffer[bytes_received] = '\0';
-    std::string request(buffer);
-    std::cout << "--- Received Request ---\n" << request << "\n------------------------\n";
 
-    std::istringstream request_stream(request);
-    std::string method, url, http_version;
-    request_stream >> method >> url >> http_version;
+    release_stored_response(session);
+    bool store = session.method == "GET" && !session.no_store && response_cache_policy(response, now, session.policy) &&
+                 shared_response_storable(response, session.authorized);
+    if (store) {
+        session.cache_fd = disk_cache_create(object_cache.disk, session.cache_key, session.cache_url, session.policy,
+                                             session.cache_temp_path);
+        if (session.cache_fd < 0) {
+            perror("Failed to create cache file");
+        } else {
+            if (session.fetch_leader) {
+                off_t header_size = cache_header_size(session.cache_url);
+                publish_fetch(*session.fetch, header_size, &session.cache_temp_path, header_size);
+            }
+            write_cache_bytes(session, client_head.data(), client_head.size());
+        }
+    } else if (session.revalidating && response.status < 500) {
+        // Ресурс изменился и больше не может храниться: прежний ответ удаляется.
+        object_cache_remove(object_cache, session.cache_key);
+    }
+    // Успешный POST, PUT или DELETE мог изменить ресурс: сохраненный ответ удаляется (RFC 9111, раздел 4.4).
+    if (!safe_method(session.method) && response.status < 400) {
+        object_cache_remove(object_cache, session.cache_key);
+    }
+    // Ответ не будет записан в кэш: ведомым нечего читать, и они обращаются к серверу сами.
+    if (session.cache_fd < 0) finish_fetch(session, false);
 
-    if (method != "GET") {
-        std::cerr << "Unsupported method: " << method << std::endl;
-        close(client_socket);
+    if (session.client_fd < 0) {
+        // Фоновому обновлению нечего делать с ответом, который не будет сохранен.
+        session.state = session.cache_fd >= 0 ? SessionState::RELAYING : SessionState::CLOSED;
         return;
     }
+    session.out = std::move(client_head);
+    session.out_offset = 0;
+    session.state = SessionState::SENDING_HEAD;
+}
 
-    std::string cache_filepath = url_to_filename(url);
-    std::ifstream cache_file(cache_filepath, std::ios::binary);
+// Читает заголовок ответа сервера до пустой строки. Начало тела, пришедшее вместе с ним,
+// отправляется клиенту из памяти вместе с заголовком, остальное тело — через splice.
+void receive_head(EventLoop& loop, Session& session) {
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        ssize_t n = recv(session.origin_fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            size_t scan_from = session.head.size() >= 3 ? session.head.size() - 3 : 0;
+            session.head.append(buffer, n);
+            size_t head_end = session.head.find("\r\n\r\n", scan_from);
+            // Промежуточные ответы 1xx клиенту не передаются: ждем окончательный.
+            while (head_end != std::string::npos && interim_response(session.head)) {
+                session.head.erase(0, head_end + 4);
+                head_end = session.head.find("\r\n\r\n");
+            }
+            if (head_end != std::string::npos) {
+                on_response_head(loop, session, head_end + 4);
+                return;
+            }
+            if (session.head.size() > MAX_RESPONSE_HEAD_SIZE) {
+                log_info("[ERROR] Response head too large for URL: " + session.url);
+                send_error(session, "502 Bad Gateway");
+                return;
+            }
+        } else if (n == 0) {
+            if (retry_origin_request(loop, session)) return;
+            log_info("[ERROR] Remote server closed connection without response for URL: " + session.url);
+            send_error(session, "502 Bad Gateway");
+            return;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            if (errno == ECONNRESET && retry_origin_request(loop, session)) return;
+            perror("Failed to receive from remote server");
+            send_error(session, "502 Bad Gateway");
+            return;
+        }
+    }
+}
 
-    if (cache_file.is_open()) {
-        std::cout << "[INFO] Cache HIT for URL: " << url << std::endl;
-        std::vector<char> cache_buffer(BUFFER_SIZE);
-        while (!cache_file.eof()) {
-            cache_file.read(cache_buffer.data(), cache_buffer.size());
-            send(client_socket, cache_buffer.data(), cache_file.gcount(), 0);
+// Переносит только что полученные n байт из канала ответа в файл кэша. Если ответ получает клиент,
+// они сначала дублируются через tee в канал-копию: канал ответа перед этим был пуст, а канал-копия
+// опустошается после каждой записи, поэтому tee копирует все n байт. Для фонового обновления
+// данные перемещаются в файл прямо из канала ответа.
+void write_to_cache(Session& session, size_t n) {
+    if (session.cache_fd < 0) return;
+    int source = session.pipe_fds[0];
+    if (session.client_fd >= 0) {
+        ssize_t copied = tee(session.pipe_fds[0], session.cache_pipe[1], n, SPLICE_F_NONBLOCK);
+        if (copied != (ssize_t)n) {
+            abort_cache_write(session);
+            return;
         }
-        cache_file.close();
+        source = session.cache_pipe[0];
     } else {
-        std::cout << "[INFO] Cache MISS for URL: " << url << std::endl;
+        session.pipe_bytes = 0;
+    }
+    while (n > 0) {
+        ssize_t written = splice(source, nullptr, session.cache_fd, nullptr, n, SPLICE_F_MOVE);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            perror("Failed to write cache file");
+            abort_cache_write(session);
+            // Канал-копию нужно опустошить, иначе следующий tee скопирует старые данные.
+            close_fd(session.cache_pipe[0]);
+            close_fd(session.cache_pipe[1]);
+            if (session.client_fd < 0) session.state = SessionState::CLOSED;
+            return;
+        }
+        n -= written;
+        session.cache_size += written;
+    }
+    publish_cache_progress(session);
+}
 
-        std::string temp_url = url;
-        if (temp_url.rfind("http://", 0) == 0) {
-            temp_url = temp_url.substr(7);
+// Строка разметки chunked (размер куска или трейлер) читается из сокета fd только до '\n'
+// включительно, чтобы следующий splice начался точно с данных куска, и разбирается. Возвращает
+// длину строки, 0 при закрытии соединения и -1, если данных пока нет или произошла ошибка (errno).
+ssize_t read_chunk_line(int fd, BodyReader& body, char* buffer) {
+    ssize_t n = recv(fd, buffer, MAX_CHUNK_LINE, MSG_PEEK);
+    if (n <= 0) return n;
+    const char* newline = (const char*)memchr(buffer, '\n', n);
+    size_t length = newline ? newline - buffer + 1 : n;
+    n = recv(fd, buffer, length, 0);
+    if (n > 0) body_consume(body, buffer, n);
+    return n;
+}
+
+// Строка разметки chunked ответа отправляется клиенту из памяти и дописывается в файл кэша.
+// Возвращает false, если данных пока нет.
+bool receive_chunk_line(Session& session) {
+    char buffer[MAX_CHUNK_LINE];
+    ssize_t n = read_chunk_line(session.origin_fd, session.body, buffer);
+    if (n < 0) {
+        if (errno == EINTR) return true;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("Failed to receive from remote server");
+            session.state = SessionState::CLOSED;
+        }
+        return false;
+    }
+    if (n == 0) {
+        session.origin_eof = true;
+        return true;
+    }
+    if (session.client_fd >= 0) {
+        if (session.out_offset == session.out.size()) {
+            session.out.clear();
+            session.out_offset = 0;
         }
-        size_t path_pos = temp_url.find('/');
-        std::string host = (path_pos == std::string::npos) ? temp_url : temp_url.substr(0, path_pos);
-        std::string path = (path_pos == std::string::npos) ? "/" : temp_url.substr(path_pos);
+        session.out.append(buffer, n);
+    }
+    write_cache_bytes(session, buffer, n);
+    return true;
+}
 
-        struct hostent* server = gethostbyname(host.c_str());
-        if (server == nullptr) {
-            std::cerr << "Could not resolve host: " << host << std::endl;
-            close(client_socket);
+// Тело запроса переносится из сокета клиента в сокет сервера через канал ответа (он еще пуст)
+// ровно до границы тела, строки разметки chunked — через session.out. Новые данные читаются
+// из клиента, только когда сервер принял предыдущие, поэтому память на соединение ограничена
+// емкостью канала при любом размере тела.
+void relay_request_body(EventLoop& loop, Session& session) {
+    while (session.state == SessionState::SENDING_BODY) {
+        if (session.pipe_bytes > 0) {
+            ssize_t n = splice(session.pipe_fds[0], nullptr, session.origin_fd, nullptr, session.pipe_bytes,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                session.pipe_bytes -= n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            abandon_request_body(session);
             return;
         }
+        if (!flush_output(loop, session, session.origin_fd)) return;
 
-        int remote_socket = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in remote_addr;
-        remote_addr.sin_family = AF_INET;
-        remote_addr.sin_port = htons(80); // HTTP port
-        memcpy(&remote_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+        if (session.request_body.error) {
+            log_info("[ERROR] Invalid chunked request body for URL: " + session.url);
+            send_error(session, "400 Bad Request");
+            return;
+        }
+        if (body_complete(session.request_body)) {
+            session.state = SessionState::RECEIVING_HEAD;
+            return;
+        }
 
-        if (connect(remote_socket, (struct sockaddr*)&remote_addr, sizeof(remote_addr)) < 0) {
-            perror("Failed to connect to remote server");
-            close(remote_socket);
-            close(client_socket);
+        uint64_t passthrough = body_passthrough(session.request_body);
+        ssize_t n;
+        if (passthrough == 0) {
+            char buffer[MAX_CHUNK_LINE];
+            n = read_chunk_line(session.client_fd, session.request_body, buffer);
+            if (n > 0) {
+                session.out.assign(buffer, n);
+                session.out_offset = 0;
+            }
+        } else {
+            n = splice(session.client_fd, nullptr, session.pipe_fds[1], nullptr,
+                       std::min<uint64_t>(passthrough, PIPE_CHUNK_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                body_skip(session.request_body, n);
+                session.pipe_bytes = n;
+            }
+        }
+        if (n > 0 || (n < 0 && errno == EINTR)) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        // Клиент закрыл соединение, не отправив тело целиком.
+        log_info("[ERROR] Client closed connection before end of request body for URL: " + session.url);
+        session.state = SessionState::CLOSED;
+        return;
+    }
+}
+
+// Ответ передан: полный ответ сохраняется в кэше, а соединение с сервером возвращается в пул.
+// Если сервер закрыл соединение раньше границы тела, ответ неполный и в кэш не попадает.
+void finish_response(EventLoop& loop, Session& session) {
+    bool complete = !session.body.error &&
+                    (body_complete(session.body) || session.body.framing == BodyFraming::UNTIL_CLOSE);
+    if (complete) {
+        commit_cache_write(session);
+    } else {
+        log_info("[ERROR] Truncated response from remote server for URL: " + session.url);
+        abort_cache_write(session);
+    }
+    if (complete && !session.origin_eof) {
+        release_origin(loop, session);
+    } else {
+        close_origin(loop, session);
+    }
+    session.state = SessionState::CLOSED;
+}
+
+// Тело переносится через splice ровно до границы, известной из BodyReader: после него на
+// постоянном соединении начнется следующий ответ. Порядок байт для клиента сохраняется:
+// новые данные читаются, только когда канал и буфер строк разметки отправлены.
+void relay_response(EventLoop& loop, Session& session) {
+    while (session.state == SessionState::RELAYING) {
+        if (session.pipe_bytes > 0) {
+            ssize_t n = splice(session.pipe_fds[0], nullptr, session.client_fd, nullptr, session.pipe_bytes,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                session.pipe_bytes -= n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            drop_client(loop, session);
+            continue;
+        }
+        if (session.client_fd >= 0 && !flush_output(loop, session, session.client_fd)) {
+            if (session.client_fd >= 0) return;
+            continue;
+        }
+
+        if (session.origin_eof || session.body.error || body_complete(session.body)) {
+            finish_response(loop, session);
             return;
         }
 
-        std::string forward_request = "GET " + path + " " + http_version + "\r\n"
-                                    + "Host: " + host + "\r\n"
-                                    + "Connection: close\r\n\r\n"; // "Connection: close" важно!
-        send(remote_socket, forward_request.c_str(), forward_request.length(), 0);
+        uint64_t passthrough = body_passthrough(session.body);
+        if (passthrough == 0) {
+            if (!receive_chunk_line(session)) return;
+            continue;
+        }
+        ssize_t n = splice(session.origin_fd, nullptr, session.pipe_fds[1], nullptr,
+                           std::min<uint64_t>(passthrough, PIPE_CHUNK_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            body_skip(session.body, n);
+            session.pipe_bytes = n;
+            write_to_cache(session, n);
+        } else if (n == 0) {
+            session.origin_eof = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            perror("Failed to receive from remote server");
+            session.state = SessionState::CLOSED;
+            return;
+        }
+    }
+}
 
-        std::ofstream new_cache_file(cache_filepath, std::ios::binary);
-        char remote_buffer[BUFFER_SIZE];
-        int remote_bytes_received;
-        while ((remote_bytes_received = recv(remote_socket, remote_buffer, BUFFER_SIZE, 0)) > 0) {
-            send(client_socket, remote_buffer, remote_bytes_received, 0);
-            if (new_cache_file.is_open()) {
-                new_cache_file.write(remote_buffer, remote_bytes_received);
+// Одно направление туннеля: from -> канал -> to через splice. Новые данные читаются, только
+// когда канал опустел. Когда источник закрыт (eof), получателю передается закрытие на запись,
+// а второе направление продолжает работать. bytes — сколько байт доставлено получателю.
+void pump_tunnel(int from, int to, int pipe[2], size_t& pipe_bytes, uint64_t& bytes, bool& eof, bool& failed) {
+    while (!failed) {
+        if (pipe_bytes > 0) {
+            ssize_t n = splice(pipe[0], nullptr, to, nullptr, pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                pipe_bytes -= n;
+                bytes += n;
+                continue;
             }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            failed = true;
+            return;
         }
+        if (eof) return;
+        ssize_t n = splice(from, nullptr, pipe[1], nullptr, PIPE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            pipe_bytes = n;
+        } else if (n == 0) {
+            eof = true;
+            shutdown(to, SHUT_WR);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            failed = true;
+        }
+    }
+}
 
-        if (new_cache_file.is_open()) new_cache_file.close();
-        close(remote_socket);
+// Сначала клиенту отправляется ответ 200, затем байты переносятся в обе стороны. Туннель
+// закрывается, когда обе стороны закрыли соединение, при ошибке или по таймауту простоя.
+void relay_tunnel(EventLoop& loop, Session& session) {
+    if (!flush_output(loop, session, session.client_fd)) return;
+    bool failed = false;
+    pump_tunnel(session.client_fd, session.origin_fd, session.tunnel_pipe, session.tunnel_pipe_bytes,
+                session.tunnel_sent, session.client_eof, failed);
+    pump_tunnel(session.origin_fd, session.client_fd, session.pipe_fds, session.pipe_bytes,
+                session.tunnel_received, session.origin_eof, failed);
+    bool drained = session.tunnel_pipe_bytes == 0 && session.pipe_bytes == 0;
+    if (failed || (session.client_eof && session.origin_eof && drained)) {
+        session.state = SessionState::CLOSED;
+    }
+}
+
+void send_cached(Session& session) {
+    if (session.object) {
+        const std::string& bytes = session.object->bytes;
+        while (session.object_offset < bytes.size()) {
+            ssize_t n = send(session.client_fd, bytes.data() + session.object_offset, bytes.size() - session.object_offset,
+                             MSG_NOSIGNAL);
+            if (n > 0) {
+                session.object_offset += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            break;
+        }
+        session.state = SessionState::CLOSED;
+        return;
     }
 
-    close(client_socket);
-    std::cout << "[INFO] Client connection closed.\n" << std::endl;
+    while (session.file_offset < session.file_size) {
+        ssize_t n = sendfile(session.client_fd, session.file_fd, &session.file_offset, session.file_size - session.file_offset);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        break;
+    }
+    session.state = SessionState::CLOSED;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: ./proxy_server <port>" << std::endl;
-        return 1;
+// Ведомая сессия отправляет клиенту из файла общей загрузки то, что ведущий уже записал. Догнав
+// запись, она регистрирует воркер в списке ожидающих и ждет пробуждения через notify_fd. Если
+// загрузка не удалась, а клиенту еще ничего не отправлено, сессия запрашивает сервер сама.
+void follow_fetch(EventLoop& loop, std::shared_ptr<Session> session) {
+    InFlightFetch& fetch = *session->fetch;
+    while (session->state == SessionState::FOLLOWING) {
+        off_t available = 0;
+        bool failed;
+        {
+            std::lock_guard<std::mutex> lock(fetch.mutex);
+            failed = fetch.failed;
+            if (!failed && session->file_fd < 0 && !fetch.path.empty()) {
+                session->file_fd = open(fetch.path.c_str(), O_RDONLY | O_CLOEXEC);
+                session->file_offset = fetch.body_offset;
+                if (session->file_fd < 0) {
+                    perror("Failed to open shared cache file");
+                    failed = true;
+                }
+            }
+            if (!failed) {
+                available = fetch.size;
+                bool caught_up = session->file_fd < 0 || session->file_offset >= available;
+                if (caught_up && fetch.done) {
+                    session->state = SessionState::CLOSED;
+                    return;
+                }
+                if (caught_up) {
+                    if (std::find(fetch.waiters.begin(), fetch.waiters.end(), loop.notify_fd) == fetch.waiters.end()) {
+                        fetch.waiters.push_back(loop.notify_fd);
+                    }
+                    park_session(loop, session);
+                    return;
+                }
+            }
+        }
+
+        if (failed) {
+            bool sent = session->file_fd >= 0 && session->file_offset > fetch.body_offset;
+            close_fd(session->file_fd);
+            finish_fetch(*session, false);
+            if (sent) {
+                session->state = SessionState::CLOSED;
+                return;
+            }
+            log_info("[INFO] Shared fetch failed, requesting URL: " + session->url);
+            start_origin_request(loop, session, "");
+            return;
+        }
+
+        ssize_t n = sendfile(session->client_fd, session->file_fd, &session->file_offset, available - session->file_offset);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        session->state = SessionState::CLOSED;
     }
-    int port = std::stoi(argv[1]);
+}
 
-    if (!std::filesystem::exists(CACHE_DIR)) {
-        std::filesystem::create_directory(CACHE_DIR);
+// Продвигает конечный автомат сессии, пока очередная операция не вернет EAGAIN.
+void advance_session(EventLoop& loop, std::shared_ptr<Session> session) {
+    while (true) {
+        switch (session->state) {
+        case SessionState::READING_REQUEST:
+            if (!read_request(loop, session)) return;
+            break;
+        case SessionState::RESOLVING:
+            connect_session_origin(loop, session);
+            if (session->state == SessionState::RESOLVING) return;
+            break;
+        case SessionState::SENDING_REQUEST:
+            if (session->method == "CONNECT") {
+                connect_tunnel(*session);
+                if (session->state == SessionState::SENDING_REQUEST) return;
+                break;
+            }
+            if (!flush_output(loop, *session, session->origin_fd)) {
+                if (session->state == SessionState::SENDING_REQUEST) return;
+                break;
+            }
+            session->state = body_complete(session->request_body) ? SessionState::RECEIVING_HEAD
+                                                                  : SessionState::SENDING_BODY;
+            break;
+        case SessionState::SENDING_BODY:
+            relay_request_body(loop, *session);
+            if (session->state == SessionState::SENDING_BODY) return;
+            break;
+        case SessionState::RECEIVING_HEAD:
+            receive_head(loop, *session);
+            if (session->state == SessionState::RECEIVING_HEAD) return;
+            break;
+        case SessionState::SENDING_HEAD:
+            if (!flush_output(loop, *session, session->client_fd)) return;
+            session->state = SessionState::RELAYING;
+            break;
+        case SessionState::RELAYING:
+            relay_response(loop, *session);
+            return;
+        case SessionState::SENDING_CACHED:
+            send_cached(*session);
+            return;
+        case SessionState::TUNNELING:
+            relay_tunnel(loop, *session);
+            return;
+        case SessionState::FOLLOWING:
+            follow_fetch(loop, session);
+            if (session->state == SessionState::FOLLOWING || session->state == SessionState::CLOSED) return;
+            break;
+        case SessionState::SENDING_ERROR:
+            if (flush_output(loop, *session, session->client_fd)) {
+                session->state = SessionState::CLOSED;
+            }
+            return;
+        case SessionState::CLOSED:
+            return;
+        }
+    }
+}
+
+void accept_clients(int server_socket, EventLoop& loop) {
+    while (true) {
+        sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept4(server_socket, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept failed");
+            }
+            return;
+        }
+        if (!watch_fd(loop, client_socket)) {
+            close(client_socket);
+            continue;
+        }
+        log_info(std::string("[INFO] Accepted new connection from ") + inet_ntoa(client_addr.sin_addr));
+
+        auto session = add_session(loop);
+        session->client_fd = client_socket;
+        loop.sessions[client_socket] = std::move(session);
+    }
+}
+
+// После обработки события: закрытая сессия освобождается, активная переносится в конец списка простоя.
+void settle_session(EventLoop& loop, const std::shared_ptr<Session>& session) {
+    if (session->state == SessionState::CLOSED) {
+        close_session(loop, *session);
+    } else {
+        session->last_active = Clock::now();
+        loop.idle_list.splice(loop.idle_list.end(), loop.idle_list, session->idle_pos);
+    }
+}
+
+// Пробуждение через notify_fd: ждавшие сессии проверяют, готово ли то, чего они ждали.
+void wake_waiting_sessions(EventLoop& loop) {
+    uint64_t value;
+    while (read(loop.notify_fd, &value, sizeof(value)) > 0) {}
+    std::vector<std::shared_ptr<Session>> waiting;
+    waiting.swap(loop.waiting);
+    for (auto& session : waiting) {
+        session->waiting = false;
+        if (session->state != SessionState::FOLLOWING && session->state != SessionState::RESOLVING) continue;
+        advance_session(loop, session);
+        settle_session(loop, session);
+    }
+}
+
+void close_idle_sessions(EventLoop& loop) {
+    auto deadline = Clock::now() - std::chrono::seconds(idle_timeout_sec);
+    while (!loop.idle_list.empty()) {
+        auto session = loop.idle_list.front();
+        if (session->last_active > deadline) break;
+        log_info("[INFO] Idle timeout for URL: " + session->url);
+        close_session(loop, *session);
+    }
+}
+
+void run_event_loop(int server_socket) {
+    EventLoop loop;
+    loop.epoll_fd = epoll_create1(0);
+    if (loop.epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = server_socket;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+        perror("epoll_ctl failed");
+        close(loop.epoll_fd);
+        return;
+    }
+    loop.notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.data.fd = loop.notify_fd;
+    if (loop.notify_fd < 0 || epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.notify_fd, &ev) < 0) {
+        perror("eventfd failed");
+        close(loop.epoll_fd);
+        return;
+    }
+
+    std::vector<epoll_event> events(MAX_EVENTS);
+    auto next_timer = Clock::now() + std::chrono::milliseconds(TIMER_RESOLUTION_MS);
+
+    while (true) {
+        int n = epoll_wait(loop.epoll_fd, events.data(), MAX_EVENTS, TIMER_RESOLUTION_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == server_socket) {
+                accept_clients(server_socket, loop);
+                continue;
+            }
+            if (fd == loop.notify_fd) {
+                wake_waiting_sessions(loop);
+                continue;
+            }
+
+            auto it = loop.sessions.find(fd);
+            if (it == loop.sessions.end()) continue;
+            std::shared_ptr<Session> session = it->second;
+
+            // Ошибку на сокете сервера покажет сама операция с ним (splice вернет ошибку или 0).
+            if (fd == session->client_fd && (events[i].events & EPOLLERR)) {
+                drop_client(loop, *session);
+            }
+            advance_session(loop, session);
+            settle_session(loop, session);
+        }
+
+        if (Clock::now() >= next_timer) {
+            close_idle_sessions(loop);
+            expire_pooled_connections(loop);
+            next_timer = Clock::now() + std::chrono::milliseconds(TIMER_RESOLUTION_MS);
+        }
+    }
+
+    close(loop.notify_fd);
+    close(loop.epoll_fd);
+}
+
+// С SO_REUSEPORT каждый воркер получает собственный слушающий сокет на том же порту,
+// и ядро само распределяет входящие соединения между ними.
+int create_listener(int port) {
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server_socket < 0) {
+        perror("Socket creation failed");
+        return -1;
     }
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
@@ -129,28 +1451,79 @@ int main(int argc, char* argv[]) {
 
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
-        return 1;
+        close(server_socket);
+        return -1;
     }
 
-    if (listen(server_socket, 10) < 0) {
+    if (listen(server_socket, SOMAXCONN) < 0) {
         perror("Listen failed");
+        close(server_socket);
+        return -1;
+    }
+    return server_socket;
+}
+
+int main(int argc, char* argv[]) {
+    int port = -1;
+    int workers = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc) {
+            workers = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            idle_timeout_sec = std::stoi(argv[++i]);
+        } else if (arg == "--memory-cache" && i + 1 < argc) {
+            object_cache.memory.shard_capacity = std::stoull(argv[++i]) * 1024 * 1024 / MEMORY_CACHE_SHARDS;
+        } else if (arg == "--disk-cache" && i + 1 < argc) {
+            object_cache.disk.capacity = std::stoull(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--pool-size" && i + 1 < argc) {
+            pool_size = std::stoul(argv[++i]);
+        } else if (arg == "--pool-idle" && i + 1 < argc) {
+            pool_idle_sec = std::stoi(argv[++i]);
+        } else if (arg == "-q") {
+            verbose = false;
+        } else if (arg[0] != '-' && port < 0) {
+            port = std::stoi(arg);
+        } else {
+            port = -1;
+            break;
+        }
+    }
+    if (port < 0) {
+        std::cerr << "Usage: ./proxy_server <port> [--workers N] [--idle-timeout sec] [--memory-cache MB] [--disk-cache MB]"
+                     " [--pool-size N] [--pool-idle sec] [-q]" << std::endl;
         return 1;
     }
 
-    std::cout << "HTTP Proxy server is listening on port " << port << "..." << std::endl;
+    if (!std::filesystem::exists(CACHE_DIR)) {
+        std::filesystem::create_directory(CACHE_DIR);
+    }
+    disk_cache_load(object_cache.disk);
+    start_resolver(resolver, RESOLVER_THREADS);
+
+    signal(SIGPIPE, SIG_IGN);
 
-    while (true) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        if (client_socket < 0) {
-            perror("Accept failed");
-            continue;
+    std::vector<int> listeners;
+    for (int i = 0; i < workers; ++i) {
+        int server_socket = create_listener(port);
+        if (server_socket < 0) {
+            for (int fd : listeners) close(fd);
+            return 1;
         }
-        std::cout << "[INFO] Accepted new connection from " << inet_ntoa(client_addr.sin_addr) << std::endl;
-        handle_client(client_socket);
+        listeners.push_back(server_socket);
     }
 
-    close(server_socket);
+    std::cout << "HTTP Proxy server is listening on port " << port << " (workers: " << workers << ")..." << std::endl;
+
+    std::vector<std::thread> threads;
+    for (int fd : listeners) {
+        threads.emplace_back(run_event_loop, fd);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (int fd : listeners) close(fd);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <atomic>
+#include <algorithm>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <unistd.h>
+
+const int RESOLVER_THREADS = 2;
+const size_t RESOLVER_CACHE_SIZE = 4096;
+const size_t DNS_ANSWER_SIZE = 4096;
+// Границы TTL положительного ответа. Адреса из /etc/hosts (getaddrinfo, TTL неизвестен)
+// хранятся DNS_DEFAULT_TTL.
+const time_t DNS_MIN_TTL = 1;
+const time_t DNS_MAX_TTL = 3600;
+const time_t DNS_DEFAULT_TTL = 60;
+// Отрицательный ответ (NXDOMAIN, нет записей) хранится по SOA зоны (RFC 2308), но не дольше
+// DNS_NEGATIVE_MAX_TTL. Если DNS-сервер не ответил вовсе, ошибка хранится DNS_FAILURE_TTL.
+const time_t DNS_NEGATIVE_MAX_TTL = 300;
+const time_t DNS_FAILURE_TTL = 5;
+
+struct HostAddress {
+    sockaddr_storage addr;
+    socklen_t length;
+};
+
+// Запись кэша резолвера. Пока имя разрешается (pending), воркеры, которым оно нужно, ждут:
+// их eventfd собраны в waiters и получают сигнал, когда ответ готов.
+struct ResolvedHost {
+    bool pending = false;
+    bool failed = false;
+    std::string error;
+    std::vector<HostAddress> addresses;
+    time_t expires = 0;
+    std::vector<int> waiters;
+};
+
+struct ResolverCacheEntry {
+    std::string host;
+    std::shared_ptr<ResolvedHost> entry;
+};
+
+// Кэширующий резолвер, общий для всех воркеров. Имена разрешаются в отдельных потоках, поэтому
+// медленный DNS не останавливает циклы epoll, а одновременные запросы одного имени объединяются
+// в один DNS-запрос. Кэш — LRU не больше RESOLVER_CACHE_SIZE имен.
+struct Resolver {
+    std::mutex mutex;
+    std::condition_variable queue_ready;
+    std::deque<std::string> queue;
+    std::list<ResolverCacheEntry> lru;
+    std::unordered_map<std::string, std::list<ResolverCacheEntry>::iterator> index;
+    std::atomic<unsigned long long> lookups{0};
+    std::atomic<unsigned long long> cache_hits{0};
+    std::atomic<unsigned long long> negative_hits{0};
+};
+
+Resolver resolver;
+
+enum class ResolveStatus {
+    READY,
+    PENDING,
+    FAILED
+};
+
+// Один DNS-запрос типа type (A или AAAA). Адреса из ответа добавляются в addresses, ttl
+// уменьшается до наименьшего TTL записей ответа (включая CNAME), а для ответа без адресов
+// negative_ttl берется из SOA в разделе authority. Возвращает false, если ответа нет.
+bool query_host(res_state state, const std::string& host, int type, std::vector<HostAddress>& addresses,
+                time_t& ttl, time_t& negative_ttl) {
+    unsigned char query[NS_PACKETSZ];
+    int query_size = res_nmkquery(state, ns_o_query, host.c_str(), ns_c_in, type, nullptr, 0, nullptr, query, sizeof(query));
+    if (query_size < 0) return false;
+    unsigned char answer[DNS_ANSWER_SIZE];
+    int answer_size = res_nsend(state, query, query_size, answer, sizeof(answer));
+    if (answer_size < 0) return false;
+
+    ns_msg message;
+    if (ns_initparse(answer, answer_size, &message) < 0) return false;
+    int rcode = ns_msg_getflag(message, ns_f_rcode);
+    if (rcode != ns_r_noerror && rcode != ns_r_nxdomain) return false;
+
+    ns_rr record;
+    size_t found = addresses.size();
+    for (int i = 0; i < ns_msg_count(message, ns_s_an); ++i) {
+        if (ns_parserr(&message, ns_s_an, i, &record) < 0) break;
+        HostAddress address{};
+        if (ns_rr_type(record) == ns_t_a && ns_rr_rdlen(record) == 4) {
+            auto* in = (sockaddr_in*)&address.addr;
+            in->sin_family = AF_INET;
+            memcpy(&in->sin_addr, ns_rr_rdata(record), 4);
+            address.length = sizeof(sockaddr_in);
+        } else if (ns_rr_type(record) == ns_t_aaaa && ns_rr_rdlen(record) == 16) {
+            auto* in6 = (sockaddr_in6*)&address.addr;
+            in6->sin6_family = AF_INET6;
+            memcpy(&in6->sin6_addr, ns_rr_rdata(record), 16);
+            address.length = sizeof(sockaddr_in6);
+        } else if (ns_rr_type(record) != ns_t_cname) {
+            continue;
+        }
+        ttl = std::min<time_t>(ttl, ns_rr_ttl(record));
+        if (address.length > 0) addresses.push_back(address);
+    }
+    if (addresses.size() > found) return true;
+
+    for (int i = 0; i < ns_msg_count(message, ns_s_ns); ++i) {
+        if (ns_parserr(&message, ns_s_ns, i, &record) < 0) break;
+        if (ns_rr_type(record) != ns_t_soa || ns_rr_rdlen(record) < 4) continue;
+        // Последнее поле SOA — MINIMUM.
+        time_t minimum = ns_get32(ns_rr_rdata(record) + ns_rr_rdlen(record) - 4);
+        negative_ttl = std::min<time_t>(ns_rr_ttl(record), minimum);
+    }
+    return true;
+}
+
+// Разрешает имя: сначала DNS (A, затем AAAA) с учетом TTL, затем getaddrinfo для имен, которых
+// нет в DNS (/etc/hosts). ttl — сколько секунд хранить результат, в том числе отрицательный.
+bool lookup_host(res_state state, const std::string& host, std::vector<HostAddress>& addresses, time_t& ttl,
+                 std::string& error) {
+    time_t record_ttl = DNS_MAX_TTL;
+    time_t negative_ttl = DNS_FAILURE_TTL;
+    bool answered = query_host(state, host, ns_t_a, addresses, record_ttl, negative_ttl);
+    answered = query_host(state, host, ns_t_aaaa, addresses, record_ttl, negative_ttl) || answered;
+    if (!addresses.empty()) {
+        ttl = std::clamp(record_ttl, DNS_MIN_TTL, DNS_MAX_TTL);
+        return true;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    int err = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+    if (err == 0) {
+        for (addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+            HostAddress address{};
+            memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+            address.length = ai->ai_addrlen;
+            addresses.push_back(address);
+        }
+        freeaddrinfo(result);
+        ttl = DNS_DEFAULT_TTL;
+        return true;
+    }
+    error = gai_strerror(err);
+    ttl = answered ? std::min(negative_ttl, DNS_NEGATIVE_MAX_TTL) : DNS_FAILURE_TTL;
+    return false;
+}
+
+// Возвращает запись имени, перенося ее в начало LRU, или создает новую. Если кэш заполнен,
+// вытесняется самое давнее имя; разрешаемые (pending) записи не вытесняются — их ждут сессии,
+// они переносятся в начало. Вызывается под resolver.mutex.
+ResolvedHost& resolver_cache_entry(Resolver& resolver, const std::string& host) {
+    auto found = resolver.index.find(host);
+    if (found != resolver.index.end()) {
+        resolver.lru.splice(resolver.lru.begin(), resolver.lru, found->second);
+        return *found->second->entry;
+    }
+    for (size_t checked = 0; resolver.lru.size() >= RESOLVER_CACHE_SIZE && checked < resolver.lru.size(); ++checked) {
+        auto oldest = std::prev(resolver.lru.end());
+        if (oldest->entry->pending) {
+            resolver.lru.splice(resolver.lru.begin(), resolver.lru, oldest);
+            continue;
+        }
+        resolver.index.erase(oldest->host);
+        resolver.lru.erase(oldest);
+    }
+    resolver.lru.push_front({host, std::make_shared<ResolvedHost>()});
+    resolver.index[host] = resolver.lru.begin();
+    return *resolver.lru.front().entry;
+}
+
+// Поток резолвера: у каждого свое состояние res_state, поэтому запросы идут параллельно.
+void run_resolver(Resolver& resolver) {
+    struct __res_state state{};
+    if (res_ninit(&state) < 0) {
+        perror("res_ninit failed");
+        return;
+    }
+    while (true) {
+        std::string host;
+        {
+            std::unique_lock<std::mutex> lock(resolver.mutex);
+            resolver.queue_ready.wait(lock, [&] { return !resolver.queue.empty(); });
+            host = std::move(resolver.queue.front());
+            resolver.queue.pop_front();
+        }
+
+        std::vector<HostAddress> addresses;
+        time_t ttl = 0;
+        std::string error;
+        bool ok = lookup_host(&state, host, addresses, ttl, error);
+        resolver.lookups++;
+
+        std::vector<int> waiters;
+        {
+            std::lock_guard<std::mutex> lock(resolver.mutex);
+            ResolvedHost& entry = resolver_cache_entry(resolver, host);
+            entry.pending = false;
+            entry.failed = !ok;
+            entry.error = error;
+            entry.addresses = std::move(addresses);
+            entry.expires = time(nullptr) + ttl;
+            waiters.swap(entry.waiters);
+        }
+        uint64_t one = 1;
+        for (int fd : waiters) {
+            if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("Failed to wake worker");
+        }
+    }
+}
+
+void start_resolver(Resolver& resolver, int threads) {
+    for (int i = 0; i < threads; ++i) {
+        std::thread(run_resolver, std::ref(resolver)).detach();
+    }
+}
+
+// Возвращает адреса хоста из кэша (READY), ошибку из отрицательного кэша (FAILED) или ставит
+// имя в очередь разрешения (PENDING): тогда воркер будет разбужен через notify_fd и должен
+// повторить вызов. IP-адрес в URL разбирается сразу, без кэша.
+ResolveStatus resolve_host(Resolver& resolver, const std::string& host, int notify_fd,
+                           std::vector<HostAddress>& addresses, std::string& error) {
+    HostAddress numeric{};
+    std::string literal = host.size() > 2 && host.front() == '[' && host.back() == ']' ? host.substr(1, host.size() - 2) : host;
+    auto* in = (sockaddr_in*)&numeric.addr;
+    auto* in6 = (sockaddr_in6*)&numeric.addr;
+    if (inet_pton(AF_INET, literal.c_str(), &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        numeric.length = sizeof(sockaddr_in);
+        addresses.assign(1, numeric);
+        return ResolveStatus::READY;
+    }
+    if (inet_pton(AF_INET6, literal.c_str(), &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        numeric.length = sizeof(sockaddr_in6);
+        addresses.assign(1, numeric);
+        return ResolveStatus::READY;
+    }
+
+    time_t now = time(nullptr);
+    std::lock_guard<std::mutex> lock(resolver.mutex);
+    ResolvedHost& entry = resolver_cache_entry(resolver, host);
+    if (!entry.pending && now < entry.expires) {
+        if (entry.failed) {
+            resolver.negative_hits++;
+            error = entry.error;
+            return ResolveStatus::FAILED;
+        }
+        resolver.cache_hits++;
+        addresses = entry.addresses;
+        return ResolveStatus::READY;
+    }
+    // Имя уже разрешается по запросу другой сессии: ждем тот же ответ.
+    if (!entry.pending) {
+        entry.pending = true;
+        resolver.queue.push_back(host);
+        resolver.queue_ready.notify_one();
+    }
+    if (std::find(entry.waiters.begin(), entry.waiters.end(), notify_fd) == entry.waiters.end()) {
+        entry.waiters.push_back(notify_fd);
+    }
+    return ResolveStatus::PENDING;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <string>
+#include <cstdio>
+#include <cstdarg>
+#include <ctime>
+#include <chrono>
+#include <algorithm>
+
+const size_t LOG_RING_CAPACITY = 8192;  // степень двойки
+const size_t LOG_LINE_SIZE = 240;
+const int LOG_FLUSH_INTERVAL_MS = 5;
+
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    timespec time;
+    size_t length;
+    char line[LOG_LINE_SIZE];
+};
+
+// Асинхронный журнал: воркеры записывают строки в ограниченное кольцо без блокировок
+// (очередь Вьюкова с порядковым номером в каждой ячейке), а отдельный поток пачками
+// выводит их в stdout. Если кольцо заполнено, строка отбрасывается и учитывается в dropped:
+// журнал не должен тормозить обработку запросов.
+struct AsyncLogger {
+    std::unique_ptr<LogSlot[]> slots;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) size_t tail = 0;
+    std::atomic<unsigned long long> dropped{0};
+    std::atomic<bool> running{false};
+    // Записывается в журнал каждый sample-й запрос каждого воркера.
+    unsigned sample = 1;
+    std::thread thread;
+};
+
+AsyncLogger access_log;
+
+// Решает, попадет ли очередной запрос текущего потока в журнал (1 из sample).
+bool log_sampled() {
+    thread_local unsigned counter = 0;
+    if (!access_log.running.load(std::memory_order_relaxed)) return false;
+    return counter++ % access_log.sample == 0;
+}
+
+bool log_line(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+bool log_line(const char* format, ...) {
+    AsyncLogger& logger = access_log;
+    if (!logger.running.load(std::memory_order_relaxed)) return false;
+
+    LogSlot* slot;
+    size_t pos = logger.head.load(std::memory_order_relaxed);
+    while (true) {
+        slot = &logger.slots[pos & (LOG_RING_CAPACITY - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        long diff = (long)sequence - (long)pos;
+        if (diff == 0) {
+            if (logger.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            logger.dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = logger.head.load(std::memory_order_relaxed);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &slot->time);
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(slot->line, LOG_LINE_SIZE, format, args);
+    va_end(args);
+    slot->length = std::min<size_t>(std::max(n, 0), LOG_LINE_SIZE - 1);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+void format_log_time(const timespec& time, std::string& out) {
+    struct tm tm;
+    localtime_r(&time.tv_sec, &tm);
+    char buffer[48];
+    size_t n = strftime(buffer, sizeof(buffer), "[%Y-%m-%d %H:%M:%S", &tm);
+    n += snprintf(buffer + n, sizeof(buffer) - n, ".%03ld] ", time.tv_nsec / 1000000);
+    out.append(buffer, n);
+}
+
+// Забирает все готовые строки из кольца; возвращает число выведенных строк.
+size_t drain_log(AsyncLogger& logger, std::string& batch) {
+    size_t count = 0;
+    while (true) {
+        LogSlot& slot = logger.slots[logger.tail & (LOG_RING_CAPACITY - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != logger.tail + 1) break;
+        format_log_time(slot.time, batch);
+        batch.append(slot.line, slot.length);
+        batch += '\n';
+        slot.sequence.store(logger.tail + LOG_RING_CAPACITY, std::memory_order_release);
+        logger.tail++;
+        count++;
+    }
+
+    unsigned long long dropped = logger.dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+        batch += "(log ring full: " + std::to_string(dropped) + " lines dropped)\n";
+    }
+    if (!batch.empty()) {
+        fwrite(batch.data(), 1, batch.size(), stdout);
+        fflush(stdout);
+        batch.clear();
+    }
+    return count;
+}
+
+void run_logger(AsyncLogger& logger) {
+    std::string batch;
+    while (logger.running.load(std::memory_order_relaxed)) {
+        if (drain_log(logger, batch) == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        }
+    }
+    drain_log(logger, batch);
+}
+
+void start_logger(unsigned sample) {
+    AsyncLogger& logger = access_log;
+    logger.slots.reset(new LogSlot[LOG_RING_CAPACITY]);
+    for (size_t i = 0; i < LOG_RING_CAPACITY; ++i) {
+        logger.slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    logger.sample = std::max(1u, sample);
+    logger.running = true;
+    logger.thread = std::thread(run_logger, std::ref(logger));
+}
+
+void stop_logger() {
+    if (!access_log.running) return;
+    access_log.running = false;
+    access_log.thread.join();
+}
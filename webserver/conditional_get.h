@@ -0,0 +1,129 @@
+#pragma once
+
+#include "http_parser.h"
+#include <string>
+#include <string_view>
+#include <ctime>
+#include <cstdio>
+#include <sys/stat.h>
+
+// Строгий ETag из метаданных файла: время изменения с наносекундами и размер. Разные кодирования
+// одного файла — разные представления, поэтому к тегу добавляется суффикс кодирования.
+std::string make_etag(const struct stat& st, std::string_view suffix) {
+    char buffer[64];
+    unsigned long long mtime_ns = (unsigned long long)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+    int n = snprintf(buffer, sizeof(buffer), "\"%llx-%llx", mtime_ns, (unsigned long long)st.st_size);
+    std::string etag(buffer, n);
+    if (!suffix.empty()) {
+        etag += '-';
+        etag += suffix;
+    }
+    etag += '"';
+    return etag;
+}
+
+// Дата в формате IMF-fixdate: "Sun, 06 Nov 1994 08:49:37 GMT".
+std::string format_http_date(time_t time) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+    char buffer[64];
+    size_t n = strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buffer, n);
+}
+
+// Разбирает дату IMF-fixdate. Устаревшие форматы RFC 850 и asctime не поддерживаются:
+// заголовок с такой датой игнорируется, как с некорректной.
+bool parse_http_date(std::string_view value, time_t& result) {
+    if (value.size() >= 64) return false;
+    char buffer[64];
+    memcpy(buffer, value.data(), value.size());
+    buffer[value.size()] = '\0';
+
+    struct tm tm{};
+    const char* end = strptime(buffer, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != '\0') return false;
+    result = timegm(&tm);
+    return true;
+}
+
+// Слабое сравнение для If-None-Match: префикс W/ не учитывается, "*" совпадает с любым тегом.
+bool etag_list_matches(std::string_view list, std::string_view etag) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view item = trim_whitespace(list.data(), list.data() + std::min(comma, list.size()));
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+
+        if (item == "*") return true;
+        if (item.substr(0, 2) == "W/") item.remove_prefix(2);
+        if (item == etag) return true;
+    }
+    return false;
+}
+
+// Ответ 304 уместен, если клиент уже имеет это представление. If-None-Match, если он есть,
+// имеет приоритет над If-Modified-Since.
+bool is_not_modified(const HttpRequest& request, std::string_view etag, time_t last_modified) {
+    std::string_view if_none_match = request.known[HEADER_IF_NONE_MATCH];
+    if (!if_none_match.empty()) {
+        return etag_list_matches(if_none_match, etag);
+    }
+    time_t since;
+    if (!request.known[HEADER_IF_MODIFIED_SINCE].empty() &&
+        parse_http_date(request.known[HEADER_IF_MODIFIED_SINCE], since)) {
+        return last_modified <= since;
+    }
+    return false;
+}
+
+// If-Range: диапазон отдается, только если у клиента та же версия файла. ETag сравнивается строго,
+// дата должна совпадать с Last-Modified точно.
+bool if_range_matches(std::string_view if_range, std::string_view etag, time_t last_modified) {
+    if (if_range.empty()) return true;
+    if (if_range.front() == '"') return if_range == etag;
+    if (if_range.substr(0, 2) == "W/") return false;
+    time_t date;
+    return parse_http_date(if_range, date) && date == last_modified;
+}
+
+enum class RangeResult {
+    IGNORE,
+    SATISFIABLE,
+    UNSATISFIABLE
+};
+
+bool parse_offset(std::string_view value, off_t& result) {
+    size_t number;
+    if (!parse_content_length(value, number)) return false;
+    result = number;
+    return true;
+}
+
+// Разбирает заголовок Range для файла размера size. Поддерживается один диапазон байт
+// ("a-b", "a-", "-n"); несколько диапазонов и некорректный заголовок игнорируются, и клиент получает
+// файл целиком, что допускает RFC 9110. При успехе [begin, end) — отправляемая часть файла.
+RangeResult parse_range(std::string_view value, off_t size, off_t& begin, off_t& end) {
+    if (value.size() < 6 || !equals_ignore_case(value.substr(0, 6), "bytes=")) return RangeResult::IGNORE;
+    std::string_view spec = trim_whitespace(value.data() + 6, value.data() + value.size());
+    size_t dash = spec.find('-');
+    if (dash == std::string_view::npos || spec.find(',') != std::string_view::npos) return RangeResult::IGNORE;
+
+    std::string_view first = spec.substr(0, dash);
+    std::string_view last = spec.substr(dash + 1);
+    if (first.empty()) {
+        off_t suffix;
+        if (!parse_offset(last, suffix)) return RangeResult::IGNORE;
+        if (suffix == 0 || size == 0) return RangeResult::UNSATISFIABLE;
+        begin = size - std::min(suffix, size);
+        end = size;
+        return RangeResult::SATISFIABLE;
+    }
+
+    if (!parse_offset(first, begin)) return RangeResult::IGNORE;
+    end = size;
+    if (!last.empty()) {
+        off_t last_byte;
+        if (!parse_offset(last, last_byte) || last_byte < begin) return RangeResult::IGNORE;
+        end = std::min(last_byte + 1, size);
+    }
+    return begin < size ? RangeResult::SATISFIABLE : RangeResult::UNSATISFIABLE;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <zlib.h>
+
+const size_t MAX_COMPRESS_SIZE = 4 * 1024 * 1024;
+const int COMPRESSION_LEVEL = 6;
+
+enum Encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+    ENCODING_COUNT
+};
+
+const char* const ENCODING_NAMES[ENCODING_COUNT] = {"identity", "gzip", "deflate"};
+
+struct MimeType {
+    const char* extension;
+    const char* type;
+    bool compressible;
+};
+
+const MimeType MIME_TYPES[] = {
+    {"html", "text/html; charset=utf-8", true},
+    {"htm", "text/html; charset=utf-8", true},
+    {"css", "text/css; charset=utf-8", true},
+    {"js", "text/javascript; charset=utf-8", true},
+    {"mjs", "text/javascript; charset=utf-8", true},
+    {"json", "application/json", true},
+    {"xml", "application/xml", true},
+    {"txt", "text/plain; charset=utf-8", true},
+    {"csv", "text/csv; charset=utf-8", true},
+    {"md", "text/markdown; charset=utf-8", true},
+    {"svg", "image/svg+xml", true},
+    {"wasm", "application/wasm", true},
+    {"ico", "image/x-icon", true},
+    {"png", "image/png", false},
+    {"jpg", "image/jpeg", false},
+    {"jpeg", "image/jpeg", false},
+    {"gif", "image/gif", false},
+    {"webp", "image/webp", false},
+    {"avif", "image/avif", false},
+    {"woff", "font/woff", false},
+    {"woff2", "font/woff2", false},
+    {"pdf", "application/pdf", false},
+    {"zip", "application/zip", false},
+    {"gz", "application/gzip", false},
+    {"mp3", "audio/mpeg", false},
+    {"mp4", "video/mp4", false},
+    {"webm", "video/webm", false},
+};
+
+const MimeType DEFAULT_MIME_TYPE = {"", "application/octet-stream", false};
+
+// Определяет MIME-тип по расширению файла (без учета регистра).
+const MimeType& mime_type(std::string_view path) {
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash)) {
+        return DEFAULT_MIME_TYPE;
+    }
+    std::string_view extension = path.substr(dot + 1);
+    for (const MimeType& mime : MIME_TYPES) {
+        if (extension.size() == strlen(mime.extension) &&
+            strncasecmp(extension.data(), mime.extension, extension.size()) == 0) {
+            return mime;
+        }
+    }
+    return DEFAULT_MIME_TYPE;
+}
+
+// Выбирает кодирование по Accept-Encoding с учетом q-значений. При равных весах предпочитается gzip;
+// "*" относится ко всем кодированиям, не перечисленным явно.
+Encoding negotiate_encoding(std::string_view accept_encoding) {
+    double weights[ENCODING_COUNT] = {0, -1, -1};
+    double wildcard = -1;
+
+    while (!accept_encoding.empty()) {
+        size_t comma = accept_encoding.find(',');
+        std::string_view item = accept_encoding.substr(0, comma);
+        accept_encoding = comma == std::string_view::npos ? std::string_view() : accept_encoding.substr(comma + 1);
+
+        double q = 1.0;
+        size_t semicolon = item.find(';');
+        if (semicolon != std::string_view::npos) {
+            std::string_view params = item.substr(semicolon + 1);
+            size_t q_pos = params.find("q=");
+            if (q_pos != std::string_view::npos) {
+                q = strtod(std::string(params.substr(q_pos + 2)).c_str(), nullptr);
+            }
+            item = item.substr(0, semicolon);
+        }
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+
+        if (item == "*") {
+            wildcard = q;
+            continue;
+        }
+        for (int e = ENCODING_GZIP; e < ENCODING_COUNT; ++e) {
+            if (item.size() == strlen(ENCODING_NAMES[e]) && strncasecmp(item.data(), ENCODING_NAMES[e], item.size()) == 0) {
+                weights[e] = q;
+            }
+        }
+    }
+
+    Encoding best = ENCODING_IDENTITY;
+    double best_weight = 0;
+    for (int e = ENCODING_GZIP; e < ENCODING_COUNT; ++e) {
+        double weight = weights[e] >= 0 ? weights[e] : wildcard;
+        if (weight > best_weight) {
+            best = (Encoding)e;
+            best_weight = weight;
+        }
+    }
+    return best;
+}
+
+// Сжимает data в формате gzip или zlib ("deflate" в HTTP). Возвращает false при ошибке zlib.
+bool compress_data(std::string_view data, Encoding encoding, std::string& output) {
+    z_stream stream{};
+    int window_bits = encoding == ENCODING_GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&stream, COMPRESSION_LEVEL, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    output.resize(deflateBound(&stream, data.size()));
+    stream.next_in = (Bytef*)data.data();
+    stream.avail_in = data.size();
+    stream.next_out = (Bytef*)output.data();
+    stream.avail_out = output.size();
+
+    int result = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <memory>
+#include <chrono>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "metrics.h"
+
+const size_t FD_CACHE_CAPACITY = 256;
+const int FD_CACHE_REVALIDATE_MS = 1000;
+const size_t RESPONSE_CACHE_CAPACITY = 64 * 1024 * 1024;
+const size_t RESPONSE_CACHE_MAX_ENTRY = 256 * 1024;
+
+// Позволяет искать в unordered_map<std::string, ...> по string_view без создания строки.
+struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+};
+
+// Открытый файл с метаданными fstat. Дескриптор закрывается, когда файл
+// вытеснен из кэша и больше не отправляется ни одному клиенту.
+struct OpenFile {
+    int fd = -1;
+    struct stat st;
+
+    ~OpenFile() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+struct FdCacheEntry {
+    std::string path;
+    std::shared_ptr<OpenFile> file;
+    std::chrono::steady_clock::time_point checked_at;
+};
+
+// LRU открытых файловых дескрипторов: в начале списка — недавно использованные.
+struct FdCache {
+    size_t capacity = FD_CACHE_CAPACITY;
+    std::list<FdCacheEntry> lru;
+    std::unordered_map<std::string, std::list<FdCacheEntry>::iterator, StringHash, std::equal_to<>> index;
+    // Счетчики в WorkerMetrics воркера-владельца (задаются в init_loop), их отдает /metrics.
+    CacheCounters* counters = nullptr;
+};
+
+bool same_file(const struct stat& a, const struct stat& b) {
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size &&
+           a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+std::shared_ptr<OpenFile> open_regular_file(const std::string& path) {
+    auto file = std::make_shared<OpenFile>();
+    file->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0) return nullptr;
+    if (fstat(file->fd, &file->st) < 0 || !S_ISREG(file->st.st_mode)) return nullptr;
+    return file;
+}
+
+void fd_cache_erase(FdCache& cache, std::list<FdCacheEntry>::iterator it) {
+    cache.index.erase(it->path);
+    cache.lru.erase(it);
+}
+
+// Возвращает открытый файл из кэша или открывает его. Не чаще раза в
+// FD_CACHE_REVALIDATE_MS проверяет через stat, не был ли файл изменен или заменен.
+std::shared_ptr<OpenFile> fd_cache_open(FdCache& cache, std::string_view path) {
+    auto now = std::chrono::steady_clock::now();
+    auto found = cache.index.find(path);
+    if (found != cache.index.end()) {
+        auto it = found->second;
+        bool fresh = now - it->checked_at < std::chrono::milliseconds(FD_CACHE_REVALIDATE_MS);
+        if (!fresh) {
+            struct stat st;
+            fresh = stat(it->path.c_str(), &st) == 0 && same_file(st, it->file->st);
+            it->checked_at = now;
+        }
+        if (fresh) {
+            bump(cache.counters->hits);
+            cache.lru.splice(cache.lru.begin(), cache.lru, it);
+            return it->file;
+        }
+        fd_cache_erase(cache, it);
+    }
+
+    bump(cache.counters->misses);
+    std::string path_string(path);
+    std::shared_ptr<OpenFile> file = open_regular_file(path_string);
+    if (!file) return nullptr;
+
+    cache.lru.push_front({path_string, file, now});
+    cache.index[path_string] = cache.lru.begin();
+    while (cache.lru.size() > cache.capacity) {
+        fd_cache_erase(cache, std::prev(cache.lru.end()));
+    }
+    return file;
+}
+
+// Готовый к отправке ответ: строка статуса, заголовки и тело одним буфером.
+struct CachedResponse {
+    std::string bytes;
+    // Позиция пустой строки, завершающей заголовки: сюда вставляется "Connection: close".
+    size_t headers_size = 0;
+    // Файл, по которому проверяется актуальность ответа, если он отличается от ключа кэша
+    // (например, заранее сжатый index.html.gz для ключа index.html).
+    std::string source_path;
+    std::string etag;
+    struct stat st;
+};
+
+struct ResponseCacheEntry {
+    std::string path;
+    std::shared_ptr<const CachedResponse> response;
+    std::chrono::steady_clock::time_point checked_at;
+};
+
+// LRU готовых ответов для небольших часто запрашиваемых файлов, ограниченный по памяти.
+struct ResponseCache {
+    size_t capacity = RESPONSE_CACHE_CAPACITY;
+    size_t max_entry = RESPONSE_CACHE_MAX_ENTRY;
+    size_t size = 0;
+    std::list<ResponseCacheEntry> lru;
+    std::unordered_map<std::string, std::list<ResponseCacheEntry>::iterator, StringHash, std::equal_to<>> index;
+    CacheCounters* counters = nullptr;
+};
+
+void response_cache_erase(ResponseCache& cache, std::list<ResponseCacheEntry>::iterator it) {
+    cache.size -= it->response->bytes.size();
+    cache.index.erase(it->path);
+    cache.lru.erase(it);
+}
+
+// Возвращает готовый ответ или nullptr. Запись, файл которой изменился (по mtime,
+// размеру или inode), удаляется; проверка выполняется не чаще раза в FD_CACHE_REVALIDATE_MS.
+std::shared_ptr<const CachedResponse> response_cache_lookup(ResponseCache& cache, std::string_view path) {
+    auto found = cache.index.find(path);
+    if (found == cache.index.end()) {
+        bump(cache.counters->misses);
+        return nullptr;
+    }
+
+    auto it = found->second;
+    auto now = std::chrono::steady_clock::now();
+    if (now - it->checked_at >= std::chrono::milliseconds(FD_CACHE_REVALIDATE_MS)) {
+        const std::string& source = it->response->source_path.empty() ? it->path : it->response->source_path;
+        struct stat st;
+        if (stat(source.c_str(), &st) != 0 || !same_file(st, it->response->st)) {
+            response_cache_erase(cache, it);
+            bump(cache.counters->misses);
+            return nullptr;
+        }
+        it->checked_at = now;
+    }
+
+    bump(cache.counters->hits);
+    cache.lru.splice(cache.lru.begin(), cache.lru, it);
+    return it->response;
+}
+
+void response_cache_insert(ResponseCache& cache, std::string_view path, std::shared_ptr<const CachedResponse> response) {
+    size_t entry_size = response->bytes.size();
+    if (entry_size > cache.max_entry || entry_size > cache.capacity) return;
+
+    auto found = cache.index.find(path);
+    if (found != cache.index.end()) {
+        response_cache_erase(cache, found->second);
+    }
+    while (cache.size + entry_size > cache.capacity) {
+        response_cache_erase(cache, std::prev(cache.lru.end()));
+    }
+
+    cache.lru.push_front({std::string(path), std::move(response), std::chrono::steady_clock::now()});
+    cache.index[cache.lru.front().path] = cache.lru.begin();
+    cache.size += entry_size;
+}
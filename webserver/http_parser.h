@@ -0,0 +1,245 @@
+#pragma once
+
+#include <string_view>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const size_t MAX_REQUEST_SIZE = 8192;
+const size_t MAX_BODY_SIZE = 1024 * 1024;
+const int MAX_HEADERS = 64;
+
+// Заголовки, которые сервер использует сам: при разборе их значения сразу раскладываются по индексу.
+enum KnownHeader {
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    KNOWN_HEADER_COUNT
+};
+
+const std::string_view KNOWN_HEADER_NAMES[KNOWN_HEADER_COUNT] = {
+    "Host",
+    "Connection",
+    "Content-Length",
+    "Transfer-Encoding",
+    "Accept-Encoding",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Range",
+    "If-Range",
+};
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+// Разобранный запрос. Все поля — срезы приемного буфера и действительны, пока буфер не изменен.
+struct HttpRequest {
+    std::string_view method;
+    std::string_view path;
+    std::string_view http_version;
+    HttpHeader headers[MAX_HEADERS];
+    int header_count = 0;
+    std::string_view known[KNOWN_HEADER_COUNT];
+    bool keep_alive = false;
+    size_t content_length = 0;
+
+    std::string_view header(std::string_view name) const {
+        for (int i = 0; i < header_count; ++i) {
+            if (headers[i].name.size() == name.size() &&
+                strncasecmp(headers[i].name.data(), name.data(), name.size()) == 0) {
+                return headers[i].value;
+            }
+        }
+        return {};
+    }
+};
+
+bool equals_ignore_case(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+// Первая позиция байта a или b в [p, end), либо end. SSE2 проверяет по 16 байт за итерацию.
+const char* find_either(const char* p, const char* end, char a, char b) {
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != a && *p != b) p++;
+    return p;
+}
+
+const char* find_byte(const char* p, const char* end, char c) {
+    return find_either(p, end, c, c);
+}
+
+// Ищет конец блока заголовков "\r\n\r\n"; возвращает позицию первого '\r' или end.
+const char* find_headers_end(const char* p, const char* end) {
+    while ((p = find_byte(p, end, '\r')) + 3 < end) {
+        if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n') return p;
+        p++;
+    }
+    return end;
+}
+
+// Таблица символов, допустимых в методе и имени заголовка (token по RFC 9110).
+struct TokenTable {
+    bool allowed[256] = {};
+
+    constexpr TokenTable() {
+        const char* separators = "\"(),/:;<=>?@[\\]{}";
+        for (int c = '!'; c < 127; ++c) {
+            allowed[c] = true;
+        }
+        for (const char* p = separators; *p; ++p) {
+            allowed[(unsigned char)*p] = false;
+        }
+    }
+};
+
+constexpr TokenTable TOKEN_CHARS;
+
+bool is_token(std::string_view s) {
+    for (char c : s) {
+        if (!TOKEN_CHARS.allowed[(unsigned char)c]) return false;
+    }
+    return !s.empty();
+}
+
+// Путь не может содержать пробелы и управляющие символы.
+bool is_valid_target(std::string_view s) {
+    for (char c : s) {
+        if ((unsigned char)c <= ' ' || c == 127) return false;
+    }
+    return !s.empty();
+}
+
+// Значение заголовка не может содержать управляющие символы, кроме табуляции.
+bool is_valid_field_value(std::string_view s) {
+    for (char c : s) {
+        if (((unsigned char)c < ' ' && c != '\t') || c == 127) return false;
+    }
+    return true;
+}
+
+bool is_valid_version(std::string_view v) {
+    return v.size() == 8 && v.substr(0, 5) == "HTTP/" && v[5] >= '0' && v[5] <= '9' && v[6] == '.' && v[7] >= '0' && v[7] <= '9';
+}
+
+std::string_view trim_whitespace(const char* begin, const char* end) {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) begin++;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    return std::string_view(begin, end - begin);
+}
+
+bool parse_content_length(std::string_view value, size_t& result) {
+    if (value.empty() || value.size() > 18) return false;
+    result = 0;
+    for (char c : value) {
+        if (c < '0' || c > '9') return false;
+        result = result * 10 + (c - '0');
+    }
+    return true;
+}
+
+// Разбирает один запрос, начинающийся с позиции start буфера [buffer, buffer + size).
+// scan_from запоминает, докуда уже искался конец заголовков, чтобы не сканировать буфер заново
+// после каждого чтения. Возвращает длину запроса вместе с телом, 0 если запрос получен
+// не целиком, -1 если запрос некорректен.
+long parse_request(const char* buffer, size_t size, size_t start, size_t& scan_from, HttpRequest& request) {
+    const char* begin = buffer + start;
+    const char* end = buffer + size;
+    const char* headers_end = find_headers_end(buffer + std::max(start, scan_from), end);
+    if (headers_end == end) {
+        // Следующий поиск начнем с места, где могла оборваться последовательность \r\n\r\n.
+        scan_from = std::max(start, size >= 3 ? size - 3 : 0);
+        return size - start > MAX_REQUEST_SIZE ? -1 : 0;
+    }
+    if ((size_t)(headers_end - begin) > MAX_REQUEST_SIZE) return -1;
+
+    // Строка запроса: метод SP путь SP версия CRLF.
+    const char* line_end = find_byte(begin, headers_end + 2, '\r');
+    if (line_end[1] != '\n') return -1;
+    const char* space = find_byte(begin, line_end, ' ');
+    request.method = std::string_view(begin, space - begin);
+    if (!is_token(request.method) || space == line_end) return -1;
+    const char* path_begin = space + 1;
+    space = find_byte(path_begin, line_end, ' ');
+    request.path = std::string_view(path_begin, space - path_begin);
+    if (!is_valid_target(request.path) || space == line_end) return -1;
+    request.http_version = std::string_view(space + 1, line_end - space - 1);
+    if (!is_valid_version(request.http_version)) return -1;
+
+    request.header_count = 0;
+    for (auto& value : request.known) value = {};
+
+    const char* line = line_end + 2;
+    while (line < headers_end + 2) {
+        const char* colon = find_either(line, headers_end + 2, ':', '\r');
+        if (*colon != ':') return -1;
+        std::string_view name(line, colon - line);
+        if (!is_token(name)) return -1;
+        line_end = find_byte(colon, headers_end + 2, '\r');
+        if (line_end[1] != '\n') return -1;
+        if (request.header_count == MAX_HEADERS) return -1;
+
+        HttpHeader& header = request.headers[request.header_count++];
+        header.name = name;
+        header.value = trim_whitespace(colon + 1, line_end);
+        if (!is_valid_field_value(header.value)) return -1;
+        for (int k = 0; k < KNOWN_HEADER_COUNT; ++k) {
+            if (name.size() == KNOWN_HEADER_NAMES[k].size() && equals_ignore_case(name, KNOWN_HEADER_NAMES[k])) {
+                // Повторный Content-Length: прокси перед сервером может взять первое значение, а сервер —
+                // последнее, и границы запроса разойдутся (request smuggling, RFC 9112, раздел 6.3).
+                // Присутствующий заголовок отличается от отсутствующего непустым data() даже при пустом значении.
+                if (k == HEADER_CONTENT_LENGTH && request.known[k].data() != nullptr) return -1;
+                request.known[k] = header.value;
+                break;
+            }
+        }
+        line = line_end + 2;
+    }
+
+    std::string_view connection = request.known[HEADER_CONNECTION];
+    if (request.http_version == "HTTP/1.1") {
+        request.keep_alive = !equals_ignore_case(connection, "close");
+    } else {
+        request.keep_alive = equals_ignore_case(connection, "keep-alive");
+    }
+
+    // Тела с chunked-кодированием не поддерживаются: без Content-Length нельзя найти начало следующего запроса.
+    if (!request.known[HEADER_TRANSFER_ENCODING].empty()) return -1;
+    request.content_length = 0;
+    if (request.known[HEADER_CONTENT_LENGTH].data() != nullptr &&
+        !parse_content_length(request.known[HEADER_CONTENT_LENGTH], request.content_length)) {
+        return -1;
+    }
+    if (request.content_length > MAX_BODY_SIZE) return -1;
+
+    size_t total = headers_end + 4 - begin + request.content_length;
+    if (size - start < total) {
+        scan_from = start;
+        return 0;
+    }
+    scan_from = start + total;
+    return total;
+}
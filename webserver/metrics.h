@@ -0,0 +1,240 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
+#include <cstdarg>
+#include <algorithm>
+#include "content_encoding.h"
+
+// Гистограмма задержек в стиле HDR: значения в наносекундах раскладываются по логарифмическим
+// диапазонам (степеням двойки), каждый из которых делится на HISTOGRAM_SUB_BUCKETS равных частей.
+// Относительная погрешность — не больше 1/HISTOGRAM_SUB_BUCKETS (6,25%) на всем диапазоне.
+const int HISTOGRAM_SUB_BUCKET_BITS = 4;
+const int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+const int HISTOGRAM_MAX_EXPONENT = 36;  // 2^36 нс ≈ 68 с; большие значения попадают в последний бакет
+// Первые HISTOGRAM_SUB_BUCKETS бакетов — точные значения 0..15 нс, далее по HISTOGRAM_SUB_BUCKETS на степень двойки.
+const int HISTOGRAM_BUCKETS = (HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKETS;
+const int MAX_STATUS_CODE = 600;
+
+// Границы бакетов, которые отдаются в Prometheus (в секундах).
+const double PROMETHEUS_BUCKETS[] = {0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+                                     0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+using Counter = std::atomic<unsigned long long>;
+
+// Каждый счетчик изменяет только поток-владелец, поэтому вместо атомарного fetch_add достаточно
+// обычных load/store: они не блокируют шину, а поток /metrics все равно читает целые значения.
+void bump(Counter& counter, unsigned long long value = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+unsigned long long counter_value(const Counter& counter) {
+    return counter.load(std::memory_order_relaxed);
+}
+
+// Попадания и промахи одного кэша воркера.
+struct CacheCounters {
+    Counter hits{0};
+    Counter misses{0};
+};
+
+struct LatencyHistogram {
+    Counter buckets[HISTOGRAM_BUCKETS] = {};
+    Counter sum_ns{0};
+};
+
+int histogram_bucket(uint64_t value_ns) {
+    if (value_ns < (uint64_t)HISTOGRAM_SUB_BUCKETS) return value_ns;
+    int exponent = 63 - __builtin_clzll(value_ns);
+    if (exponent > HISTOGRAM_MAX_EXPONENT) return HISTOGRAM_BUCKETS - 1;
+    int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+    int sub_bucket = (value_ns >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+// Верхняя (исключающая) граница бакета в наносекундах.
+uint64_t histogram_bucket_limit(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket + 1;
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift;
+}
+
+void histogram_record(LatencyHistogram& histogram, uint64_t value_ns) {
+    bump(histogram.buckets[histogram_bucket(value_ns)]);
+    bump(histogram.sum_ns, value_ns);
+}
+
+// Счетчики одного воркера. Выравнивание по строке кэша исключает ложное разделение между воркерами.
+struct alignas(64) WorkerMetrics {
+    Counter connections_accepted{0};
+    Counter connections_closed{0};
+    Counter bytes_sent{0};
+    Counter responses[MAX_STATUS_CODE] = {};
+    CacheCounters fd_cache;
+    // Кэши готовых ответов по кодированию тела (ENCODING_IDENTITY — несжатые ответы).
+    CacheCounters response_cache[ENCODING_COUNT];
+    // От приема соединения (для первого запроса) или получения запроса до отправки первого байта ответа.
+    LatencyHistogram time_to_first_byte;
+    // От того же момента до отправки последнего байта ответа.
+    LatencyHistogram request_duration;
+};
+
+void count_response(WorkerMetrics& metrics, int status) {
+    bump(metrics.responses[status > 0 && status < MAX_STATUS_CODE ? status : 0]);
+}
+
+// Реестр счетчиков всех воркеров. Блокировка нужна только при регистрации и формировании /metrics.
+struct MetricsRegistry {
+    std::mutex mutex;
+    std::vector<WorkerMetrics*> workers;
+};
+
+MetricsRegistry metrics_registry;
+
+WorkerMetrics* register_worker_metrics() {
+    auto* metrics = new WorkerMetrics();
+    std::lock_guard<std::mutex> lock(metrics_registry.mutex);
+    metrics_registry.workers.push_back(metrics);
+    return metrics;
+}
+
+struct HistogramSnapshot {
+    std::vector<unsigned long long> buckets = std::vector<unsigned long long>(HISTOGRAM_BUCKETS);
+    unsigned long long sum_ns = 0;
+};
+
+void add_histogram(HistogramSnapshot& snapshot, const LatencyHistogram& histogram) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        snapshot.buckets[i] += counter_value(histogram.buckets[i]);
+    }
+    snapshot.sum_ns += counter_value(histogram.sum_ns);
+}
+
+// Значение квантиля — верхняя граница бакета, в который он попадает.
+double histogram_quantile(const HistogramSnapshot& snapshot, double quantile) {
+    unsigned long long total = 0;
+    for (auto count : snapshot.buckets) total += count;
+    if (total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(quantile * total);
+    unsigned long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += snapshot.buckets[i];
+        if (seen > rank) return histogram_bucket_limit(i) / 1e9;
+    }
+    return histogram_bucket_limit(HISTOGRAM_BUCKETS - 1) / 1e9;
+}
+
+void append_line(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void append_line(std::string& out, const char* format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    out.append(buffer, std::min<size_t>(std::max(n, 0), sizeof(buffer) - 1));
+}
+
+// Гистограмма Prometheus строится из HDR-бакетов: в бакет le попадают значения, верхняя граница
+// бакета которых не превышает le. Квантили отдаются отдельной метрикой-сводкой с полной точностью HDR.
+void render_histogram(std::string& out, const char* name, const char* help, const HistogramSnapshot& snapshot) {
+    append_line(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    int bucket = 0;
+    unsigned long long cumulative = 0;
+    for (double le : PROMETHEUS_BUCKETS) {
+        while (bucket < HISTOGRAM_BUCKETS && histogram_bucket_limit(bucket) <= le * 1e9) {
+            cumulative += snapshot.buckets[bucket++];
+        }
+        append_line(out, "%s_bucket{le=\"%g\"} %llu\n", name, le, cumulative);
+    }
+    // Счетчики читаются без остановки воркеров, поэтому общее число берется из тех же бакетов,
+    // чтобы +Inf не оказался меньше предыдущих.
+    while (bucket < HISTOGRAM_BUCKETS) {
+        cumulative += snapshot.buckets[bucket++];
+    }
+    append_line(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+    append_line(out, "%s_sum %.9f\n%s_count %llu\n", name, snapshot.sum_ns / 1e9, name, cumulative);
+
+    append_line(out, "# HELP %s_quantiles %s (quantiles)\n# TYPE %s_quantiles summary\n", name, help, name);
+    for (double quantile : QUANTILES) {
+        append_line(out, "%s_quantiles{quantile=\"%g\"} %.9f\n", name, quantile, histogram_quantile(snapshot, quantile));
+    }
+    append_line(out, "%s_quantiles_sum %.9f\n%s_quantiles_count %llu\n", name, snapshot.sum_ns / 1e9, name, cumulative);
+}
+
+// Суммирует счетчики всех воркеров и формирует ответ в текстовом формате Prometheus.
+std::string render_metrics() {
+    unsigned long long accepted = 0, closed = 0, bytes_sent = 0;
+    std::vector<unsigned long long> responses(MAX_STATUS_CODE);
+    unsigned long long fd_cache_hits = 0, fd_cache_misses = 0;
+    unsigned long long response_cache_hits[ENCODING_COUNT] = {}, response_cache_misses[ENCODING_COUNT] = {};
+    HistogramSnapshot ttfb, duration;
+    size_t worker_count;
+    {
+        std::lock_guard<std::mutex> lock(metrics_registry.mutex);
+        worker_count = metrics_registry.workers.size();
+        for (const WorkerMetrics* metrics : metrics_registry.workers) {
+            accepted += counter_value(metrics->connections_accepted);
+            closed += counter_value(metrics->connections_closed);
+            bytes_sent += counter_value(metrics->bytes_sent);
+            for (int status = 0; status < MAX_STATUS_CODE; ++status) {
+                responses[status] += counter_value(metrics->responses[status]);
+            }
+            fd_cache_hits += counter_value(metrics->fd_cache.hits);
+            fd_cache_misses += counter_value(metrics->fd_cache.misses);
+            for (int e = 0; e < ENCODING_COUNT; ++e) {
+                response_cache_hits[e] += counter_value(metrics->response_cache[e].hits);
+                response_cache_misses[e] += counter_value(metrics->response_cache[e].misses);
+            }
+            add_histogram(ttfb, metrics->time_to_first_byte);
+            add_histogram(duration, metrics->request_duration);
+        }
+    }
+
+    std::string out;
+    append_line(out, "# HELP webserver_workers Number of worker event loops.\n# TYPE webserver_workers gauge\n");
+    append_line(out, "webserver_workers %zu\n", worker_count);
+    append_line(out, "# HELP webserver_connections_accepted_total Accepted client connections.\n"
+                     "# TYPE webserver_connections_accepted_total counter\n");
+    append_line(out, "webserver_connections_accepted_total %llu\n", accepted);
+    append_line(out, "# HELP webserver_connections_open Currently open client connections.\n"
+                     "# TYPE webserver_connections_open gauge\n");
+    append_line(out, "webserver_connections_open %llu\n", accepted >= closed ? accepted - closed : 0);
+    append_line(out, "# HELP webserver_sent_bytes_total Bytes written to client sockets.\n"
+                     "# TYPE webserver_sent_bytes_total counter\n");
+    append_line(out, "webserver_sent_bytes_total %llu\n", bytes_sent);
+    append_line(out, "# HELP webserver_responses_total Fully sent responses by status code.\n"
+                     "# TYPE webserver_responses_total counter\n");
+    for (int status = 0; status < MAX_STATUS_CODE; ++status) {
+        if (responses[status] > 0) {
+            append_line(out, "webserver_responses_total{code=\"%d\"} %llu\n", status, responses[status]);
+        }
+    }
+    append_line(out, "# HELP webserver_fd_cache_hits_total Lookups served by an open descriptor from the file cache.\n"
+                     "# TYPE webserver_fd_cache_hits_total counter\n");
+    append_line(out, "webserver_fd_cache_hits_total %llu\n", fd_cache_hits);
+    append_line(out, "# HELP webserver_fd_cache_misses_total Lookups that had to open the file.\n"
+                     "# TYPE webserver_fd_cache_misses_total counter\n");
+    append_line(out, "webserver_fd_cache_misses_total %llu\n", fd_cache_misses);
+    append_line(out, "# HELP webserver_response_cache_hits_total Responses served from the ready response cache, by encoding.\n"
+                     "# TYPE webserver_response_cache_hits_total counter\n");
+    for (int e = 0; e < ENCODING_COUNT; ++e) {
+        append_line(out, "webserver_response_cache_hits_total{encoding=\"%s\"} %llu\n", ENCODING_NAMES[e], response_cache_hits[e]);
+    }
+    append_line(out, "# HELP webserver_response_cache_misses_total Response cache lookups that found no valid entry, by encoding.\n"
+                     "# TYPE webserver_response_cache_misses_total counter\n");
+    for (int e = 0; e < ENCODING_COUNT; ++e) {
+        append_line(out, "webserver_response_cache_misses_total{encoding=\"%s\"} %llu\n", ENCODING_NAMES[e], response_cache_misses[e]);
+    }
+    render_histogram(out, "webserver_time_to_first_byte_seconds",
+                     "Time from request arrival (connection accept for the first request) to the first response byte.", ttfb);
+    render_histogram(out, "webserver_request_duration_seconds",
+                     "Time from request arrival (connection accept for the first request) to the last response byte.", duration);
+    return out;
+}
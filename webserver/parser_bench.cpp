@@ -0,0 +1,201 @@
+#include "http_parser.h"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <random>
+
+using Clock = std::chrono::steady_clock;
+
+// Прежний разбор запроса (istringstream и копии строк) — эталон для сравнения.
+struct LegacyRequest {
+    std::string method;
+    std::string path;
+    std::string http_version;
+    bool keep_alive = false;
+    size_t content_length = 0;
+};
+
+std::string legacy_find_header(const std::string& buffer, size_t headers_begin, size_t headers_end, const char* name) {
+    size_t name_len = strlen(name);
+    size_t line = headers_begin;
+    while (line < headers_end) {
+        size_t line_end = buffer.find("\r\n", line);
+        if (line_end == std::string::npos || line_end > headers_end) line_end = headers_end;
+        if (line_end - line > name_len && buffer[line + name_len] == ':' &&
+            strncasecmp(buffer.data() + line, name, name_len) == 0) {
+            size_t value = line + name_len + 1;
+            while (value < line_end && (buffer[value] == ' ' || buffer[value] == '\t')) value++;
+            size_t value_end = line_end;
+            while (value_end > value && (buffer[value_end - 1] == ' ' || buffer[value_end - 1] == '\t')) value_end--;
+            return buffer.substr(value, value_end - value);
+        }
+        line = line_end + 2;
+    }
+    return "";
+}
+
+long legacy_parse_request(const std::string& buffer, LegacyRequest& request) {
+    size_t header_end = buffer.find("\r\n\r\n");
+    if (header_end == std::string::npos) return 0;
+
+    size_t line_end = buffer.find("\r\n");
+    std::istringstream request_line(buffer.substr(0, line_end));
+    request_line >> request.method >> request.path >> request.http_version;
+    if (request.method.empty() || request.path.empty()) return -1;
+
+    size_t headers_begin = line_end + 2;
+    std::string connection = legacy_find_header(buffer, headers_begin, header_end, "Connection");
+    if (request.http_version == "HTTP/1.1") {
+        request.keep_alive = strcasecmp(connection.c_str(), "close") != 0;
+    } else {
+        request.keep_alive = strcasecmp(connection.c_str(), "keep-alive") == 0;
+    }
+
+    std::string content_length = legacy_find_header(buffer, headers_begin, header_end, "Content-Length");
+    if (!content_length.empty()) {
+        char* end = nullptr;
+        request.content_length = strtoul(content_length.c_str(), &end, 10);
+        if (*end != '\0') return -1;
+    }
+
+    size_t total = header_end + 4 + request.content_length;
+    return buffer.size() < total ? 0 : total;
+}
+
+const std::vector<std::string> SEED_CORPUS = {
+    "GET / HTTP/1.1\r\nHost: localhost:8080\r\n\r\n",
+    "GET /index.html HTTP/1.0\r\nConnection: keep-alive\r\n\r\n",
+    "GET /images/logo.png?v=42 HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: ru-RU,ru;q=0.8,en-US;q=0.5,en;q=0.3\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=0123456789abcdef; theme=dark\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "If-Modified-Since: Sat, 18 Oct 2025 10:00:00 GMT\r\n"
+    "\r\n",
+    "POST /form HTTP/1.1\r\nHost: x\r\nContent-Length: 11\r\nConnection: close\r\n\r\nhello=world",
+    "GET /a HTTP/1.1\r\nHost:\tx \r\nX-Empty:\r\n\r\n",
+};
+
+// Случайная порча запроса: замена, вставка и удаление байт, в том числе разделителей.
+std::string mutate(const std::string& seed, std::mt19937& rng) {
+    static const char interesting[] = {'\r', '\n', ':', ' ', '\t', '\0', '/', '0', '9', '\x7f', '\xff'};
+    std::string data = seed;
+    int mutations = 1 + rng() % 4;
+    for (int m = 0; m < mutations && !data.empty(); ++m) {
+        size_t pos = rng() % data.size();
+        char byte = rng() % 2 ? interesting[rng() % sizeof(interesting)] : (char)(rng() % 256);
+        switch (rng() % 4) {
+            case 0: data[pos] = byte; break;
+            case 1: data.insert(data.begin() + pos, byte); break;
+            case 2: data.erase(pos, 1 + rng() % 8); break;
+            case 3: data.resize(pos); break;
+        }
+    }
+    return data;
+}
+
+bool inside(std::string_view slice, const std::string& buffer) {
+    return slice.empty() || (slice.data() >= buffer.data() && slice.data() + slice.size() <= buffer.data() + buffer.size());
+}
+
+// Проверяет новый разборщик на испорченных запросах: срезы не выходят за буфер, а если
+// запрос принят, метод, путь, версия и длина совпадают с прежним разбором.
+int run_fuzz(long iterations) {
+    std::mt19937 rng(12345);
+    long accepted = 0, rejected = 0, incomplete = 0, mismatches = 0, violations = 0;
+
+    for (long i = 0; i < iterations; ++i) {
+        std::string data = mutate(SEED_CORPUS[i % SEED_CORPUS.size()], rng);
+        HttpRequest request;
+        size_t scan_from = 0;
+        long length = parse_request(data.data(), data.size(), 0, scan_from, request);
+
+        if (length < 0) { rejected++; continue; }
+        if (length == 0) { incomplete++; continue; }
+        accepted++;
+
+        bool ok = (size_t)length <= data.size() && inside(request.method, data) &&
+                  inside(request.path, data) && inside(request.http_version, data);
+        for (int h = 0; h < request.header_count; ++h) {
+            ok = ok && inside(request.headers[h].name, data) && inside(request.headers[h].value, data);
+        }
+        if (!ok) {
+            violations++;
+            continue;
+        }
+
+        LegacyRequest legacy;
+        long legacy_length = legacy_parse_request(data, legacy);
+        if (legacy_length != length || legacy.method != request.method || legacy.path != request.path ||
+            legacy.http_version != request.http_version || legacy.keep_alive != request.keep_alive) {
+            mismatches++;
+            if (mismatches <= 5) {
+                std::cout << "Mismatch on input: " << std::quoted(data) << std::endl;
+            }
+        }
+    }
+
+    std::cout << "\n--- Parser Fuzz Results ---" << std::endl;
+    std::cout << "Inputs: " << iterations << " (accepted " << accepted << ", rejected " << rejected
+              << ", incomplete " << incomplete << ")" << std::endl;
+    std::cout << "Out-of-bounds slices: " << violations << std::endl;
+    std::cout << "Mismatches with legacy parser: " << mismatches << std::endl;
+    return violations == 0 ? 0 : 1;
+}
+
+template <typename ParseFn>
+double measure_ns(long iterations, ParseFn parse) {
+    auto start = Clock::now();
+    for (long i = 0; i < iterations; ++i) {
+        parse(SEED_CORPUS[i % SEED_CORPUS.size()]);
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = 2000000;
+    long fuzz_iterations = 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "-n") iterations = std::stol(argv[i + 1]);
+        else if (arg == "--fuzz") fuzz_iterations = std::stol(argv[i + 1]);
+    }
+
+    if (fuzz_iterations > 0) {
+        return run_fuzz(fuzz_iterations);
+    }
+
+    long checksum = 0;
+    double legacy_ns = measure_ns(iterations, [&](const std::string& data) {
+        LegacyRequest request;
+        checksum += legacy_parse_request(data, request) + request.path.size();
+    });
+    // Как и в сервере, структура запроса переиспользуется между вызовами.
+    HttpRequest request;
+    double new_ns = measure_ns(iterations, [&](const std::string& data) {
+        size_t scan_from = 0;
+        checksum += parse_request(data.data(), data.size(), 0, scan_from, request) + request.path.size();
+    });
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "\n--- Parser Benchmark (" << iterations << " requests, " << SEED_CORPUS.size() << " seed requests) ---" << std::endl;
+#ifdef __SSE2__
+    std::cout << "Scanning: SSE2" << std::endl;
+#else
+    std::cout << "Scanning: scalar" << std::endl;
+#endif
+    std::cout << "Legacy parser (istringstream): " << legacy_ns << " ns/request" << std::endl;
+    std::cout << "Zero-copy parser:              " << new_ns << " ns/request" << std::endl;
+    std::cout << "Speedup: " << legacy_ns / new_ns << "x" << std::endl;
+    std::cout << "(checksum " << checksum << ")" << std::endl;
+    return 0;
+}
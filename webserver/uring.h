@@ -0,0 +1,149 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+// Минимальная обертка над системными вызовами io_uring (без liburing): кольца отправки (SQ)
+// и завершения (CQ) отображаются в память процесса, заявки пишутся прямо в общий массив SQE.
+struct Uring {
+    int fd = -1;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    io_uring_sqe* sqes = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    // Заявки, записанные в SQ, но еще не переданные ядру через io_uring_enter.
+    unsigned pending = 0;
+
+    void* sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void* cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+};
+
+int uring_setup(unsigned entries, io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+void uring_close(Uring& ring) {
+    if (ring.sqes) munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring) munmap(ring.cq_ring, ring.cq_ring_size);
+    if (ring.sq_ring != MAP_FAILED) munmap(ring.sq_ring, ring.sq_ring_size);
+    if (ring.fd >= 0) close(ring.fd);
+    ring = Uring();
+}
+
+// Создает кольцо. Возвращает false (errno сохраняется), если ядро не поддерживает io_uring
+// или оно запрещено (kernel.io_uring_disabled, seccomp в контейнере).
+bool uring_init(Uring& ring, unsigned entries) {
+    io_uring_params params{};
+    // Кольцо используется одним потоком: ядро не синхронизирует подачу заявок и обрабатывает
+    // завершения только внутри io_uring_enter этого потока, а не прерывая его в произвольный момент.
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * 4;
+    ring.fd = uring_setup(entries, &params);
+    if (ring.fd < 0 && errno == EINVAL) {
+        params = io_uring_params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring.fd = uring_setup(entries, &params);
+    }
+    if (ring.fd < 0) return false;
+
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        ring.sq_ring_size = ring.cq_ring_size = std::max(ring.sq_ring_size, ring.cq_ring_size);
+    }
+
+    ring.sq_ring = mmap(nullptr, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) {
+        uring_close(ring);
+        return false;
+    }
+    ring.cq_ring = single_mmap ? ring.sq_ring
+                               : mmap(nullptr, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQES);
+    if (ring.cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        uring_close(ring);
+        return false;
+    }
+    ring.sqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)ring.sq_ring;
+    ring.sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring.sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring.sq_entries = params.sq_entries;
+    ring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    char* cq = (char*)ring.cq_ring;
+    ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring.cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring.cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Передает ядру накопленные заявки и ждет не меньше wait_nr завершений.
+int uring_submit(Uring& ring, unsigned wait_nr) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int submitted;
+    do {
+        submitted = uring_enter(ring.fd, ring.pending, wait_nr, flags);
+    } while (submitted < 0 && errno == EINTR);
+    if (submitted > 0) ring.pending -= std::min<unsigned>(submitted, ring.pending);
+    return submitted;
+}
+
+// Возвращает очищенную заявку в конце SQ. Если кольцо заполнено, накопленное сначала отправляется ядру;
+// если ядро не забрало ни одной заявки (EBUSY при переполненной CQ), возвращает nullptr.
+io_uring_sqe* uring_get_sqe(Uring& ring) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+        uring_submit(ring, 0);
+        if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) return nullptr;
+    }
+    unsigned index = tail & ring.sq_mask;
+    io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+    return sqe;
+}
+
+io_uring_cqe* uring_peek_cqe(Uring& ring) {
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) return nullptr;
+    return &ring.cqes[head & ring.cq_mask];
+}
+
+void uring_cqe_seen(Uring& ring) {
+    __atomic_store_n(ring.cq_head, *ring.cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Регистрирует буферы в ядре: операции *_FIXED с ними не закрепляют страницы при каждом вызове.
+bool uring_register_buffers(Uring& ring, const iovec* buffers, unsigned count) {
+    return syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+}
@@ -1,74 +1,1269 @@
+#include "file_cache.h"
+#include "http_parser.h"
+#include "content_encoding.h"
+#include "conditional_get.h"
+#include "metrics.h"
+#include "async_logger.h"
+#include "uring.h"
 #include <iostream>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
 #include <string>
-#include <fstream>
-#include <sstream>
 #include <vector>
+#include <list>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
 
-void handle_client(int client_socket) {
+const int MAX_EVENTS = 1024;
+const size_t READ_CHUNK_SIZE = 16384;
+const size_t MAX_PENDING_OUTPUT = 256 * 1024;
+const int MAX_IOV = 64;
+const int TIMER_RESOLUTION_MS = 1000;
+
+const std::string CLOSE_HEADER = "Connection: close\r\n";
+
+bool verbose = true;
+unsigned log_sample = 1;
+int idle_timeout_sec = 15;
+size_t response_cache_capacity = RESPONSE_CACHE_CAPACITY;
+int listen_backlog = SOMAXCONN;
+
+using Clock = std::chrono::steady_clock;
+
+enum class ConnState {
+    READING_REQUEST,
+    DRAINING,
+    CLOSED
+};
+
+// Ответ для отправки: готовый ответ из кэша либо заголовки (и короткое тело) из памяти,
+// за которыми, если есть, следует тело из файла.
+struct Response {
+    std::shared_ptr<const CachedResponse> cached;
+    bool keep_alive = true;
+    std::string head;
+    std::shared_ptr<OpenFile> file;
+    // Отправляемая часть файла [file_begin, file_end): весь файл или запрошенный диапазон.
+    off_t file_begin = 0;
+    off_t file_end = 0;
+    // Валидаторы отдаваемого представления для условных запросов. ETag готового ответа из кэша
+    // не копируется, а читается из cached (см. response_etag).
+    std::string etag;
+    time_t last_modified = 0;
+    int status = 0;
+};
+
+// Элемент очереди вывода: часть в памяти уходит через writev, файл — через sendfile.
+struct OutputChunk {
+    std::shared_ptr<const CachedResponse> cached;
+    bool add_close_header = false;
+    std::string head;
+    size_t head_offset = 0;
+    size_t head_size = 0;
+    std::shared_ptr<OpenFile> file;
+    off_t file_offset = 0;
+    off_t file_end = 0;
+    // Для метрик: код ответа и момент, с которого отсчитывается задержка запроса.
+    int status = 0;
+    Clock::time_point started;
+};
+
+struct Connection {
+    int fd;
+    ConnState state = ConnState::READING_REQUEST;
+    std::string in;
+    size_t in_scan = 0;
+    std::deque<OutputChunk> out;
+    size_t pending_output = 0;
+    bool read_paused = false;
+    size_t requests = 0;
+    // Момент приема соединения для первого запроса, затем — получения начала очередного запроса.
+    Clock::time_point request_start;
+    Clock::time_point last_active;
+    std::list<int>::iterator idle_pos;
+};
+
+struct EventLoop {
+    int epoll_fd = -1;
+    std::unordered_map<int, Connection> connections;
+    // Соединения в порядке последней активности: в начале списка — самые давние.
+    std::list<int> idle_list;
+    FdCache fd_cache;
+    ResponseCache response_cache;
+    // Сжатые ответы по кодированию; элемент ENCODING_IDENTITY не используется.
+    ResponseCache encoded_cache[ENCODING_COUNT];
+    WorkerMetrics* metrics = nullptr;
+};
+
+void init_loop(EventLoop& loop) {
+    loop.metrics = register_worker_metrics();
+    loop.fd_cache.counters = &loop.metrics->fd_cache;
+    loop.response_cache.capacity = response_cache_capacity;
+    loop.response_cache.counters = &loop.metrics->response_cache[ENCODING_IDENTITY];
+    for (int e = 0; e < ENCODING_COUNT; ++e) {
+        loop.encoded_cache[e].capacity = response_cache_capacity;
+        loop.encoded_cache[e].max_entry = MAX_COMPRESS_SIZE;
+        loop.encoded_cache[e].counters = &loop.metrics->response_cache[e];
+    }
+}
+
+std::string make_head(const std::string& status, const std::string& content_type, size_t content_length) {
+    std::string head = "HTTP/1.1 " + status + "\r\n";
+    head += "Content-Type: " + content_type + "\r\n";
+    head += "Content-Length: " + std::to_string(content_length) + "\r\n";
+    return head;
+}
+
+// Заголовки ответа с файлом. Для сжимаемых типов ответ зависит от Accept-Encoding,
+// поэтому всегда добавляется Vary, чтобы промежуточные кэши не отдали gzip клиенту без его поддержки.
+// Диапазоны поддерживаются только для несжатого представления, о чем сообщает Accept-Ranges.
+std::string make_file_head(const std::string& status, const MimeType& mime, Encoding encoding,
+                           const struct stat& st, size_t content_length) {
+    std::string head = make_head(status, mime.type, content_length);
+    head += "ETag: " + make_etag(st, encoding == ENCODING_IDENTITY ? "" : ENCODING_NAMES[encoding]) + "\r\n";
+    head += "Last-Modified: " + format_http_date(st.st_mtime) + "\r\n";
+    if (encoding == ENCODING_IDENTITY) {
+        head += "Accept-Ranges: bytes\r\n";
+    } else {
+        head += std::string("Content-Encoding: ") + ENCODING_NAMES[encoding] + "\r\n";
+    }
+    if (mime.compressible) {
+        head += "Vary: Accept-Encoding\r\n";
+    }
+    return head;
+}
+
+void end_head(Response& response) {
+    response.head += response.keep_alive ? "\r\n" : CLOSE_HEADER + "\r\n";
+}
+
+std::shared_ptr<CachedResponse> make_cached_response(const MimeType& mime, Encoding encoding,
+                                                     const struct stat& st, std::string_view body) {
+    auto cached = std::make_shared<CachedResponse>();
+    cached->st = st;
+    cached->etag = make_etag(st, encoding == ENCODING_IDENTITY ? "" : ENCODING_NAMES[encoding]);
+    cached->bytes = make_file_head("200 OK", mime, encoding, st, body.size());
+    cached->headers_size = cached->bytes.size();
+    cached->bytes += "\r\n";
+    cached->bytes += body;
+    return cached;
+}
+
+bool read_whole_file(const OpenFile& file, std::string& data) {
+    data.resize(file.st.st_size);
+    return pread(file.fd, data.data(), data.size(), 0) == file.st.st_size;
+}
+
+// Читает небольшой файл целиком и собирает для него готовый ответ 200 OK.
+// encoding — кодирование, в котором файл уже лежит на диске (для заранее сжатых .gz).
+std::shared_ptr<CachedResponse> load_cached_response(const OpenFile& file, const MimeType& mime, Encoding encoding) {
+    std::string body;
+    if (!read_whole_file(file, body)) return nullptr;
+    return make_cached_response(mime, encoding, file.st, body);
+}
+
+// Сжимает файл и собирает готовый ответ. Если сжатие не уменьшило размер, ответ остается несжатым.
+std::shared_ptr<CachedResponse> load_compressed_response(const OpenFile& file, const MimeType& mime, Encoding encoding) {
+    std::string body;
+    if (!read_whole_file(file, body)) return nullptr;
+
+    std::string compressed;
+    if (compress_data(body, encoding, compressed) && compressed.size() < body.size()) {
+        return make_cached_response(mime, encoding, file.st, compressed);
+    }
+    return make_cached_response(mime, ENCODING_IDENTITY, file.st, body);
+}
+
+std::string_view response_etag(const Response& response) {
+    return response.cached ? std::string_view(response.cached->etag) : std::string_view(response.etag);
+}
+
+void use_cached_response(Response& response, std::shared_ptr<const CachedResponse> cached) {
+    response.status = 200;
+    response.last_modified = cached->st.st_mtime;
+    response.cached = std::move(cached);
+}
+
+// Ответ 200 с телом из файла, которое отправляется через sendfile.
+void use_file_response(Response& response, const MimeType& mime, Encoding encoding, std::shared_ptr<OpenFile> file) {
+    response.head = make_file_head("200 OK", mime, encoding, file->st, file->st.st_size);
+    end_head(response);
+    response.status = 200;
+    response.etag = make_etag(file->st, encoding == ENCODING_IDENTITY ? "" : ENCODING_NAMES[encoding]);
+    response.last_modified = file->st.st_mtime;
+    response.file_begin = 0;
+    response.file_end = file->st.st_size;
+    response.file = std::move(file);
+}
+
+// Ищет сжатую версию ответа: готовый ответ в кэше, заранее сжатый файл рядом с исходным (path.gz)
+// или результат сжатия исходного файла, который сохраняется в кэше и больше не пересчитывается.
+bool build_encoded_response(EventLoop& loop, std::string_view path, const MimeType& mime, Encoding encoding, Response& response) {
+    ResponseCache& cache = loop.encoded_cache[encoding];
+    if (auto cached = response_cache_lookup(cache, path)) {
+        use_cached_response(response, std::move(cached));
+        return true;
+    }
+
+    if (encoding == ENCODING_GZIP) {
+        std::string gz_path = std::string(path) + ".gz";
+        std::shared_ptr<OpenFile> file = fd_cache_open(loop.fd_cache, gz_path);
+        if (file) {
+            if ((size_t)file->st.st_size <= cache.max_entry) {
+                auto cached = load_cached_response(*file, mime, ENCODING_GZIP);
+                if (cached) {
+                    cached->source_path = gz_path;
+                    response_cache_insert(cache, path, cached);
+                    use_cached_response(response, std::move(cached));
+                    return true;
+                }
+            }
+            use_file_response(response, mime, ENCODING_GZIP, std::move(file));
+            return true;
+        }
+    }
+
+    std::shared_ptr<OpenFile> file = fd_cache_open(loop.fd_cache, path);
+    if (!file || (size_t)file->st.st_size > MAX_COMPRESS_SIZE) return false;
+    auto cached = load_compressed_response(*file, mime, encoding);
+    if (!cached) return false;
+    response_cache_insert(cache, path, cached);
+    use_cached_response(response, std::move(cached));
+    return true;
+}
+
+bool build_identity_response(EventLoop& loop, std::string_view path, const MimeType& mime, Response& response) {
+    if (auto cached = response_cache_lookup(loop.response_cache, path)) {
+        use_cached_response(response, std::move(cached));
+        return true;
+    }
+
+    std::shared_ptr<OpenFile> file = fd_cache_open(loop.fd_cache, path);
+    if (!file) return false;
+    if ((size_t)file->st.st_size <= loop.response_cache.max_entry) {
+        auto cached = load_cached_response(*file, mime, ENCODING_IDENTITY);
+        if (cached) {
+            response_cache_insert(loop.response_cache, path, cached);
+            use_cached_response(response, std::move(cached));
+            return true;
+        }
+    }
+    use_file_response(response, mime, ENCODING_IDENTITY, std::move(file));
+    return true;
+}
+
+// 304: клиент уже имеет это представление, тело не отправляется.
+void make_not_modified(Response& response, const MimeType& mime) {
+    response.status = 304;
+    response.head = "HTTP/1.1 304 Not Modified\r\n";
+    response.head += "ETag: ";
+    response.head += response_etag(response);
+    response.head += "\r\n";
+    response.head += "Last-Modified: " + format_http_date(response.last_modified) + "\r\n";
+    if (mime.compressible) {
+        response.head += "Vary: Accept-Encoding\r\n";
+    }
+    end_head(response);
+    response.cached = nullptr;
+    response.file = nullptr;
+}
+
+// Заменяет полный ответ на 206 с одним диапазоном или 416. Даже если файл целиком лежит в кэше ответов,
+// диапазон отправляется через sendfile из дескриптора в FdCache, без копирования в память.
+// Возвращает false, если заголовок Range следует проигнорировать и отдать файл целиком.
+bool apply_range(EventLoop& loop, std::string_view path, const MimeType& mime, std::string_view range, Response& response) {
+    std::shared_ptr<OpenFile> file = response.file ? response.file : fd_cache_open(loop.fd_cache, path);
+    if (!file) return false;
+
+    off_t size = file->st.st_size;
+    off_t begin = 0, end = 0;
+    RangeResult result = parse_range(range, size, begin, end);
+    if (result == RangeResult::IGNORE) return false;
+
+    response.cached = nullptr;
+    response.file = nullptr;
+    if (result == RangeResult::UNSATISFIABLE) {
+        response.status = 416;
+        response.head = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+        response.head += "Content-Range: bytes */" + std::to_string(size) + "\r\n";
+        response.head += "Content-Length: 0\r\n";
+        end_head(response);
+        return true;
+    }
+
+    response.status = 206;
+    response.head = make_file_head("206 Partial Content", mime, ENCODING_IDENTITY, file->st, end - begin);
+    response.head += "Content-Range: bytes " + std::to_string(begin) + "-" + std::to_string(end - 1) + "/" +
+                     std::to_string(size) + "\r\n";
+    end_head(response);
+    response.file_begin = begin;
+    response.file_end = end;
+    response.file = std::move(file);
+    return true;
+}
+
+// Ответ об ошибке с текстом причины в теле и "Connection: close": после неразобранного запроса (400)
+// или запроса с неподдерживаемым методом (501, его тело не читается) граница следующего запроса неизвестна.
+Response make_error_response(int status, const std::string& reason) {
+    Response response;
+    response.status = status;
+    response.keep_alive = false;
+    response.head = make_head(std::to_string(status) + " " + reason, "text/plain", reason.size());
+    end_head(response);
+    response.head += reason;
+    return response;
+}
+
+Response build_response(EventLoop& loop, const HttpRequest& request) {
+    if (request.method != "GET") {
+        return make_error_response(501, "Not Implemented");
+    }
+    Response response;
+    response.keep_alive = request.keep_alive;
+
+    if (request.path == "/metrics") {
+        std::string content = render_metrics();
+        response.status = 200;
+        response.head = make_head("200 OK", "text/plain; version=0.0.4; charset=utf-8", content.size());
+        end_head(response);
+        response.head += content;
+        return response;
+    }
+
+    std::string_view path = request.path;
+    if (path.substr(0, 1) == "/") {
+        path.remove_prefix(1);
+    }
+    if (path.empty()) {
+        path = "index.html";
+    }
+
+    // Диапазоны отдаются только из несжатого файла, поэтому при Range сжатие не согласуется.
+    std::string_view range = request.known[HEADER_RANGE];
+    const MimeType& mime = mime_type(path);
+    Encoding encoding = ENCODING_IDENTITY;
+    if (mime.compressible && range.empty()) {
+        encoding = negotiate_encoding(request.known[HEADER_ACCEPT_ENCODING]);
+    }
+
+    bool found = (encoding != ENCODING_IDENTITY && build_encoded_response(loop, path, mime, encoding, response)) ||
+                 build_identity_response(loop, path, mime, response);
+    if (!found) {
+        std::string content = "File Not Found";
+        response.status = 404;
+        response.head = make_head("404 Not Found", "text/plain", content.length());
+        end_head(response);
+        response.head += content;
+        return response;
+    }
+
+    if (is_not_modified(request, response_etag(response), response.last_modified)) {
+        make_not_modified(response, mime);
+        return response;
+    }
+
+    if (!range.empty() && if_range_matches(request.known[HEADER_IF_RANGE], response_etag(response), response.last_modified)) {
+        apply_range(loop, path, mime, range, response);
+    }
+    return response;
+}
+
+size_t response_size(const Response& response) {
+    size_t size = response.head.size() + (response.file ? response.file_end - response.file_begin : 0);
+    if (response.cached) {
+        size += response.cached->bytes.size() + (response.keep_alive ? 0 : CLOSE_HEADER.size());
+    }
+    return size;
+}
+
+// Строка журнала доступа: запрос, код ответа и размер ответа в байтах.
+void log_request(const HttpRequest& request, const Response& response) {
+    if (!log_sampled()) return;
+    log_line("\"%.*s %.*s %.*s\" %d %zu", (int)request.method.size(), request.method.data(),
+             (int)std::min<size_t>(request.path.size(), 160), request.path.data(),
+             (int)request.http_version.size(), request.http_version.data(), response.status, response_size(response));
+}
+
+void handle_client(int client_socket, EventLoop& loop, Clock::time_point accepted_at) {
     char buffer[1024] = {0};
     read(client_socket, buffer, 1024);
 
-    std::cout << "--- Received Request ---" << std::endl;
-    std::cout << buffer << std::endl;
-    std::cout << "------------------------" << std::endl;
+    HttpRequest request;
+    size_t scan_from = 0;
+    long length = parse_request(buffer, strlen(buffer), 0, scan_from, request);
+    if (length == 0) {
+        close(client_socket);
+        bump(loop.metrics->connections_closed);
+        return;
+    }
+
+    Response response;
+    if (length < 0) {
+        response = make_error_response(400, "Bad Request");
+    } else {
+        request.keep_alive = false;
+        response = build_response(loop, request);
+        log_request(request, response);
+    }
+
+    size_t sent = 0;
+    ssize_t n = 0;
+    if (response.cached) {
+        const std::string& bytes = response.cached->bytes;
+        iovec iov[3] = {
+            {(void*)bytes.data(), response.cached->headers_size},
+            {(void*)CLOSE_HEADER.data(), CLOSE_HEADER.size()},
+            {(void*)(bytes.data() + response.cached->headers_size), bytes.size() - response.cached->headers_size},
+        };
+        n = writev(client_socket, iov, 3);
+    }
+    if (!response.head.empty()) {
+        n = write(client_socket, response.head.c_str(), response.head.length());
+    }
+    if (n > 0) {
+        sent += n;
+        histogram_record(loop.metrics->time_to_first_byte, (Clock::now() - accepted_at).count());
+    }
+    if (response.file) {
+        off_t offset = response.file_begin;
+        while (offset < response.file_end &&
+               (n = sendfile(client_socket, response.file->fd, &offset, response.file_end - offset)) > 0) {
+            sent += n;
+        }
+    }
+
+    close(client_socket);
+    bump(loop.metrics->bytes_sent, sent);
+    bump(loop.metrics->connections_closed);
+    if (response.status != 0) {
+        count_response(*loop.metrics, response.status);
+        histogram_record(loop.metrics->request_duration, (Clock::now() - accepted_at).count());
+    }
+}
+
+void run_blocking_loop(int server_socket) {
+    EventLoop loop;
+    init_loop(loop);
+    while (true) {
+        sockaddr_in client_address;
+        socklen_t client_address_len = sizeof(client_address);
+        int client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_len);
+
+        if (client_socket < 0) {
+            perror("Accept failed");
+            continue;
+        }
+
+        bump(loop.metrics->connections_accepted);
+        handle_client(client_socket, loop, Clock::now());
+    }
+}
+
+bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+void close_connection(EventLoop& loop, int fd) {
+    auto it = loop.connections.find(fd);
+    if (it == loop.connections.end()) return;
+    loop.idle_list.erase(it->second.idle_pos);
+    loop.connections.erase(it);
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    bump(loop.metrics->connections_closed);
+}
+
+void touch_connection(EventLoop& loop, Connection& conn) {
+    conn.last_active = Clock::now();
+    loop.idle_list.splice(loop.idle_list.end(), loop.idle_list, conn.idle_pos);
+}
+
+void queue_response(Connection& conn, Response&& response) {
+    OutputChunk chunk;
+    chunk.status = response.status;
+    chunk.started = conn.request_start;
+    if (response.cached) {
+        chunk.add_close_header = !response.keep_alive;
+        chunk.head_size = response.cached->bytes.size() + (chunk.add_close_header ? CLOSE_HEADER.size() : 0);
+        chunk.cached = std::move(response.cached);
+    } else {
+        chunk.head = std::move(response.head);
+        chunk.head_size = chunk.head.size();
+    }
+    conn.pending_output += chunk.head_size;
+    if (response.file && response.file_end > response.file_begin) {
+        chunk.file_offset = response.file_begin;
+        chunk.file_end = response.file_end;
+        chunk.file = std::move(response.file);
+        conn.pending_output += chunk.file_end - chunk.file_offset;
+    }
+    conn.out.push_back(std::move(chunk));
+}
+
+// Отвечает на все полностью полученные запросы по порядку (pipelining).
+void process_requests(EventLoop& loop, Connection& conn) {
+    size_t consumed = 0;
+    HttpRequest request;
+    while (conn.state == ConnState::READING_REQUEST && conn.pending_output < MAX_PENDING_OUTPUT) {
+        long length = parse_request(conn.in.data(), conn.in.size(), consumed, conn.in_scan, request);
+        if (length == 0) break;
+        if (length < 0) {
+            // Ответы на предыдущие запросы уже в очереди и уйдут первыми, затем 400 и закрытие.
+            queue_response(conn, make_error_response(400, "Bad Request"));
+            conn.state = ConnState::DRAINING;
+            break;
+        }
+
+        consumed += length;
 
+        Response response = build_response(loop, request);
+        log_request(request, response);
+        bool keep_alive = response.keep_alive;
+        queue_response(conn, std::move(response));
+        conn.requests++;
+        if (!keep_alive) {
+            conn.state = ConnState::DRAINING;
+        }
+    }
 
-    std::string request(buffer);
-    std::istringstream request_stream(request);
-    std::string method, path, http_version;
-    request_stream >> method >> path >> http_version;
+    if (consumed > 0) {
+        conn.in.erase(0, consumed);
+        conn.in_scan -= std::min(conn.in_scan, consumed);
+        // Остаток буфера — начало следующего запроса, полученное при последнем чтении.
+        if (!conn.in.empty()) conn.request_start = Clock::now();
+    }
+    // Запросы остались неразобранными из-за объема неотправленного вывода: их нужно разобрать,
+    // когда вывод уйдет, даже если новых данных от клиента не будет.
+    if (conn.state == ConnState::READING_REQUEST && conn.pending_output >= MAX_PENDING_OUTPUT && !conn.in.empty()) {
+        conn.read_paused = true;
+    }
+}
 
-    if (method == "GET") {
-        if (path.substr(0, 1) == "/") {
-            path = path.substr(1);
+// Edge-triggered: читаем, пока ядро не вернет EAGAIN, иначе событие больше не придет.
+void on_readable(EventLoop& loop, Connection& conn) {
+    char buffer[READ_CHUNK_SIZE];
+    while (conn.state == ConnState::READING_REQUEST) {
+        // Клиент шлет запросы быстрее, чем забирает ответы: не читаем, пока не уйдет накопленный вывод.
+        if (conn.in.size() > MAX_REQUEST_SIZE && conn.pending_output >= MAX_PENDING_OUTPUT) {
+            conn.read_paused = true;
+            return;
         }
-        if (path.empty()) {
-            path = "index.html";
+        ssize_t n = read(conn.fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            if (conn.in.empty() && conn.requests > 0) conn.request_start = Clock::now();
+            conn.in.append(buffer, n);
+            process_requests(loop, conn);
+        } else if (n == 0) {
+            conn.state = conn.out.empty() ? ConnState::CLOSED : ConnState::DRAINING;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            conn.state = ConnState::CLOSED;
         }
+    }
+}
 
-        std::ifstream file(path);
-        if (file.good()) {
-            std::stringstream file_buffer;
-            file_buffer << file.rdbuf();
-            std::string content = file_buffer.str();
-            file.close();
+// Добавляет в iov неотправленные части ответа из памяти. Для готового ответа из кэша
+// "Connection: close" вставляется отдельным сегментом перед пустой строкой, без копирования.
+int chunk_segments(const OutputChunk& chunk, iovec* iov) {
+    if (!chunk.cached) {
+        iov[0].iov_base = (void*)(chunk.head.data() + chunk.head_offset);
+        iov[0].iov_len = chunk.head.size() - chunk.head_offset;
+        return 1;
+    }
+
+    const std::string& bytes = chunk.cached->bytes;
+    size_t split = chunk.add_close_header ? chunk.cached->headers_size : bytes.size();
+    std::string_view parts[3] = {
+        std::string_view(bytes.data(), split),
+        chunk.add_close_header ? std::string_view(CLOSE_HEADER) : std::string_view(),
+        std::string_view(bytes.data() + split, bytes.size() - split),
+    };
+
+    int count = 0;
+    size_t skip = chunk.head_offset;
+    for (std::string_view part : parts) {
+        if (skip >= part.size()) {
+            skip -= part.size();
+            continue;
+        }
+        iov[count].iov_base = (void*)(part.data() + skip);
+        iov[count].iov_len = part.size() - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
 
-            std::string response = "HTTP/1.1 200 OK\r\n";
-            response += "Content-Type: text/html\r\n";
-            response += "Content-Length: " + std::to_string(content.length()) + "\r\n";
-            response += "\r\n";
-            response += content;
+void complete_chunk(EventLoop& loop, const OutputChunk& chunk, Clock::time_point now) {
+    count_response(*loop.metrics, chunk.status);
+    histogram_record(loop.metrics->request_duration, (now - chunk.started).count());
+}
 
-            write(client_socket, response.c_str(), response.length());
-            std::cout << "Responded with 200 OK for file: " << path << std::endl;
+// Учитывает n отправленных байт из частей ответов в памяти; полностью отправленные ответы без файла
+// удаляются из очереди.
+void consume_heads(EventLoop& loop, Connection& conn, size_t n) {
+    size_t left = n;
+    conn.pending_output -= n;
+    bump(loop.metrics->bytes_sent, n);
+    Clock::time_point now = Clock::now();
+    while (left > 0) {
+        OutputChunk& chunk = conn.out.front();
+        size_t part = std::min(left, chunk.head_size - chunk.head_offset);
+        if (chunk.head_offset == 0) {
+            histogram_record(loop.metrics->time_to_first_byte, (now - chunk.started).count());
+        }
+        chunk.head_offset += part;
+        left -= part;
+        if (chunk.head_offset == chunk.head_size && !chunk.file) {
+            complete_chunk(loop, chunk, now);
+            conn.out.pop_front();
+        }
+    }
+}
+
+// Отправляет части в памяти подряд идущих ответов одним sendmsg. Если за ними
+// следует тело из файла, MSG_MORE придерживает их до sendfile, чтобы не слать отдельный сегмент.
+ssize_t write_heads(EventLoop& loop, Connection& conn) {
+    iovec iov[MAX_IOV];
+    int count = 0;
+    bool more = false;
+    for (auto it = conn.out.begin(); it != conn.out.end() && count + 3 <= MAX_IOV; ++it) {
+        if (it->head_offset < it->head_size) {
+            count += chunk_segments(*it, iov + count);
+        }
+        if (it->file) {
+            more = true;
+            break;
+        }
+    }
+
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t n = sendmsg(conn.fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (n <= 0) return n;
+
+    consume_heads(loop, conn, n);
+    return n;
+}
+
+void on_writable(EventLoop& loop, Connection& conn) {
+    while (conn.state != ConnState::CLOSED && !conn.out.empty()) {
+        OutputChunk& chunk = conn.out.front();
+        ssize_t n;
+        if (chunk.head_offset < chunk.head_size) {
+            n = write_heads(loop, conn);
         } else {
-            std::string content = "File Not Found";
-            std::string response = "HTTP/1.1 404 Not Found\r\n";
-            response += "Content-Type: text/plain\r\n";
-            response += "Content-Length: " + std::to_string(content.length()) + "\r\n";
-            response += "\r\n";
-            response += content;
+            n = sendfile(conn.fd, chunk.file->fd, &chunk.file_offset, chunk.file_end - chunk.file_offset);
+            if (n > 0) {
+                conn.pending_output -= n;
+                bump(loop.metrics->bytes_sent, n);
+                if (chunk.file_offset == chunk.file_end) {
+                    complete_chunk(loop, chunk, Clock::now());
+                    conn.out.pop_front();
+                }
+            }
+        }
 
-            write(client_socket, response.c_str(), response.length());
-            std::cout << "Responded with 404 Not Found for file: " << path << std::endl;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            conn.state = ConnState::CLOSED;
+            return;
         }
     }
 
-    close(client_socket);
-    std::cout << "Client connection closed." << std::endl << std::endl;
+    if (conn.state == ConnState::DRAINING) {
+        conn.state = ConnState::CLOSED;
+    } else if (conn.read_paused) {
+        conn.read_paused = false;
+        process_requests(loop, conn);
+        on_readable(loop, conn);
+        on_writable(loop, conn);
+    }
 }
 
-int main() {
+void accept_connections(int server_socket, EventLoop& loop) {
+    while (true) {
+        int client_socket = accept4(server_socket, nullptr, nullptr, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Accept failed");
+            }
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        int one = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_socket;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close(client_socket);
+            continue;
+        }
+
+        Connection& conn = loop.connections[client_socket];
+        conn.fd = client_socket;
+        conn.last_active = Clock::now();
+        conn.request_start = conn.last_active;
+        conn.idle_pos = loop.idle_list.insert(loop.idle_list.end(), client_socket);
+        bump(loop.metrics->connections_accepted);
+    }
+}
+
+void close_idle_connections(EventLoop& loop) {
+    auto deadline = Clock::now() - std::chrono::seconds(idle_timeout_sec);
+    while (!loop.idle_list.empty()) {
+        int fd = loop.idle_list.front();
+        if (loop.connections.at(fd).last_active > deadline) break;
+        close_connection(loop, fd);
+    }
+}
+
+void run_epoll_loop(int server_socket) {
+    if (!set_nonblocking(server_socket)) {
+        perror("fcntl failed");
+        return;
+    }
+
+    EventLoop loop;
+    init_loop(loop);
+    loop.epoll_fd = epoll_create1(0);
+    if (loop.epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = server_socket;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+        perror("epoll_ctl failed");
+        close(loop.epoll_fd);
+        return;
+    }
+
+    std::vector<epoll_event> events(MAX_EVENTS);
+    auto next_timer = Clock::now() + std::chrono::milliseconds(TIMER_RESOLUTION_MS);
+
+    while (true) {
+        int n = epoll_wait(loop.epoll_fd, events.data(), MAX_EVENTS, TIMER_RESOLUTION_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == server_socket) {
+                accept_connections(server_socket, loop);
+                continue;
+            }
+
+            auto it = loop.connections.find(fd);
+            if (it == loop.connections.end()) continue;
+            Connection& conn = it->second;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn.state = ConnState::CLOSED;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                on_readable(loop, conn);
+            }
+            // Ответ пробуем отправить сразу: сокет обычно готов к записи, и EPOLLOUT уже мог прийти ранее.
+            on_writable(loop, conn);
+
+            if (conn.state == ConnState::CLOSED) {
+                close_connection(loop, fd);
+            } else {
+                touch_connection(loop, conn);
+            }
+        }
+
+        if (Clock::now() >= next_timer) {
+            close_idle_connections(loop);
+            next_timer = Clock::now() + std::chrono::milliseconds(TIMER_RESOLUTION_MS);
+        }
+    }
+
+    close(loop.epoll_fd);
+}
+
+const unsigned URING_ENTRIES = 4096;
+const int URING_READ_BUFFERS = 1024;
+const size_t URING_SPLICE_CHUNK = 64 * 1024;
+
+enum UringOp {
+    OP_ACCEPT,
+    OP_READ,
+    OP_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_TIMEOUT,
+    OP_CLOSE
+};
+
+uint64_t make_user_data(UringOp op, int fd) {
+    return (uint64_t)op << 32 | (uint32_t)fd;
+}
+
+// Соединение движка io_uring. На каждое соединение одновременно выполняется не больше одного
+// чтения и одной цепочки отправки; память, на которую ссылаются заявки (iov, msghdr, буферы),
+// живет в этой структуре до их завершения.
+struct UringConnection {
+    Connection conn;
+    bool reading = false;
+    // Индекс зарегистрированного буфера текущего чтения или -1, если читаем в fallback_buffer.
+    int read_buffer = -1;
+    std::string fallback_buffer;
+    int sends_inflight = 0;
+    // Канал для splice: тело файла идет файл -> канал -> сокет без копирования в память процесса.
+    int pipe_fds[2] = {-1, -1};
+    size_t pipe_bytes = 0;
+    msghdr msg{};
+    iovec iov[MAX_IOV];
+    bool shutdown_sent = false;
+    // Соединение ждет в UringLoop::deferred повторной подачи заявки, для которой не нашлось места в SQ.
+    bool deferred = false;
+};
+
+struct UringLoop {
+    EventLoop loop;
+    Uring ring;
+    int server_socket = -1;
+    std::unordered_map<int, UringConnection> connections;
+    char* buffers = nullptr;
+    std::vector<int> free_buffers;
+    bool multishot_accept = true;
+    __kernel_timespec timer{};
+    // Заявки, не поданные из-за заполненной SQ: подаются снова после разбора следующих завершений.
+    std::vector<int> deferred;
+    bool accept_deferred = false;
+    bool timer_deferred = false;
+};
+
+unsigned uring_sq_space(const Uring& ring) {
+    return ring.sq_entries - (*ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Гарантирует место под count заявок подряд, чтобы цепочка IOSQE_IO_LINK не разорвалась
+// на границе отправки. Возвращает false, если места нет и после передачи накопленного ядру.
+bool uring_reserve(Uring& ring, unsigned count) {
+    if (uring_sq_space(ring) < count) {
+        uring_submit(ring, 0);
+    }
+    return uring_sq_space(ring) >= count;
+}
+
+void uring_defer(UringLoop& ul, UringConnection& uc) {
+    if (uc.deferred) return;
+    uc.deferred = true;
+    ul.deferred.push_back(uc.conn.fd);
+}
+
+void uring_submit_accept(UringLoop& ul) {
+    io_uring_sqe* sqe = uring_get_sqe(ul.ring);
+    ul.accept_deferred = sqe == nullptr;
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ul.server_socket;
+    // Один multishot accept выдает по завершению на каждое новое соединение, без повторной подачи заявки.
+    sqe->ioprio = ul.multishot_accept ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = make_user_data(OP_ACCEPT, ul.server_socket);
+}
+
+void uring_submit_timer(UringLoop& ul) {
+    ul.timer.tv_sec = TIMER_RESOLUTION_MS / 1000;
+    ul.timer.tv_nsec = (TIMER_RESOLUTION_MS % 1000) * 1000000L;
+    io_uring_sqe* sqe = uring_get_sqe(ul.ring);
+    ul.timer_deferred = sqe == nullptr;
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)&ul.timer;
+    sqe->len = 1;
+    sqe->user_data = make_user_data(OP_TIMEOUT, 0);
+}
+
+// Чтение в зарегистрированный буфер (READ_FIXED). Если все буферы заняты, читаем обычным recv
+// в буфер соединения.
+void uring_submit_read(UringLoop& ul, UringConnection& uc) {
+    io_uring_sqe* sqe = uring_get_sqe(ul.ring);
+    if (!sqe) {
+        uring_defer(ul, uc);
+        return;
+    }
+    sqe->fd = uc.conn.fd;
+    sqe->user_data = make_user_data(OP_READ, uc.conn.fd);
+    if (!ul.free_buffers.empty()) {
+        uc.read_buffer = ul.free_buffers.back();
+        ul.free_buffers.pop_back();
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uint64_t)(ul.buffers + (size_t)uc.read_buffer * READ_CHUNK_SIZE);
+        sqe->buf_index = uc.read_buffer;
+    } else {
+        uc.read_buffer = -1;
+        uc.fallback_buffer.resize(READ_CHUNK_SIZE);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (uint64_t)uc.fallback_buffer.data();
+    }
+    sqe->len = READ_CHUNK_SIZE;
+    uc.reading = true;
+}
+
+// Подает цепочку отправки: sendmsg с частями ответов в памяти, связанный (IOSQE_IO_LINK) со splice
+// файла в канал и splice из канала в сокет. MSG_WAITALL делает короткую отправку ошибкой, которая
+// отменяет остаток цепочки, поэтому тело файла никогда не обгонит заголовки.
+void uring_submit_send(UringLoop& ul, UringConnection& uc) {
+    Connection& conn = uc.conn;
+    int count = 0;
+    OutputChunk* file_chunk = nullptr;
+    for (auto it = conn.out.begin(); it != conn.out.end() && count + 3 <= MAX_IOV; ++it) {
+        if (it->head_offset < it->head_size) {
+            count += chunk_segments(*it, uc.iov + count);
+        }
+        if (it->file) {
+            file_chunk = &*it;
+            break;
+        }
+    }
+    if (file_chunk && uc.pipe_fds[0] < 0 && pipe2(uc.pipe_fds, O_CLOEXEC) < 0) {
+        perror("pipe2 failed");
+        conn.state = ConnState::CLOSED;
+        return;
+    }
+
+    unsigned needed = (count > 0) + (file_chunk ? 1 + (uc.pipe_bytes == 0) : 0);
+    if (!uring_reserve(ul.ring, needed)) {
+        uring_defer(ul, uc);
+        return;
+    }
+    if (count > 0) {
+        uc.msg = msghdr{};
+        uc.msg.msg_iov = uc.iov;
+        uc.msg.msg_iovlen = count;
+        io_uring_sqe* sqe = uring_get_sqe(ul.ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn.fd;
+        sqe->addr = (uint64_t)&uc.msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (file_chunk ? MSG_MORE : 0);
+        sqe->flags = file_chunk ? IOSQE_IO_LINK : 0;
+        sqe->user_data = make_user_data(OP_SEND, conn.fd);
+        uc.sends_inflight++;
+    }
+    if (!file_chunk) return;
+
+    size_t length = uc.pipe_bytes;
+    if (length == 0) {
+        length = std::min<size_t>(URING_SPLICE_CHUNK, file_chunk->file_end - file_chunk->file_offset);
+        io_uring_sqe* sqe = uring_get_sqe(ul.ring);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = uc.pipe_fds[1];
+        sqe->off = (uint64_t)-1;
+        sqe->splice_fd_in = file_chunk->file->fd;
+        sqe->splice_off_in = file_chunk->file_offset;
+        sqe->len = length;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = make_user_data(OP_SPLICE_IN, conn.fd);
+        uc.sends_inflight++;
+    }
+    io_uring_sqe* sqe = uring_get_sqe(ul.ring);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = conn.fd;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = uc.pipe_fds[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = length;
+    sqe->user_data = make_user_data(OP_SPLICE_OUT, conn.fd);
+    uc.sends_inflight++;
+}
+
+void uring_finish_close(UringLoop& ul, int fd) {
+    auto it = ul.connections.find(fd);
+    UringConnection& uc = it->second;
+    ul.loop.idle_list.erase(uc.conn.idle_pos);
+    if (uc.pipe_fds[0] >= 0) {
+        close(uc.pipe_fds[0]);
+        close(uc.pipe_fds[1]);
+    }
+    ul.connections.erase(it);
+
+    // Без места в SQ сокет закрывается сразу: заявок соединения в полете уже нет.
+    io_uring_sqe* sqe = uring_get_sqe(ul.ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->user_data = make_user_data(OP_CLOSE, fd);
+    } else {
+        close(fd);
+    }
+    bump(ul.loop.metrics->connections_closed);
+}
+
+// Подает следующие операции соединения после завершения предыдущих. Закрываемое соединение
+// сначала дожидается завершения своих заявок (shutdown прерывает ожидающее чтение).
+void uring_advance(UringLoop& ul, UringConnection& uc) {
+    Connection& conn = uc.conn;
+    if (conn.state != ConnState::CLOSED) {
+        if (conn.read_paused && conn.pending_output < MAX_PENDING_OUTPUT) {
+            conn.read_paused = false;
+            process_requests(ul.loop, conn);
+        }
+        if (!conn.out.empty() && uc.sends_inflight == 0) {
+            uring_submit_send(ul, uc);
+        }
+        if (conn.state == ConnState::READING_REQUEST && !uc.reading) {
+            if (conn.pending_output < MAX_PENDING_OUTPUT) {
+                uring_submit_read(ul, uc);
+            } else {
+                conn.read_paused = true;
+            }
+        }
+        if (conn.state == ConnState::DRAINING && conn.out.empty() && uc.sends_inflight == 0) {
+            conn.state = ConnState::CLOSED;
+        }
+    }
+
+    if (conn.state == ConnState::CLOSED) {
+        if (!uc.reading && uc.sends_inflight == 0) {
+            uring_finish_close(ul, conn.fd);
+        } else if (!uc.shutdown_sent) {
+            uc.shutdown_sent = true;
+            shutdown(conn.fd, SHUT_RDWR);
+        }
+    }
+}
+
+void uring_on_read(UringLoop& ul, UringConnection& uc, int result) {
+    Connection& conn = uc.conn;
+    uc.reading = false;
+    const char* data = uc.fallback_buffer.data();
+    if (uc.read_buffer >= 0) {
+        data = ul.buffers + (size_t)uc.read_buffer * READ_CHUNK_SIZE;
+        ul.free_buffers.push_back(uc.read_buffer);
+        uc.read_buffer = -1;
+    }
+    if (conn.state != ConnState::READING_REQUEST) return;
+
+    if (result > 0) {
+        if (conn.in.empty() && conn.requests > 0) conn.request_start = Clock::now();
+        conn.in.append(data, result);
+        process_requests(ul.loop, conn);
+    } else if (result == 0) {
+        conn.state = conn.out.empty() ? ConnState::CLOSED : ConnState::DRAINING;
+    } else if (result != -EINTR && result != -EAGAIN) {
+        conn.state = ConnState::CLOSED;
+    }
+}
+
+void uring_on_send(UringLoop& ul, UringConnection& uc, UringOp op, int result) {
+    Connection& conn = uc.conn;
+    uc.sends_inflight--;
+    if (result == -ECANCELED) return;
+    if (result < 0 || (result == 0 && op != OP_SEND) || conn.out.empty()) {
+        conn.state = ConnState::CLOSED;
+        return;
+    }
+
+    if (op == OP_SEND) {
+        consume_heads(ul.loop, conn, result);
+        return;
+    }
+    OutputChunk& chunk = conn.out.front();
+    if (op == OP_SPLICE_IN) {
+        chunk.file_offset += result;
+        uc.pipe_bytes += result;
+        return;
+    }
+    uc.pipe_bytes -= result;
+    conn.pending_output -= result;
+    bump(ul.loop.metrics->bytes_sent, result);
+    if (chunk.file_offset == chunk.file_end && uc.pipe_bytes == 0) {
+        complete_chunk(ul.loop, chunk, Clock::now());
+        conn.out.pop_front();
+    }
+}
+
+void uring_on_accept(UringLoop& ul, const io_uring_cqe& cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        // Старые ядра не знают multishot accept: переходим на подачу заявки на каждое соединение.
+        if (cqe.res == -EINVAL && ul.multishot_accept) ul.multishot_accept = false;
+        uring_submit_accept(ul);
+    }
+    if (cqe.res < 0) {
+        if (cqe.res != -EINVAL) std::cerr << "Accept failed: " << strerror(-cqe.res) << std::endl;
+        return;
+    }
+
+    int client_socket = cqe.res;
+    int one = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    UringConnection& uc = ul.connections[client_socket];
+    uc.conn.fd = client_socket;
+    uc.conn.last_active = Clock::now();
+    uc.conn.request_start = uc.conn.last_active;
+    uc.conn.idle_pos = ul.loop.idle_list.insert(ul.loop.idle_list.end(), client_socket);
+    bump(ul.loop.metrics->connections_accepted);
+    uring_submit_read(ul, uc);
+}
+
+void uring_close_idle_connections(UringLoop& ul) {
+    auto deadline = Clock::now() - std::chrono::seconds(idle_timeout_sec);
+    std::vector<int> expired;
+    for (int fd : ul.loop.idle_list) {
+        UringConnection& uc = ul.connections.at(fd);
+        if (uc.conn.last_active > deadline) break;
+        if (!uc.shutdown_sent) expired.push_back(fd);
+    }
+    for (int fd : expired) {
+        UringConnection& uc = ul.connections.at(fd);
+        uc.conn.state = ConnState::CLOSED;
+        uring_advance(ul, uc);
+    }
+}
+
+// Повторно подает заявки, отложенные из-за заполненной SQ. Соединения, закрытые за это время
+// (или чей дескриптор уже занят новым соединением без флага deferred), пропускаются.
+void uring_retry_deferred(UringLoop& ul) {
+    if (ul.accept_deferred) uring_submit_accept(ul);
+    if (ul.timer_deferred) uring_submit_timer(ul);
+    std::vector<int> deferred;
+    deferred.swap(ul.deferred);
+    for (int fd : deferred) {
+        auto it = ul.connections.find(fd);
+        if (it == ul.connections.end() || !it->second.deferred) continue;
+        it->second.deferred = false;
+        uring_advance(ul, it->second);
+    }
+}
+
+bool uring_available() {
+    Uring ring;
+    if (!uring_init(ring, 8)) return false;
+    uring_close(ring);
+    return true;
+}
+
+// Движок io_uring: прием, чтение, отправка и закрытие идут заявками в кольцо, и один вызов
+// io_uring_enter на итерации цикла передает ядру все накопленные операции и забирает завершения.
+void run_uring_loop(int server_socket) {
+    UringLoop ul;
+    ul.server_socket = server_socket;
+    init_loop(ul.loop);
+    if (!uring_init(ul.ring, URING_ENTRIES)) {
+        perror("io_uring_setup failed, using epoll");
+        run_epoll_loop(server_socket);
+        return;
+    }
+
+    size_t buffers_size = (size_t)URING_READ_BUFFERS * READ_CHUNK_SIZE;
+    void* memory = mmap(nullptr, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        ul.buffers = (char*)memory;
+        std::vector<iovec> iovs(URING_READ_BUFFERS);
+        for (int i = 0; i < URING_READ_BUFFERS; ++i) {
+            iovs[i].iov_base = ul.buffers + (size_t)i * READ_CHUNK_SIZE;
+            iovs[i].iov_len = READ_CHUNK_SIZE;
+        }
+        if (uring_register_buffers(ul.ring, iovs.data(), URING_READ_BUFFERS)) {
+            for (int i = URING_READ_BUFFERS - 1; i >= 0; --i) ul.free_buffers.push_back(i);
+        } else {
+            perror("IORING_REGISTER_BUFFERS failed, reading with recv");
+        }
+    }
+
+    uring_submit_accept(ul);
+    uring_submit_timer(ul);
+
+    while (true) {
+        // С отложенными заявками не ждем завершений: их может не оказаться, если отложено все.
+        bool deferred = !ul.deferred.empty() || ul.accept_deferred || ul.timer_deferred;
+        if (uring_submit(ul.ring, deferred ? 0 : 1) < 0 && errno != EBUSY && errno != EAGAIN) {
+            perror("io_uring_enter failed");
+            break;
+        }
+
+        io_uring_cqe* cqe;
+        while ((cqe = uring_peek_cqe(ul.ring)) != nullptr) {
+            io_uring_cqe event = *cqe;
+            uring_cqe_seen(ul.ring);
+
+            UringOp op = (UringOp)(event.user_data >> 32);
+            int fd = (int)(uint32_t)event.user_data;
+            if (op == OP_ACCEPT) {
+                uring_on_accept(ul, event);
+                continue;
+            }
+            if (op == OP_TIMEOUT) {
+                uring_close_idle_connections(ul);
+                uring_submit_timer(ul);
+                continue;
+            }
+
+            auto it = ul.connections.find(fd);
+            if (op == OP_CLOSE || it == ul.connections.end()) continue;
+            UringConnection& uc = it->second;
+            if (op == OP_READ) {
+                uring_on_read(ul, uc, event.res);
+            } else {
+                uring_on_send(ul, uc, op, event.res);
+            }
+            if (uc.conn.state != ConnState::CLOSED) {
+                touch_connection(ul.loop, uc.conn);
+            }
+            uring_advance(ul, uc);
+        }
+        uring_retry_deferred(ul);
+    }
+
+    if (ul.buffers) munmap(ul.buffers, buffers_size);
+    uring_close(ul.ring);
+}
+
+// Создает слушающий сокет. С SO_REUSEPORT каждый воркер получает собственный сокет на том же порту,
+// и ядро само распределяет входящие соединения между ними.
+int create_listener(int port, bool reuse_port) {
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket == -1) {
         perror("Socket creation failed");
-        return 1;
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        perror("SO_REUSEPORT failed");
+        close(server_socket);
+        return -1;
     }
 
-    int port = 8080;
     sockaddr_in server_address;
     server_address.sin_family = AF_INET;
     server_address.sin_addr.s_addr = INADDR_ANY;
@@ -77,32 +1272,110 @@ int main() {
     if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
         perror("Bind failed");
         close(server_socket);
-        return 1;
+        return -1;
     }
 
-    if (listen(server_socket, 10) < 0) {
+    if (listen(server_socket, listen_backlog) < 0) {
         perror("Listen failed");
         close(server_socket);
+        return -1;
+    }
+    return server_socket;
+}
+
+void run_worker(int worker_id, int server_socket, bool use_uring) {
+    int cpu_count = std::thread::hardware_concurrency();
+    if (cpu_count > 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker_id % cpu_count, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0) {
+            std::cerr << "Worker " << worker_id << ": failed to pin to CPU: " << strerror(err) << std::endl;
+        }
+    }
+    if (use_uring) {
+        run_uring_loop(server_socket);
+    } else {
+        run_epoll_loop(server_socket);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int port = 8080;
+    int workers = 1;
+    std::string engine = "epoll";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--engine" && i + 1 < argc) {
+            engine = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workers = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--backlog" && i + 1 < argc) {
+            listen_backlog = std::stoi(argv[++i]);
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            idle_timeout_sec = std::stoi(argv[++i]);
+        } else if (arg == "--cache-size" && i + 1 < argc) {
+            response_cache_capacity = std::stoul(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--log-sample" && i + 1 < argc) {
+            log_sample = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-q") {
+            verbose = false;
+        } else if (arg[0] != '-') {
+            port = std::stoi(arg);
+        } else {
+            std::cerr << "Usage: ./webserver [port] [--engine epoll|uring|blocking] [--workers N] [--backlog N] "
+                         "[--idle-timeout sec] [--cache-size MB] [--log-sample N] [-q]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (engine != "epoll" && engine != "uring" && engine != "blocking") {
+        std::cerr << "Unknown engine: " << engine << ". Use epoll, uring or blocking." << std::endl;
         return 1;
     }
+    if (engine == "uring" && !uring_available()) {
+        perror("io_uring is not available, falling back to epoll");
+        engine = "epoll";
+    }
 
-    std::cout << "Server is listening on port " << port << "..." << std::endl;
+    signal(SIGPIPE, SIG_IGN);
 
-    while (true) {
-        sockaddr_in client_address;
-        socklen_t client_address_len = sizeof(client_address);
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_len);
+    if (engine == "blocking") {
+        int server_socket = create_listener(port, false);
+        if (server_socket < 0) return 1;
+        std::cout << "Server is listening on port " << port << " (engine: blocking)..." << std::endl;
+        if (verbose) start_logger(log_sample);
+        run_blocking_loop(server_socket);
+        stop_logger();
+        close(server_socket);
+        return 0;
+    }
 
-        if (client_socket < 0) {
-            perror("Accept failed");
-            continue;
+    // Все сокеты создаются до запуска потоков, чтобы ошибка bind была видна сразу.
+    std::vector<int> listeners;
+    for (int i = 0; i < workers; ++i) {
+        int server_socket = create_listener(port, true);
+        if (server_socket < 0) {
+            for (int fd : listeners) close(fd);
+            return 1;
         }
+        listeners.push_back(server_socket);
+    }
 
-        std::cout << "New connection accepted." << std::endl;
+    std::cout << "Server is listening on port " << port << " (engine: " << engine << ", workers: " << workers << ")..." << std::endl;
 
-        handle_client(client_socket);
+    if (verbose) start_logger(log_sample);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; ++i) {
+        threads.emplace_back(run_worker, i, listeners[i], engine == "uring");
     }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    stop_logger();
 
-    close(server_socket);
+    for (int fd : listeners) close(fd);
     return 0;
-}
\ No newline at end of file
+}
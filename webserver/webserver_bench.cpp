@@ -0,0 +1,357 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <thread>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+const int MAX_EVENTS = 1024;
+const double REQUEST_TIMEOUT_SEC = 5.0;
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchClient {
+    int fd = -1;
+    std::string request;
+    size_t sent = 0;
+    std::string response;
+    int pending = 0;
+    Clock::time_point started;
+};
+
+struct BenchStats {
+    long long completed = 0;
+    long long errors = 0;
+    long long timeouts = 0;
+    std::vector<double> latencies_ms;
+};
+
+sockaddr_in server_addr;
+bool keep_alive = false;
+int pipeline_depth = 1;
+int connections = 64;
+int load_threads = 1;
+int duration_sec = 10;
+
+// Длина первого полностью полученного ответа (заголовки + Content-Length байт тела) или 0.
+size_t complete_response_length(const std::string& response) {
+    size_t header_end = response.find("\r\n\r\n");
+    if (header_end == std::string::npos) return 0;
+    size_t pos = response.find("Content-Length:");
+    if (pos == std::string::npos || pos > header_end) return 0;
+    size_t total = header_end + 4 + strtoul(response.c_str() + pos + 15, nullptr, 10);
+    return response.size() >= total ? total : 0;
+}
+
+void start_batch(BenchClient& client) {
+    client.sent = 0;
+    client.pending = pipeline_depth;
+    client.started = Clock::now();
+}
+
+bool open_connection(int epoll_fd, BenchClient& client, int index) {
+    client.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (client.fd < 0) {
+        perror("socket creation failed");
+        return false;
+    }
+    int one = 1;
+    setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(client.fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        close(client.fd);
+        client.fd = -1;
+        return false;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u32 = index;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client.fd, &ev);
+    client.response.clear();
+    start_batch(client);
+    return true;
+}
+
+void close_client(int epoll_fd, BenchClient& client) {
+    if (client.fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client.fd, nullptr);
+        close(client.fd);
+        client.fd = -1;
+    }
+}
+
+void restart_client(int epoll_fd, BenchClient& client, int index, BenchStats& stats) {
+    close_client(epoll_fd, client);
+    if (!open_connection(epoll_fd, client, index)) {
+        stats.errors++;
+    }
+}
+
+// Отправляет пачку запросов и читает ответы. Следующая пачка keep-alive начинается в том же цикле,
+// а не рекурсивным вызовом: с быстрым сервером и большими ответами рекурсия переполняла стек.
+void drive_client(int epoll_fd, BenchClient& client, int index, BenchStats& stats) {
+    char buffer[16384];
+    while (client.fd >= 0) {
+        while (client.sent < client.request.size()) {
+            ssize_t n = send(client.fd, client.request.data() + client.sent, client.request.size() - client.sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                client.sent += n;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)) {
+                return;
+            } else {
+                stats.errors++;
+                restart_client(epoll_fd, client, index, stats);
+                return;
+            }
+        }
+
+        while (client.pending > 0) {
+            ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                client.response.append(buffer, n);
+                size_t length;
+                while (client.pending > 0 && (length = complete_response_length(client.response)) > 0) {
+                    double ms = std::chrono::duration<double, std::milli>(Clock::now() - client.started).count();
+                    stats.latencies_ms.push_back(ms);
+                    stats.completed++;
+                    client.pending--;
+                    client.response.erase(0, length);
+                }
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            } else {
+                stats.errors++;
+                restart_client(epoll_fd, client, index, stats);
+                return;
+            }
+        }
+
+        if (!keep_alive) {
+            restart_client(epoll_fd, client, index, stats);
+            return;
+        }
+        start_batch(client);
+    }
+}
+
+double percentile(std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t idx = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+    return sorted[idx];
+}
+
+// Поток генератора нагрузки: держит свою долю соединений в собственном epoll.
+void run_load_thread(int thread_connections, const std::string& request, BenchStats& stats) {
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return;
+    }
+
+    std::vector<BenchClient> clients(thread_connections);
+    for (int i = 0; i < thread_connections; ++i) {
+        clients[i].request = request;
+        if (!open_connection(epoll_fd, clients[i], i)) {
+            stats.errors++;
+        }
+    }
+
+    std::vector<epoll_event> events(MAX_EVENTS);
+    auto deadline = Clock::now() + std::chrono::seconds(duration_sec);
+
+    while (Clock::now() < deadline) {
+        int n = epoll_wait(epoll_fd, events.data(), MAX_EVENTS, 100);
+        for (int i = 0; i < n; ++i) {
+            int index = events[i].data.u32;
+            drive_client(epoll_fd, clients[index], index, stats);
+        }
+
+        auto now = Clock::now();
+        for (int i = 0; i < thread_connections; ++i) {
+            if (clients[i].fd >= 0 && std::chrono::duration<double>(now - clients[i].started).count() > REQUEST_TIMEOUT_SEC) {
+                stats.timeouts++;
+                restart_client(epoll_fd, clients[i], i, stats);
+            } else if (clients[i].fd < 0) {
+                restart_client(epoll_fd, clients[i], i, stats);
+            }
+        }
+    }
+
+    for (auto& client : clients) close_client(epoll_fd, client);
+    close(epoll_fd);
+}
+
+BenchStats run_benchmark(const std::string& request, double& elapsed) {
+    std::vector<BenchStats> thread_stats(load_threads);
+    std::vector<std::thread> threads;
+    auto bench_start = Clock::now();
+    for (int t = 0; t < load_threads; ++t) {
+        int share = connections / load_threads + (t < connections % load_threads ? 1 : 0);
+        threads.emplace_back(run_load_thread, share, std::cref(request), std::ref(thread_stats[t]));
+    }
+    for (auto& thread : threads) thread.join();
+    elapsed = std::chrono::duration<double>(Clock::now() - bench_start).count();
+
+    BenchStats total;
+    for (auto& stats : thread_stats) {
+        total.completed += stats.completed;
+        total.errors += stats.errors;
+        total.timeouts += stats.timeouts;
+        total.latencies_ms.insert(total.latencies_ms.end(), stats.latencies_ms.begin(), stats.latencies_ms.end());
+    }
+    std::sort(total.latencies_ms.begin(), total.latencies_ms.end());
+    return total;
+}
+
+// Запускает сервер с заданным числом воркеров и ждет, пока он начнет принимать соединения.
+pid_t start_server(const std::string& server_binary, int port, const std::string& engine, int workers) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        std::string port_arg = std::to_string(port);
+        std::string workers_arg = std::to_string(workers);
+        execl(server_binary.c_str(), server_binary.c_str(), port_arg.c_str(), "-q", "--engine", engine.c_str(),
+              "--workers", workers_arg.c_str(), (char*)nullptr);
+        perror("exec failed");
+        _exit(1);
+    }
+
+    for (int attempt = 0; attempt < 50; ++attempt) {
+        usleep(100 * 1000);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        bool ready = connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == 0;
+        close(fd);
+        if (ready) return pid;
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    return -1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: ./webserver_bench <host> <port> [-c connections] [-t threads] [-d seconds] [-p path] "
+                     "[-s slow_clients] [-k] [-P depth] [-S server_binary -w workers_list -E engine_list]" << std::endl;
+        return 1;
+    }
+
+    std::string host = argv[1];
+    int port = std::stoi(argv[2]);
+    int slow_clients = 0;
+    std::string path = "/";
+    std::string server_binary;
+    std::string workers_list = "1,2,4,8";
+    std::string engine_list = "epoll";
+
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-k") keep_alive = true;
+        else if (i + 1 >= argc) break;
+        else if (arg == "-c") connections = std::stoi(argv[++i]);
+        else if (arg == "-t") load_threads = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "-d") duration_sec = std::stoi(argv[++i]);
+        else if (arg == "-p") path = argv[++i];
+        else if (arg == "-s") slow_clients = std::stoi(argv[++i]);
+        else if (arg == "-P") pipeline_depth = std::stoi(argv[++i]);
+        else if (arg == "-S") server_binary = argv[++i];
+        else if (arg == "-w") workers_list = argv[++i];
+        else if (arg == "-E") engine_list = argv[++i];
+    }
+    if (pipeline_depth > 1) keep_alive = true;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &server_addr.sin_addr) != 1) {
+        std::cerr << "Invalid host address: " << host << std::endl;
+        return 1;
+    }
+
+    std::string single_request = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\n"
+                               + (keep_alive ? "" : "Connection: close\r\n") + "\r\n";
+    std::string request;
+    for (int i = 0; i < pipeline_depth; ++i) request += single_request;
+
+    std::cout << std::fixed << std::setprecision(2);
+
+    // Режим сравнения: сервер перезапускается с каждым движком и числом воркеров из списков.
+    // Блокирующий движок однопоточный, поэтому для него берется только первое число воркеров.
+    if (!server_binary.empty()) {
+        std::cout << "\n--- Scaling Benchmark (" << connections << " connections, " << load_threads
+                  << " load threads, keep-alive: " << (keep_alive ? "on" : "off") << ") ---" << std::endl;
+        std::cout << std::setw(10) << "Engine" << std::setw(8) << "Workers" << std::setw(16) << "Requests/sec"
+                  << std::setw(12) << "p50, ms" << std::setw(12) << "p99, ms" << std::setw(10) << "Errors" << std::endl;
+
+        std::istringstream engines(engine_list);
+        std::string engine;
+        while (std::getline(engines, engine, ',')) {
+            std::istringstream list(workers_list);
+            std::string item;
+            while (std::getline(list, item, ',')) {
+                int workers = std::stoi(item);
+                pid_t pid = start_server(server_binary, port, engine, workers);
+                if (pid < 0) {
+                    std::cerr << "Server did not start with engine " << engine << ", " << workers << " workers" << std::endl;
+                    return 1;
+                }
+                double elapsed;
+                BenchStats stats = run_benchmark(request, elapsed);
+                kill(pid, SIGTERM);
+                waitpid(pid, nullptr, 0);
+
+                std::cout << std::setw(10) << engine << std::setw(8) << workers << std::setw(16) << stats.completed / elapsed
+                          << std::setw(12) << percentile(stats.latencies_ms, 50)
+                          << std::setw(12) << percentile(stats.latencies_ms, 99)
+                          << std::setw(10) << stats.errors + stats.timeouts << std::endl;
+                if (engine == "blocking") break;
+            }
+        }
+        return 0;
+    }
+
+    // "Медленные" клиенты подключаются и молчат: так видно, блокирует ли один клиент остальных.
+    std::vector<int> slow_fds;
+    for (int i = 0; i < slow_clients; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == 0) {
+            slow_fds.push_back(fd);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    double elapsed;
+    BenchStats stats = run_benchmark(request, elapsed);
+    for (int fd : slow_fds) close(fd);
+
+    std::cout << "\n--- Benchmark Results ---" << std::endl;
+    std::cout << "Target: http://" << host << ":" << port << path << std::endl;
+    std::cout << "Connections: " << connections << " (+" << slow_fds.size() << " slow), load threads: " << load_threads
+              << ", keep-alive: " << (keep_alive ? "on" : "off") << ", pipeline depth: " << pipeline_depth << std::endl;
+    std::cout << "Duration: " << elapsed << " s" << std::endl;
+    std::cout << "Completed requests: " << stats.completed << std::endl;
+    std::cout << "Errors: " << stats.errors << ", timeouts: " << stats.timeouts << std::endl;
+    std::cout << "Requests/sec: " << stats.completed / elapsed << std::endl;
+    std::cout << "Latency p50: " << percentile(stats.latencies_ms, 50) << " ms" << std::endl;
+    std::cout << "Latency p99: " << percentile(stats.latencies_ms, 99) << " ms" << std::endl;
+    std::cout << "Latency max: " << (stats.latencies_ms.empty() ? 0.0 : stats.latencies_ms.back()) << " ms" << std::endl;
+
+    return 0;
+}